@@ -0,0 +1,219 @@
+/*
+ * bigbench.c - Very large allocations through mm.c
+ *
+ * Checks and times single requests from 1 MiB up to tens of GiB, with
+ * extra sizes straddling the 2 GiB and 4 GiB marks where 32-bit size
+ * arithmetic would wrap. Each request runs on a fresh heap and is served
+ * by the page heap: the time of the mm_malloc (which grows the heap) and
+ * the mm_free is reported, the payload must be page aligned, its first
+ * and last byte are written, and mm_stats must account for exactly the
+ * requested bytes.
+ *
+ * A second phase frees a large span between two others and checks that
+ * a slightly smaller request reuses it without growing the heap, and
+ * that merging the large neighbours leaves a consistent heap. A third
+ * phase asks for more than the break can still provide, so the page
+ * heap continues in a mapped arena, and checks that the arena is
+ * unmapped again once its span is freed.
+ *
+ * The blocks are never filled, so only the pages at their ends are ever
+ * touched; the sizes are bounded by the address space memlib reserves
+ * (MAX_HEAP), not by physical memory. The page provider is chosen with
+ * MM_PAGES (pages.h).
+ */
+#include "config.h"
+#include "memlib.h"
+#include "mm.h"
+#include "timer.h"
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define GiB ((size_t)1 << 30)
+#define MiB ((size_t)1 << 20)
+#define DEFAULT_MAX (64 * GiB)
+#define DEFAULT_REPS 5
+
+static int failures;
+
+static void reset_heap(void) {
+    mem_reset_brk();
+    if (mm_init() < 0) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+}
+
+/* check - count and report a failed expectation */
+static bool check(bool ok, size_t size, const char* what) {
+    if (!ok) {
+        printf("FAILED: %zu bytes: %s\n", size, what);
+        failures++;
+    }
+    return ok;
+}
+
+/*
+ * single - time one request of size bytes on a fresh heap, best of reps;
+ *          false if the request failed or was accounted wrongly
+ */
+static bool single(size_t size, int reps, double* malloc_us, double* free_us) {
+    struct mm_stats s;
+
+    *malloc_us = *free_us = 0;
+    for (int r = 0; r < reps; r++) {
+        reset_heap();
+        uint64_t t0 = now_ns();
+        char* p = mm_malloc(size);
+        uint64_t t1 = now_ns();
+        if (!check(p != NULL, size, "mm_malloc returned NULL") ||
+            !check(((uintptr_t)p & 4095) == 0, size, "the span payload is not page aligned"))
+            return false;
+        p[0] = 1;
+        p[size - 1] = 1;
+        mm_stats(&s);
+        if (!check(s.live_bytes == size, size, "live bytes differ from the request") ||
+            !check(s.alloc_bytes >= size && s.heap_size >= s.alloc_bytes, size,
+                "block is smaller than the request"))
+            return false;
+        uint64_t t2 = now_ns();
+        mm_free(p);
+        uint64_t t3 = now_ns();
+        mm_stats(&s);
+        if (!check(s.live_bytes == 0 && s.alloc_blocks == 0, size, "heap not empty after mm_free"))
+            return false;
+        if (r == 0 || (t1 - t0) / 1e3 < *malloc_us)
+            *malloc_us = (t1 - t0) / 1e3;
+        if (r == 0 || (t3 - t2) / 1e3 < *free_us)
+            *free_us = (t3 - t2) / 1e3;
+    }
+    return true;
+}
+
+/*
+ * reuse - free a large block between two others and allocate into the
+ *         hole; the heap must not grow
+ */
+static void reuse(size_t big) {
+    struct mm_stats s;
+    size_t heap;
+
+    reset_heap();
+    char* a = mm_malloc(big / 4);
+    char* b = mm_malloc(big / 2);
+    char* c = mm_malloc(big / 4);
+    if (!check(a != NULL && b != NULL && c != NULL, big, "reuse: mm_malloc returned NULL"))
+        return;
+    mm_stats(&s);
+    heap = s.heap_size;
+    mm_free(b);
+    b = mm_malloc(big / 2 - MiB);
+    mm_stats(&s);
+    /* a span alone in a mapped arena is unmapped when freed instead */
+    if (heap == mem_heapsize())
+        check(b != NULL && s.heap_size == heap, big / 2 - MiB, "reuse: the freed block was not reused");
+    mm_free(a);
+    mm_free(c);
+    mm_free(b);
+    mm_stats(&s);
+    /* merged, unless they were in mapped arenas, which are unmapped */
+    check(s.alloc_blocks == 0 && (s.largest_free >= big || s.heap_size < big), big,
+        "reuse: spans not merged");
+    check(mm_checkheap_parallel(1) == 0, big, "reuse: heap check failed");
+}
+
+/*
+ * segments - overflow the break into a mapped arena and release it
+ */
+static void segments(void) {
+    size_t half = MAX_HEAP / 2, heap;
+    struct mm_stats s;
+
+    reset_heap();
+    char* a = mm_malloc(half);
+    mm_stats(&s);
+    heap = s.heap_size;
+    char* b = mm_malloc(half);
+    if (!check(a != NULL && b != NULL, half, "segments: mm_malloc returned NULL"))
+        return;
+    b[0] = 1;
+    b[half - 1] = 1;
+    mm_stats(&s);
+    check(s.heap_size > mem_heapsize(), half, "segments: the heap did not leave the break");
+    check(mm_checkheap_parallel(2) == 0, half, "segments: heap check failed");
+    mm_free(b);
+    mm_stats(&s);
+    check(s.heap_size == heap, half, "segments: the mapped arena was not released");
+    mm_free(a);
+    mm_stats(&s);
+    check(s.live_bytes == 0 && s.alloc_blocks == 0, half, "segments: heap not empty after mm_free");
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: bigbench [-h] [-m <GiB>] [-r <reps>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-m <n>     Largest request in GiB (default %zu).\n", DEFAULT_MAX / GiB);
+    fprintf(stderr, "\t-r <n>     Repetitions of each request (default %d).\n", DEFAULT_REPS);
+}
+
+int main(int argc, char** argv) {
+    struct mem_page_stats ps;
+    size_t max = DEFAULT_MAX, sizes[64];
+    int c, n = 0, reps = DEFAULT_REPS;
+
+    while ((c = getopt(argc, argv, "hm:r:")) != EOF) {
+        switch (c) {
+        case 'm':
+            max = strtoull(optarg, NULL, 0) * GiB;
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (max < GiB || max > MAX_HEAP / 2 || reps < 1) {
+        fprintf(stderr, "bigbench: -m must be between 1 and %lu GiB\n", MAX_HEAP / 2 / GiB);
+        exit(1);
+    }
+
+    /* powers of two, and the sizes around the 31 and 32 bit limits */
+    for (size_t s = MiB; s <= max; s *= 2) {
+        if (s == 2 * GiB || s == 4 * GiB) {
+            sizes[n++] = s - 8;
+            sizes[n++] = s;
+            sizes[n++] = s + 8;
+        }
+        else {
+            sizes[n++] = s;
+        }
+    }
+
+    mem_init();
+    printf("%16s %12s %12s\n", "size", "malloc(us)", "free(us)");
+    for (int i = 0; i < n; i++) {
+        double malloc_us, free_us;
+        if (single(sizes[i], reps, &malloc_us, &free_us))
+            printf("%16zu %12.1f %12.1f\n", sizes[i], malloc_us, free_us);
+    }
+    reuse(max);
+    segments();
+    mem_page_stats(&ps);
+    printf("pages from %s: %lu commits, %lu decommits\n", ps.provider, (unsigned long)ps.commits,
+        (unsigned long)ps.decommits);
+    mem_deinit();
+
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * config.h - Configuration for the trace-driven driver and memory model
+ */
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/*
+ * Directory and file names of the default tracefiles. The driver
+ * replays each of these unless -f names a single trace instead.
+ */
+#define TRACEDIR "./traces/"
+#define DEFAULT_TRACEFILES \
+    "short1.rep",          \
+    "binary.rep",          \
+    "coalescing.rep",      \
+    "random.rep",          \
+    "random2.rep",         \
+    "realloc.rep",         \
+    "realloc2.rep"
+
+/*
+ * Reference throughput (ops/sec) used when the driver is not asked to
+ * measure libc malloc on the current machine with -l.
+ */
+#define AVG_LIBC_THRUPUT 10E6
+
+/* Weight of utilization in the performance index (the rest is throughput) */
+#define UTIL_WEIGHT .60
+
+/* Alignment requirement in bytes (checked by the driver) */
+#define ALIGNMENT 8
+
+/* Maximum heap size in bytes; only address space is reserved up front */
+#define MAX_HEAP (1UL << 38)
+
+/* Number of timed replays per trace; the fastest is reported */
+#define NUM_REPS 3
+
+#endif /* CONFIG_H */
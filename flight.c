@@ -0,0 +1,261 @@
+/*
+ * flight.c - Allocation flight recorder for mm.c
+ *
+ * mm.c appends an event for every mm_malloc, mm_free and mm_realloc to
+ * a ring owned by the calling thread (flight.h). A dump writes the
+ * events still held in every ring as a binary trace in the format of
+ * tracefmt.h, so the last moments before a failure can be replayed with
+ * mdriver -f or fed to any other tool that reads traces. Frees of blocks
+ * allocated before the oldest surviving event are dropped by the reader.
+ *
+ * Rings come from mmap and are never unmapped: the ring of an exited
+ * thread keeps its events until a new thread takes it over. Dumping
+ * allocates nothing and uses only async-signal-safe calls, so it can run
+ * from a handler for a fatal signal (mm_flight_dump_on_signal). Threads
+ * keep recording while a dump runs; events overwritten before they are
+ * written out are skipped.
+ */
+#include "flight.h"
+#include "mm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define CHUNK_BYTES 4096 /* bytes of records per chunk written by a dump */
+
+atomic_int flight_on;
+__thread flight_ring_t* flight_ring;
+
+static _Atomic(flight_ring_t*) rings;    /* every ring, newest first */
+static atomic_size_t ring_slots = MM_FLIGHT_EVENTS; /* slots of rings created from now on */
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+static char signal_path[4096];
+
+/*
+ * mm_flight_start - Start recording, keeping the last events (rounded up
+ *                   to a power of two, MM_FLIGHT_EVENTS if 0) of every
+ *                   thread. Returns -1 if mm.c was built without MM_FLIGHT.
+ */
+int mm_flight_start(size_t events) {
+#ifdef MM_FLIGHT
+    size_t slots = 1024;
+    if (events == 0)
+        events = MM_FLIGHT_EVENTS;
+    while (slots < events)
+        slots <<= 1;
+    atomic_store_explicit(&ring_slots, slots, memory_order_relaxed);
+    atomic_store_explicit(&flight_on, 1, memory_order_relaxed);
+    return 0;
+#else
+    (void)events;
+    return -1;
+#endif
+}
+
+/*
+ * mm_flight_stop - Stop recording; the events recorded so far stay in
+ *                  the rings until they are dumped or overwritten
+ */
+void mm_flight_stop(void) {
+    atomic_store_explicit(&flight_on, 0, memory_order_relaxed);
+}
+
+/*
+ * thread_exit - release the ring of an exiting thread to the next
+ *               thread that needs one
+ */
+static void thread_exit(void* arg) {
+    flight_ring_t* r = arg;
+
+    flight_ring = NULL;
+    atomic_store_explicit(&r->exited, 1, memory_order_release);
+}
+
+static void make_exit_key(void) {
+    pthread_key_create(&exit_key, thread_exit);
+}
+
+flight_ring_t* flight_attach(void) {
+    size_t slots = atomic_load_explicit(&ring_slots, memory_order_relaxed);
+    flight_ring_t* r;
+
+    pthread_once(&exit_once, make_exit_key);
+
+    /* take over the ring of an exited thread if there is one */
+    for (r = atomic_load_explicit(&rings, memory_order_acquire); r != NULL; r = r->next) {
+        int exited = 1;
+        if (atomic_compare_exchange_strong(&r->exited, &exited, 0))
+            break;
+    }
+    if (r == NULL) {
+        r = mmap(NULL, sizeof(flight_ring_t) + slots * sizeof(flight_event_t),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (r == MAP_FAILED)
+            return NULL;
+        r->mask = slots - 1;
+        r->next = atomic_load_explicit(&rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&rings, &r->next, r, memory_order_release,
+            memory_order_relaxed))
+            ;
+    }
+    r->tid = syscall(SYS_gettid);
+    pthread_setspecific(exit_key, r);
+    flight_ring = r;
+    return r;
+}
+
+/*
+ * write_all - write a whole buffer, retrying short writes; -1 on error
+ */
+static int write_all(int fd, const uint8_t* p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * write_clock - write a clock chunk pairing the tick counter with time
+ */
+static int write_clock(int fd) {
+    uint8_t hdr[32], * p = hdr;
+    p = put_varint(p, 0);
+    p = put_varint(p, read_ticks());
+    p = put_varint(p, now_ns());
+    return write_all(fd, hdr, p - hdr);
+}
+
+static int write_chunk(int fd, uint64_t tid, uint64_t start, const uint8_t* data, size_t len) {
+    uint8_t hdr[32], * p = hdr;
+    p = put_varint(p, tid);
+    p = put_varint(p, start);
+    p = put_varint(p, len);
+    if (write_all(fd, hdr, p - hdr) < 0)
+        return -1;
+    return write_all(fd, data, len);
+}
+
+/*
+ * write_ring - write the events held in ring r as event chunks, oldest
+ *              first
+ */
+static int write_ring(int fd, flight_ring_t* r) {
+    uint8_t buf[CHUNK_BYTES + TR_RECORD_MAX];
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t slots = r->mask + 1;
+    uint64_t chunk_start = 0, last_ticks = 0;
+    uintptr_t last_addr = 0;
+    size_t len = 0;
+
+    for (uint64_t i = head > slots ? head - slots : 0; i < head; i++) {
+        flight_event_t e = r->events[i & r->mask];
+        /* the owner may have lapped us and overwritten the slot meanwhile;
+           it writes slot i once head reaches i + slots, before it publishes
+           head + 1. The fence keeps the copy above before the load below. */
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&r->head, memory_order_relaxed) - i >= slots)
+            continue;
+
+        int op = e.size_op & 3;
+        if (len == 0) {
+            chunk_start = e.ticks;
+            last_ticks = e.ticks;
+            last_addr = 0;
+        }
+        uint8_t* p = buf + len;
+        *p++ = op;
+        p = put_varint(p, e.ticks > last_ticks ? e.ticks - last_ticks : 0);
+        if (e.ticks > last_ticks)
+            last_ticks = e.ticks;
+        if (op != TR_FREE)
+            p = put_varint(p, e.size_op >> 2);
+        p = put_varint(p, zigzag((int64_t)(e.addr - last_addr)));
+        last_addr = e.addr;
+        if (op == TR_REALLOC) {
+            p = put_varint(p, zigzag((int64_t)(e.newaddr - last_addr)));
+            last_addr = e.newaddr;
+        }
+        len = p - buf;
+        if (len >= CHUNK_BYTES) {
+            if (write_chunk(fd, r->tid, chunk_start, buf, len) < 0)
+                return -1;
+            len = 0;
+        }
+    }
+    return len > 0 ? write_chunk(fd, r->tid, chunk_start, buf, len) : 0;
+}
+
+/*
+ * flight_write - write every ring to fd as a binary trace
+ */
+static int flight_write(int fd) {
+    if (write_all(fd, (const uint8_t*)TRACE_MAGIC, TRACE_MAGIC_LEN) < 0 || write_clock(fd) < 0)
+        return -1;
+    for (flight_ring_t* r = atomic_load_explicit(&rings, memory_order_acquire); r != NULL;
+         r = r->next)
+        if (write_ring(fd, r) < 0)
+            return -1;
+    return write_clock(fd);
+}
+
+/*
+ * mm_flight_dump - Write the recorded events to path as a binary trace;
+ *                  returns -1 if the file cannot be written
+ */
+int mm_flight_dump(const char* path) {
+    int fd, err;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    err = flight_write(fd);
+    return close(fd) == 0 ? err : -1;
+}
+
+/*
+ * dump_on_signal - handler for fatal signals: dump, then die of the
+ *                  signal with its default action
+ */
+static void dump_on_signal(int sig) {
+    int saved = errno;
+    int fd = open(signal_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd >= 0) {
+        flight_write(fd);
+        close(fd);
+    }
+    errno = saved;
+    raise(sig);
+}
+
+/*
+ * mm_flight_dump_on_signal - Dump to path when the process is killed by
+ *                            SIGSEGV, SIGBUS, SIGILL, SIGFPE or SIGABRT
+ */
+int mm_flight_dump_on_signal(const char* path) {
+    static const int fatal[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+    struct sigaction sa;
+
+    if (strlen(path) >= sizeof(signal_path))
+        return -1;
+    strcpy(signal_path, path);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dump_on_signal;
+    sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++)
+        if (sigaction(fatal[i], &sa, NULL) < 0)
+            return -1;
+    return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * flight.h - Allocation flight recorder, internal interface used by mm.c
+ *
+ * Every thread owns a ring of fixed-size events that only it writes, so
+ * recording is a few stores and a release of the ring head with no lock
+ * and no atomic read-modify-write. Once a ring is full the oldest
+ * events are overwritten; a dump holds the last events of every thread.
+ * The recorder is compiled into mm.c with -DMM_FLIGHT and costs nothing
+ * otherwise.
+ *
+ * The public controls (mm_flight_start, mm_flight_stop, mm_flight_dump,
+ * mm_flight_dump_on_signal) are declared in mm.h.
+ */
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include "timer.h"
+#include "tracefmt.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* One recorded request */
+typedef struct {
+    uint64_t ticks;
+    uint64_t size_op;  /* size << 2 | enum trace_record */
+    uintptr_t addr;    /* the block (old block for realloc) */
+    uintptr_t newaddr; /* new block for realloc */
+} flight_event_t;
+
+typedef struct flight_ring {
+    struct flight_ring* next; /* every ring ever created, newest first */
+    _Atomic uint64_t head;    /* events recorded so far */
+    uint64_t mask;            /* slots - 1 */
+    uint64_t tid;             /* kernel thread id of the current owner */
+    atomic_int exited;        /* owner exited; another thread may take it */
+    flight_event_t events[];
+} flight_ring_t;
+
+extern atomic_int flight_on;
+extern __thread flight_ring_t* flight_ring;
+
+/* flight_attach - give the calling thread a ring; NULL if out of memory */
+flight_ring_t* flight_attach(void);
+
+/*
+ * flight_record - append one event to the calling thread's ring while
+ *                 the recorder is on
+ */
+static inline void flight_record(enum trace_record op, size_t size, void* addr, void* newaddr) {
+    flight_ring_t* r;
+
+    if (!atomic_load_explicit(&flight_on, memory_order_relaxed))
+        return;
+    if ((r = flight_ring) == NULL && (r = flight_attach()) == NULL)
+        return;
+    uint64_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    flight_event_t* e = &r->events[h & r->mask];
+    /* keep the writes below after the store of h: a dump that still sees
+       an older head keeps the event this slot held before */
+    atomic_thread_fence(memory_order_release);
+    e->ticks = read_ticks();
+    e->size_op = (uint64_t)size << 2 | op;
+    e->addr = (uintptr_t)addr;
+    e->newaddr = (uintptr_t)newaddr;
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+#endif /* FLIGHT_H */
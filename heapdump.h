@@ -0,0 +1,37 @@
+/*
+ * heapdump.h - Binary heap snapshot format written by mm_heap_dump
+ *
+ * A snapshot is the magic string, a header and one record per block in
+ * address order, all integers as unsigned LEB128 varints (tracefmt.h):
+ *
+ *      header:  <heap start address> <heap size> <offset of first block>
+ *               <number of blocks>
+ *      record:  <size | flags> [<requested bytes>]
+ *
+ * Block sizes are multiples of 8, so the low bits of the first varint
+ * carry the flags. The requested payload size follows only for
+ * allocated blocks. A record of 0 (the epilogue) ends the snapshot.
+ *
+ * A heap of several segments is written as if the segments followed one
+ * another from the heap start: between the blocks of two segments a
+ * record with HD_SEGMENT set gives the bytes of the segment boundary
+ * (an epilogue and a prologue). A block's offset is then the offset of
+ * the first block plus the sizes of all records before it, and the heap
+ * size is the total of the segments. The spans of a page heap arena are
+ * written as blocks; an arena has no prologue or epilogue, only the
+ * padding up to its first page, so its boundary records may be 0 bytes.
+ */
+#ifndef HEAPDUMP_H
+#define HEAPDUMP_H
+
+#include "tracefmt.h"
+
+#define HEAPDUMP_MAGIC "MMHEAP01"
+#define HEAPDUMP_MAGIC_LEN 8
+
+#define HD_ALLOCATED 0x1 /* the block is allocated */
+#define HD_LISTED 0x2    /* the block is on the free list */
+#define HD_SEGMENT 0x4   /* not a block: the boundary between two segments */
+#define HD_FLAGS 0x7
+
+#endif /* HEAPDUMP_H */
@@ -0,0 +1,276 @@
+/*
+ * heapprof.c - Sampling heap profiler for mm.c
+ *
+ * Allocations are sampled by bytes: every thread draws the number of
+ * bytes until its next sample from an exponential distribution with the
+ * configured mean, so a request of s bytes is sampled with probability
+ * 1 - exp(-s/interval) whatever the mix of sizes around it. A sampled
+ * request records its call stack; identical stacks share a bucket that
+ * counts the sampled objects and bytes allocated in total and still in
+ * use. Sampled blocks are remembered by address until mm_free.
+ *
+ * mm_profile_dump writes the buckets in the legacy gperftools heap
+ * profile format ("heap_v2"), which pprof reads directly:
+ *
+ *      pprof -inuse_space mdriver prof.heap    live heap
+ *      pprof -alloc_space mdriver prof.heap    everything allocated
+ *
+ * The counts in the file are the raw samples; pprof scales them back up
+ * using the sampling interval recorded in the header.
+ *
+ * The profiler's own tables come from the libc allocator and are guarded
+ * by prof_lock, which is only taken for sampled blocks.
+ */
+#include "heapprof.h"
+#include "mm.h"
+#include "rng.h"
+#include <execinfo.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_DEPTH 32           /* frames kept per stack */
+#define SKIP_FRAMES 2          /* heapprof_sample and mm_malloc */
+#define NUM_BUCKETS 4096       /* hash chains of the stack table */
+#define RECHECK_BYTES (1 << 20) /* bytes between checks while profiling is off */
+
+/* Samples that share a call stack */
+typedef struct bucket {
+    struct bucket* next; /* hash chain */
+    uint64_t hash;
+    int depth;
+    void* pcs[MAX_DEPTH];
+    uint64_t alloc_objs;  /* sampled objects allocated */
+    uint64_t alloc_bytes;
+    uint64_t inuse_objs;  /* sampled objects not yet freed */
+    uint64_t inuse_bytes;
+} bucket_t;
+
+/* A sampled block that has not been freed */
+typedef struct {
+    uintptr_t payload; /* 0 marks an empty slot */
+    size_t size;
+    bucket_t* bucket;
+} live_t;
+
+static atomic_size_t interval; /* mean bytes between samples, 0 when off */
+static size_t period;          /* the interval of the samples taken, for the dump */
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static bucket_t* buckets[NUM_BUCKETS];
+static live_t* live;     /* open-addressing table of sampled blocks */
+static size_t live_mask; /* slots - 1 */
+static size_t num_live;
+static __thread rng_t rng;
+static __thread bool rng_seeded;
+
+/*
+ * mm_profile_start - Start sampling, on average once every interval
+ *                    bytes allocated (MM_PROFILE_INTERVAL if 0)
+ */
+void mm_profile_start(size_t bytes) {
+    period = bytes ? bytes : MM_PROFILE_INTERVAL;
+    atomic_store_explicit(&interval, period, memory_order_relaxed);
+}
+
+/*
+ * mm_profile_stop - Stop taking new samples; the ones taken so far stay
+ *                   in the profile until their blocks are freed
+ */
+void mm_profile_stop(void) {
+    atomic_store_explicit(&interval, 0, memory_order_relaxed);
+}
+
+/*
+ * next_countdown - bytes until the calling thread's next sample
+ */
+static int64_t next_countdown(size_t mean) {
+    if (!rng_seeded) {
+        rng_seed(&rng, (uintptr_t)&rng ^ (uintptr_t)pthread_self());
+        rng_seeded = true;
+    }
+    return 1 + (int64_t)rng_exponential(&rng, (double)mean);
+}
+
+static size_t live_find(uintptr_t payload) {
+    size_t i = (payload * 0x9e3779b97f4a7c15ULL >> 17) & live_mask;
+    while (live[i].payload != 0 && live[i].payload != payload)
+        i = (i + 1) & live_mask;
+    return i;
+}
+
+/*
+ * live_remove - delete the entry in slot i, shifting later entries of the
+ *               same probe run back so lookups stay correct
+ */
+static void live_remove(size_t i) {
+    size_t j = i;
+    for (;;) {
+        live[i].payload = 0;
+        for (;;) {
+            j = (j + 1) & live_mask;
+            if (live[j].payload == 0)
+                return;
+            size_t home = (live[j].payload * 0x9e3779b97f4a7c15ULL >> 17) & live_mask;
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+                continue;
+            break;
+        }
+        live[i] = live[j];
+        i = j;
+    }
+}
+
+/*
+ * live_grow - double the table of sampled blocks; false if out of memory
+ */
+static bool live_grow(void) {
+    size_t old_slots = live ? live_mask + 1 : 0;
+    size_t slots = old_slots ? 2 * old_slots : 1024;
+    live_t* old = live;
+
+    if ((live = calloc(slots, sizeof(live_t))) == NULL) {
+        live = old;
+        return false;
+    }
+    live_mask = slots - 1;
+    for (size_t i = 0; i < old_slots; i++)
+        if (old[i].payload != 0)
+            live[live_find(old[i].payload)] = old[i];
+    free(old);
+    return true;
+}
+
+/*
+ * find_bucket - the bucket of a call stack, created if it is new
+ */
+static bucket_t* find_bucket(void** pcs, int depth) {
+    uint64_t h = depth;
+    bucket_t* b;
+
+    for (int i = 0; i < depth; i++)
+        h = (h ^ (uintptr_t)pcs[i]) * 0x100000001b3ULL;
+    for (b = buckets[h % NUM_BUCKETS]; b != NULL; b = b->next)
+        if (b->hash == h && b->depth == depth && memcmp(b->pcs, pcs, depth * sizeof(void*)) == 0)
+            return b;
+    if ((b = calloc(1, sizeof(bucket_t))) == NULL)
+        return NULL;
+    b->hash = h;
+    b->depth = depth;
+    memcpy(b->pcs, pcs, depth * sizeof(void*));
+    b->next = buckets[h % NUM_BUCKETS];
+    buckets[h % NUM_BUCKETS] = b;
+    return b;
+}
+
+bool heapprof_sample(void* payload, size_t size, int64_t* countdown) {
+    size_t mean = atomic_load_explicit(&interval, memory_order_relaxed);
+    void* pcs[MAX_DEPTH + SKIP_FRAMES];
+    bool sampled = false;
+    int depth;
+
+    if (mean == 0) {
+        *countdown = RECHECK_BYTES;
+        return false;
+    }
+    *countdown = next_countdown(mean);
+
+    /* the stack is captured before taking the lock */
+    depth = backtrace(pcs, MAX_DEPTH + SKIP_FRAMES) - SKIP_FRAMES;
+    if (depth < 0)
+        depth = 0;
+
+    pthread_mutex_lock(&prof_lock);
+    bucket_t* b = find_bucket(pcs + SKIP_FRAMES, depth);
+    if (b != NULL && (2 * (num_live + 1) <= (live ? live_mask + 1 : 0) || live_grow())) {
+        size_t i = live_find((uintptr_t)payload);
+        live[i].payload = (uintptr_t)payload;
+        live[i].size = size;
+        live[i].bucket = b;
+        num_live++;
+        b->alloc_objs++;
+        b->alloc_bytes += size;
+        b->inuse_objs++;
+        b->inuse_bytes += size;
+        sampled = true;
+    }
+    pthread_mutex_unlock(&prof_lock);
+    return sampled;
+}
+
+void heapprof_forget(void* payload) {
+    pthread_mutex_lock(&prof_lock);
+    if (live != NULL) {
+        size_t i = live_find((uintptr_t)payload);
+        if (live[i].payload != 0) {
+            live[i].bucket->inuse_objs--;
+            live[i].bucket->inuse_bytes -= live[i].size;
+            live_remove(i);
+            num_live--;
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+void heapprof_reset(void) {
+    pthread_mutex_lock(&prof_lock);
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        while (buckets[i] != NULL) {
+            bucket_t* next = buckets[i]->next;
+            free(buckets[i]);
+            buckets[i] = next;
+        }
+    }
+    if (live != NULL)
+        memset(live, 0, (live_mask + 1) * sizeof(live_t));
+    num_live = 0;
+    pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+ * mm_profile_dump - Write the live and cumulative profile to path in the
+ *                   gperftools heap profile format; returns -1 if the
+ *                   file cannot be written
+ */
+int mm_profile_dump(const char* path) {
+    uint64_t totals[4] = { 0, 0, 0, 0 };
+    FILE* fp, * maps;
+    char line[4096];
+    int i;
+
+    if ((fp = fopen(path, "w")) == NULL)
+        return -1;
+    pthread_mutex_lock(&prof_lock);
+    for (i = 0; i < NUM_BUCKETS; i++) {
+        for (bucket_t* b = buckets[i]; b != NULL; b = b->next) {
+            totals[0] += b->inuse_objs;
+            totals[1] += b->inuse_bytes;
+            totals[2] += b->alloc_objs;
+            totals[3] += b->alloc_bytes;
+        }
+    }
+    fprintf(fp, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%zu\n", (unsigned long)totals[0],
+        (unsigned long)totals[1], (unsigned long)totals[2], (unsigned long)totals[3],
+        period ? period : (size_t)MM_PROFILE_INTERVAL);
+    for (i = 0; i < NUM_BUCKETS; i++) {
+        for (bucket_t* b = buckets[i]; b != NULL; b = b->next) {
+            fprintf(fp, "%lu: %lu [%lu: %lu] @", (unsigned long)b->inuse_objs,
+                (unsigned long)b->inuse_bytes, (unsigned long)b->alloc_objs,
+                (unsigned long)b->alloc_bytes);
+            for (int d = 0; d < b->depth; d++)
+                fprintf(fp, " %p", b->pcs[d]);
+            fprintf(fp, "\n");
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+    /* pprof symbolizes the addresses with the mappings of this process */
+    fprintf(fp, "\nMAPPED_LIBRARIES:\n");
+    if ((maps = fopen("/proc/self/maps", "r")) != NULL) {
+        while (fgets(line, sizeof(line), maps) != NULL)
+            fputs(line, fp);
+        fclose(maps);
+    }
+    return fclose(fp) == 0 ? 0 : -1;
+}
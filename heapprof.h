@@ -0,0 +1,37 @@
+/*
+ * heapprof.h - Sampling heap profiler, internal interface used by mm.c
+ *
+ * mm.c counts the bytes each thread allocates down from a random,
+ * exponentially distributed interval and calls heapprof_sample when the
+ * count runs out. The block is marked in its header beforehand, under
+ * the heap lock, so mm_free knows to call heapprof_forget; a marked
+ * block that heapprof_sample did not record is simply not found there.
+ * Everything else in here runs only for sampled blocks, so at the
+ * default interval the cost on the allocation path is one thread-local
+ * subtraction and a branch.
+ *
+ * The public controls (mm_profile_start, mm_profile_stop,
+ * mm_profile_dump) are declared in mm.h.
+ */
+#ifndef HEAPPROF_H
+#define HEAPPROF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * heapprof_sample - the calling thread's sample counter ran out during a
+ *                   request of size bytes. Records payload if profiling
+ *                   is on and returns true if it did; *countdown is set
+ *                   to the bytes until the thread's next sample.
+ */
+bool heapprof_sample(void* payload, size_t size, int64_t* countdown);
+
+/* heapprof_forget - a sampled block is being freed */
+void heapprof_forget(void* payload);
+
+/* heapprof_reset - the heap was discarded by mm_init; drop all samples */
+void heapprof_reset(void);
+
+#endif /* HEAPPROF_H */
@@ -0,0 +1,350 @@
+/*
+ * heapview.c - Render and compare heap snapshots from mm_heap_dump
+ *
+ *     heapview show a.snap         summary, fragmentation map and free
+ *                                  block size histogram
+ *     heapview diff a.snap b.snap  what changed from a to b
+ *
+ * The fragmentation map divides the heap into equal cells, one character
+ * each, shaded by the share of the cell's bytes that are free:
+ *
+ *      '#' under 10%   '+' under 40%   '-' under 70%   '.' under 100%
+ *      ' ' all free    '!' holds a free block missing from the free list
+ *
+ * In a diff each cell shows whether it got fuller ('<'), emptier ('>')
+ * or stayed within 5% ('='); cells beyond the end of the smaller heap
+ * are shaded as in the larger one. A heap of several segments is drawn
+ * as if the segments followed one another.
+ *
+ * Snapshots are read as a stream, so even the dump of a very large heap
+ * needs only the memory of the map.
+ */
+#include "heapdump.h"
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_WIDTH 64
+#define DEFAULT_ROWS 32
+#define NUM_BUCKETS 40 /* free size histogram: powers of two */
+
+/* What a snapshot says about the heap */
+typedef struct {
+    uint64_t heap_lo, heap_size;
+    uint64_t blocks;
+    uint64_t segments; /* boundaries between heap segments */
+    uint64_t alloc_blocks, alloc_bytes, requested;
+    uint64_t free_blocks, free_bytes, largest_free;
+    uint64_t unlisted; /* free blocks missing from the free list */
+    uint64_t hist_count[NUM_BUCKETS];
+    uint64_t hist_bytes[NUM_BUCKETS];
+    int ncells;
+    uint64_t cell_size;
+    uint64_t* cell_free; /* free bytes in each cell */
+    bool* cell_bad;      /* cell holds an unlisted free block */
+} snapshot_t;
+
+static int width = DEFAULT_WIDTH, rows = DEFAULT_ROWS;
+
+static uint64_t read_varint(FILE* fp, const char* name) {
+    uint64_t v = 0;
+    int shift = 0, c;
+
+    while ((c = getc_unlocked(fp)) != EOF && shift < 64) {
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return v;
+        shift += 7;
+    }
+    fprintf(stderr, "%s: truncated snapshot\n", name);
+    exit(1);
+}
+
+/*
+ * add_free - spread a free range over the cells it overlaps
+ */
+static void add_free(snapshot_t* s, uint64_t offset, uint64_t size, bool bad) {
+    uint64_t end = offset + size;
+
+    while (offset < end) {
+        uint64_t cell = offset / s->cell_size;
+        uint64_t cell_end = (cell + 1) * s->cell_size;
+        uint64_t n = (end < cell_end ? end : cell_end) - offset;
+        if (cell >= (uint64_t)s->ncells)
+            break;
+        s->cell_free[cell] += n;
+        if (bad)
+            s->cell_bad[cell] = true;
+        offset += n;
+    }
+}
+
+/*
+ * open_snapshot - open a snapshot and read its header
+ */
+static FILE* open_snapshot(const char* name, snapshot_t* s, uint64_t* first) {
+    char magic[HEAPDUMP_MAGIC_LEN];
+    FILE* fp;
+
+    if ((fp = fopen(name, "rb")) == NULL) {
+        fprintf(stderr, "Could not open %s\n", name);
+        exit(1);
+    }
+    if (fread(magic, 1, HEAPDUMP_MAGIC_LEN, fp) != HEAPDUMP_MAGIC_LEN ||
+        memcmp(magic, HEAPDUMP_MAGIC, HEAPDUMP_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s is not a heap snapshot\n", name);
+        exit(1);
+    }
+    memset(s, 0, sizeof(*s));
+    s->heap_lo = read_varint(fp, name);
+    s->heap_size = read_varint(fp, name);
+    *first = read_varint(fp, name);
+    s->blocks = read_varint(fp, name);
+    return fp;
+}
+
+/*
+ * read_snapshot - read a snapshot, dividing span bytes (at least the
+ *                 heap size) into the cells of the map
+ */
+static void read_snapshot(const char* name, snapshot_t* s, uint64_t span) {
+    uint64_t offset, v;
+    FILE* fp = open_snapshot(name, s, &offset);
+
+    if (span < s->heap_size)
+        span = s->heap_size;
+    s->ncells = width * rows;
+    s->cell_size = (span + s->ncells - 1) / s->ncells;
+    if (s->cell_size == 0)
+        s->cell_size = 1;
+    s->cell_free = calloc(s->ncells, sizeof(uint64_t));
+    s->cell_bad = calloc(s->ncells, sizeof(bool));
+    if (s->cell_free == NULL || s->cell_bad == NULL) {
+        fprintf(stderr, "calloc failed in read_snapshot\n");
+        exit(1);
+    }
+
+    while ((v = read_varint(fp, name)) != 0) {
+        uint64_t size = v & ~(uint64_t)HD_FLAGS;
+        if (v & HD_SEGMENT) {
+            s->segments++;
+        }
+        else if (v & HD_ALLOCATED) {
+            s->alloc_blocks++;
+            s->alloc_bytes += size;
+            s->requested += read_varint(fp, name);
+        }
+        else {
+            int b = 63 - __builtin_clzll(size);
+            bool listed = v & HD_LISTED;
+            s->free_blocks++;
+            s->free_bytes += size;
+            if (size > s->largest_free)
+                s->largest_free = size;
+            if (!listed)
+                s->unlisted++;
+            s->hist_count[b < NUM_BUCKETS ? b : NUM_BUCKETS - 1]++;
+            s->hist_bytes[b < NUM_BUCKETS ? b : NUM_BUCKETS - 1] += size;
+            add_free(s, offset, size, !listed);
+        }
+        offset += size;
+    }
+    fclose(fp);
+    if (s->alloc_blocks + s->free_blocks != s->blocks)
+        fprintf(stderr, "%s: %lu blocks announced, %lu found\n", name, (unsigned long)s->blocks,
+            (unsigned long)(s->alloc_blocks + s->free_blocks));
+}
+
+static void free_snapshot(snapshot_t* s) {
+    free(s->cell_free);
+    free(s->cell_bad);
+}
+
+/* human - format a byte count with a binary unit */
+static const char* human(uint64_t bytes, char* buf, size_t n) {
+    static const char* units[] = { "B", "K", "M", "G", "T" };
+    double v = bytes;
+    int u = 0;
+
+    while (v >= 1024 && u < 4) {
+        v /= 1024;
+        u++;
+    }
+    snprintf(buf, n, u ? "%.1f%s" : "%.0f%s", v, units[u]);
+    return buf;
+}
+
+static char shade(const snapshot_t* s, int cell) {
+    uint64_t start = (uint64_t)cell * s->cell_size;
+    uint64_t len = s->cell_size;
+    double f;
+
+    if (start >= s->heap_size)
+        return ' ';
+    if (start + len > s->heap_size)
+        len = s->heap_size - start;
+    if (s->cell_bad[cell])
+        return '!';
+    f = (double)s->cell_free[cell] / len;
+    return f < 0.1 ? '#' : f < 0.4 ? '+' : f < 0.7 ? '-' : f < 1.0 ? '.' : ' ';
+}
+
+static void print_summary(const char* name, const snapshot_t* s) {
+    char b1[32], b2[32], b3[32], b4[32];
+
+    printf("%s: heap %s at 0x%lx, %lu blocks", name, human(s->heap_size, b1, sizeof(b1)),
+        (unsigned long)s->heap_lo, (unsigned long)s->blocks);
+    if (s->segments > 0)
+        printf(" in %lu segments", (unsigned long)s->segments + 1);
+    printf("\n");
+    printf("  allocated %s in %lu blocks, %s requested (%s headers, footers and padding)\n",
+        human(s->alloc_bytes, b1, sizeof(b1)), (unsigned long)s->alloc_blocks,
+        human(s->requested, b2, sizeof(b2)), human(s->alloc_bytes - s->requested, b3, sizeof(b3)));
+    printf("  free %s in %lu blocks, largest %s, fragmentation %.1f%%, utilization %.1f%%\n",
+        human(s->free_bytes, b1, sizeof(b1)), (unsigned long)s->free_blocks,
+        human(s->largest_free, b4, sizeof(b4)),
+        s->free_bytes ? 100.0 * (1.0 - (double)s->largest_free / s->free_bytes) : 0,
+        s->heap_size ? 100.0 * s->requested / s->heap_size : 0);
+    if (s->unlisted > 0)
+        printf("  WARNING: %lu free blocks are not on the free list\n", (unsigned long)s->unlisted);
+}
+
+static void print_map(const snapshot_t* a, const snapshot_t* b) {
+    char buf[32];
+
+    for (int r = 0; r < rows; r++) {
+        printf("%8s |", human((uint64_t)r * width * a->cell_size, buf, sizeof(buf)));
+        for (int c = r * width; c < (r + 1) * width; c++) {
+            if (b == NULL) {
+                putchar(shade(a, c));
+                continue;
+            }
+            uint64_t start = (uint64_t)c * a->cell_size;
+            if (start >= a->heap_size || start >= b->heap_size) {
+                putchar(shade(start < a->heap_size ? a : b, c));
+                continue;
+            }
+            double d = ((double)b->cell_free[c] - (double)a->cell_free[c]) / a->cell_size;
+            putchar(d > 0.05 ? '>' : d < -0.05 ? '<' : '=');
+        }
+        printf("|\n");
+    }
+    printf("%8s  one cell = %s\n", "", human(a->cell_size, buf, sizeof(buf)));
+}
+
+static void print_histogram(const snapshot_t* s) {
+    uint64_t most = 0;
+    char lo[32], bytes[32];
+
+    for (int i = 0; i < NUM_BUCKETS; i++)
+        if (s->hist_bytes[i] > most)
+            most = s->hist_bytes[i];
+    printf("%10s %10s %10s\n", "free size", "blocks", "bytes");
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        if (s->hist_count[i] == 0)
+            continue;
+        int bar = most ? (int)(40.0 * s->hist_bytes[i] / most + 0.5) : 0;
+        printf("%9s+ %10lu %10s ", human(1ULL << i, lo, sizeof(lo)),
+            (unsigned long)s->hist_count[i], human(s->hist_bytes[i], bytes, sizeof(bytes)));
+        for (int k = 0; k < bar; k++)
+            putchar('*');
+        printf("\n");
+    }
+}
+
+static void print_diff(const snapshot_t* a, const snapshot_t* b) {
+    char b0[32], b1[32], b2[32];
+
+    printf("%-14s %12s %12s %12s\n", "", "before", "after", "change");
+#define ROW(label, field) \
+    printf("%-14s %12lu %12lu %+12ld\n", label, (unsigned long)a->field, (unsigned long)b->field, \
+        (long)(b->field - a->field))
+    ROW("heap bytes", heap_size);
+    ROW("alloc blocks", alloc_blocks);
+    ROW("alloc bytes", alloc_bytes);
+    ROW("requested", requested);
+    ROW("free blocks", free_blocks);
+    ROW("free bytes", free_bytes);
+    ROW("largest free", largest_free);
+#undef ROW
+    printf("\n%10s %10s %10s %10s\n", "free size", "blocks", "before", "after");
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        if (a->hist_count[i] == 0 && b->hist_count[i] == 0)
+            continue;
+        printf("%9s+ %+10ld %10s %10s\n", human(1ULL << i, b0, sizeof(b0)),
+            (long)(b->hist_count[i] - a->hist_count[i]), human(a->hist_bytes[i], b1, sizeof(b1)),
+            human(b->hist_bytes[i], b2, sizeof(b2)));
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: heapview [-h] [-w <width>] [-r <rows>] show <snapshot>\n"
+                    "       heapview [-h] [-w <width>] [-r <rows>] diff <before> <after>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-r <n>     Rows of the fragmentation map (default %d).\n", DEFAULT_ROWS);
+    fprintf(stderr, "\t-w <n>     Cells per row of the map (default %d).\n", DEFAULT_WIDTH);
+}
+
+int main(int argc, char** argv) {
+    snapshot_t a, b;
+    int c;
+
+    while ((c = getopt(argc, argv, "hr:w:")) != EOF) {
+        switch (c) {
+        case 'r':
+            rows = atoi(optarg);
+            break;
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (width < 1 || rows < 1 || argc < 2) {
+        usage();
+        exit(1);
+    }
+
+    if (strcmp(argv[0], "show") == 0 && argc == 2) {
+        read_snapshot(argv[1], &a, 0);
+        print_summary(argv[1], &a);
+        printf("\n");
+        print_map(&a, NULL);
+        printf("\n");
+        print_histogram(&a);
+        free_snapshot(&a);
+    }
+    else if (strcmp(argv[0], "diff") == 0 && argc == 3) {
+        /* both maps use the cells of the larger heap so they line up */
+        uint64_t first, span;
+        fclose(open_snapshot(argv[1], &a, &first));
+        fclose(open_snapshot(argv[2], &b, &first));
+        span = a.heap_size > b.heap_size ? a.heap_size : b.heap_size;
+        read_snapshot(argv[1], &a, span);
+        read_snapshot(argv[2], &b, span);
+        print_summary(argv[1], &a);
+        print_summary(argv[2], &b);
+        printf("\n");
+        print_map(&a, &b);
+        printf("\n");
+        print_diff(&a, &b);
+        free_snapshot(&a);
+        free_snapshot(&b);
+    }
+    else {
+        usage();
+        exit(1);
+    }
+    return 0;
+}
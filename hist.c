@@ -0,0 +1,54 @@
+/*
+ * hist.c - Queries on HDR-style histograms
+ */
+#include "hist.h"
+#include <string.h>
+
+void hist_reset(hist_t* h) {
+    memset(h, 0, sizeof(hist_t));
+}
+
+/*
+ * hist_merge - add the counts of src to dst
+ */
+void hist_merge(hist_t* dst, const hist_t* src) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/*
+ * hist_bucket_high - largest value that falls into bucket index
+ */
+uint64_t hist_bucket_high(int index) {
+    if (index < 2 * HIST_SUB)
+        return index;
+    int shift = index / HIST_SUB - 1;
+    uint64_t sub = index % HIST_SUB + HIST_SUB;
+    return ((sub + 1) << shift) - 1;
+}
+
+/*
+ * hist_percentile - smallest bucket bound that at least pct percent of
+ *                   the recorded values do not exceed (capped at max)
+ */
+uint64_t hist_percentile(const hist_t* h, double pct) {
+    uint64_t rank, seen = 0;
+
+    if (h->total == 0)
+        return 0;
+    rank = (uint64_t)(pct / 100.0 * h->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t high = hist_bucket_high(i);
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
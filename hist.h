@@ -0,0 +1,47 @@
+/*
+ * hist.h - HDR-style log-linear latency histograms
+ *
+ * Values below 64 get a bucket each; above that every power of two is
+ * split into 32 equal sub-buckets, so any recorded value is known to
+ * within about 3% while the whole 64-bit range fits in 1920 counters.
+ * Recording is a handful of instructions and never allocates.
+ */
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total; /* number of recorded values */
+    uint64_t sum;   /* sum of recorded values */
+    uint64_t max;   /* largest recorded value */
+} hist_t;
+
+/* hist_index - bucket that value v falls into */
+static inline int hist_index(uint64_t v) {
+    if (v < 2 * HIST_SUB)
+        return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) - HIST_SUB);
+}
+
+static inline void hist_record(hist_t* h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+void hist_reset(hist_t* h);
+void hist_merge(hist_t* dst, const hist_t* src);
+uint64_t hist_bucket_high(int index);
+uint64_t hist_percentile(const hist_t* h, double pct);
+
+#endif /* HIST_H */
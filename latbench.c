@@ -0,0 +1,237 @@
+/*
+ * latbench.c - Tail latency of individual allocator requests
+ *
+ * Replays traces and times every single request with the tick counter,
+ * recording the latencies in HDR-style histograms kept separately for
+ * each request type and size class. Averages hide the requests that
+ * walk a long free list in find_fit or have to extend the heap; the
+ * p99.9, p99.99 and max columns show them.
+ *
+ * With -i the histograms mm.c keeps itself when built with MM_LATENCY
+ * are printed as well: the time spent inside each call, the number of
+ * free blocks find_fit looked at, and the time taken by extend_heap.
+ */
+#include "config.h"
+#include "hist.h"
+#include "memlib.h"
+#include "mm.h"
+#include "timer.h"
+#include "trace.h"
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_REPS 10 /* replays of every trace */
+#define NUM_CLASSES 6
+
+/* upper bounds (bytes) of the size classes; the last one is open */
+static const size_t class_limits[NUM_CLASSES - 1] = { 64, 512, 4096, 32768, 262144 };
+static const char* class_names[NUM_CLASSES] = {
+    "<=64", "<=512", "<=4K", "<=32K", "<=256K", ">256K"
+};
+static const char* op_names[] = { "malloc", "free", "realloc" };
+
+static hist_t hists[3][NUM_CLASSES]; /* indexed by traceop type and size class */
+
+static int size_class(size_t size) {
+    int c = 0;
+    while (c < NUM_CLASSES - 1 && size > class_limits[c])
+        c++;
+    return c;
+}
+
+/*
+ * replay - replay a trace once, timing every request
+ */
+static void replay(trace_t* trace, char** blocks, size_t* sizes, bool use_libc) {
+    for (int i = 0; i < trace->num_ops; i++) {
+        traceop_t* op = &trace->ops[i];
+        uint64_t start, end;
+        size_t size = op->size;
+
+        switch (op->type) {
+        case ALLOC:
+            start = read_ticks();
+            blocks[op->index] = use_libc ? malloc(size) : mm_malloc(size);
+            end = read_ticks();
+            sizes[op->index] = size;
+            break;
+        case REALLOC:
+            start = read_ticks();
+            blocks[op->index] = use_libc ? realloc(blocks[op->index], size)
+                                         : mm_realloc(blocks[op->index], size);
+            end = read_ticks();
+            sizes[op->index] = size;
+            break;
+        case FREE:
+        default:
+            size = sizes[op->index];
+            start = read_ticks();
+            if (use_libc)
+                free(blocks[op->index]);
+            else
+                mm_free(blocks[op->index]);
+            end = read_ticks();
+            blocks[op->index] = NULL;
+            break;
+        }
+        hist_record(&hists[op->type][size_class(size)], end - start);
+    }
+}
+
+/*
+ * timer_overhead - median ticks between two back-to-back reads
+ */
+static uint64_t timer_overhead(void) {
+    hist_t* h = calloc(1, sizeof(hist_t));
+    uint64_t median;
+
+    if (h == NULL) {
+        fprintf(stderr, "calloc failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < 100000; i++) {
+        uint64_t t = read_ticks();
+        hist_record(h, read_ticks() - t);
+    }
+    median = hist_percentile(h, 50);
+    free(h);
+    return median;
+}
+
+static void print_row(const char* op, const char* class, const hist_t* h, double rate) {
+    printf("%-8s %-7s %10lu %8.0f %8.0f %8.0f %8.0f %8.0f %10.0f\n", op, class,
+        (unsigned long)h->total, h->sum / rate / h->total,
+        hist_percentile(h, 50) / rate, hist_percentile(h, 99) / rate,
+        hist_percentile(h, 99.9) / rate, hist_percentile(h, 99.99) / rate, h->max / rate);
+}
+
+/*
+ * print_internal - the latency histograms kept inside mm.c
+ */
+static void print_internal(double rate) {
+    static const char* names[MM_LAT_NUM] = { "malloc", "free", "realloc", "fit", "extend" };
+    hist_t h;
+
+    if (mm_latency(MM_LAT_MALLOC, &h) < 0) {
+        printf("\nmm.c has no latency histograms; rebuild with make clean; make MM_LATENCY=1\n");
+        return;
+    }
+    printf("\nmm.c internal; latencies in ns, fit in free blocks scanned\n");
+    printf("%-8s %-7s %10s %8s %8s %8s %8s %8s %10s\n", "op", "", "count", "mean", "p50", "p99",
+        "p99.9", "p99.99", "max");
+    for (int op = 0; op < MM_LAT_NUM; op++) {
+        mm_latency(op, &h);
+        if (h.total > 0)
+            print_row(names[op], "", &h, op == MM_LAT_FIT_SCAN ? 1.0 : rate);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: latbench [-hil] [-f <file>] [-r <reps>] [-t <dir>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-i         Also print mm.c's internal histograms (MM_LATENCY).\n");
+    fprintf(stderr, "\t-l         Measure libc malloc instead of mm.c.\n");
+    fprintf(stderr, "\t-r <n>     Replays of each trace (default %d).\n", DEFAULT_REPS);
+    fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+}
+
+int main(int argc, char** argv) {
+    static const char* default_tracefiles[] = { DEFAULT_TRACEFILES, NULL };
+    const char* tracedir = TRACEDIR;
+    const char* const* names = default_tracefiles;
+    const char* single[2] = { NULL, NULL };
+    char path[4096];
+    bool use_libc = false, internal = false;
+    int c, reps = DEFAULT_REPS;
+
+    while ((c = getopt(argc, argv, "f:hilr:t:")) != EOF) {
+        switch (c) {
+        case 'f':
+            single[0] = optarg;
+            names = single;
+            tracedir = "";
+            break;
+        case 'i':
+            internal = true;
+            break;
+        case 'l':
+            use_libc = true;
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 't':
+            if (names != single)
+                tracedir = optarg;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (reps < 1) {
+        usage();
+        exit(1);
+    }
+
+    mem_init();
+    for (int t = 0; names[t] != NULL; t++) {
+        snprintf(path, sizeof(path), "%s%s", tracedir, names[t]);
+        trace_t* trace = read_trace(path);
+        char** blocks = calloc(trace->num_ids, sizeof(char*));
+        size_t* sizes = calloc(trace->num_ids, sizeof(size_t));
+        if (blocks == NULL || sizes == NULL) {
+            fprintf(stderr, "calloc failed\n");
+            exit(1);
+        }
+        for (int r = 0; r < reps; r++) {
+            if (!use_libc) {
+                mem_reset_brk();
+                if (mm_init() < 0) {
+                    fprintf(stderr, "mm_init failed\n");
+                    exit(1);
+                }
+            }
+            replay(trace, blocks, sizes, use_libc);
+            /* release what the trace left allocated */
+            for (int i = 0; i < trace->num_ids; i++) {
+                if (use_libc)
+                    free(blocks[i]);
+                blocks[i] = NULL;
+            }
+        }
+        free(blocks);
+        free(sizes);
+        free_trace(trace);
+    }
+    mem_deinit();
+
+    double rate = ticks_per_ns();
+    printf("%s, %d replays; latencies in ns, timer overhead %.0f ns included\n",
+        use_libc ? "libc" : "mm", reps, timer_overhead() / rate);
+    printf("%-8s %-7s %10s %8s %8s %8s %8s %8s %10s\n", "op", "class", "count", "mean", "p50",
+        "p99", "p99.9", "p99.99", "max");
+    for (int op = ALLOC; op <= REALLOC; op++) {
+        hist_t all;
+        hist_reset(&all);
+        for (int k = 0; k < NUM_CLASSES; k++) {
+            if (hists[op][k].total == 0)
+                continue;
+            print_row(op_names[op], class_names[k], &hists[op][k], rate);
+            hist_merge(&all, &hists[op][k]);
+        }
+        if (all.total > 0)
+            print_row(op_names[op], "all", &all, rate);
+    }
+    if (internal && !use_libc)
+        print_internal(rate);
+    return 0;
+}
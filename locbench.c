@@ -0,0 +1,591 @@
+/*
+ * locbench.c - Application locality benchmark
+ *
+ * The other benchmarks time the allocator itself; this one times the
+ * program using the memory it hands out. Each benchmark builds a linked
+ * data structure through the allocator:
+ *
+ *      list        singly linked list, walked front to back
+ *      tree        unbalanced binary search tree, walked in order
+ *      tree/find   the same tree, searched for every key in random order
+ *      hash        chained hash table grown by realloc of its bucket
+ *                  array, searched for every key in random order
+ *
+ * and times the traversal twice: once on the freshly built structure and
+ * once after aging the heap, i.e. after -a rounds in which half of the
+ * nodes are moved to a new block (malloc, copy, free, or realloc to a
+ * larger size) while unrelated filler blocks are allocated in between and
+ * half of them freed again. Besides ns per visited node it reports what
+ * the placement did to locality:
+ *
+ *      density     node bytes / bytes of the cache lines holding them;
+ *                  block headers, footers and padding lower it even on
+ *                  a fresh heap
+ *      nodes/page  distinct nodes per distinct 4K page touched
+ *      near        visits within 4K of the node visited before
+ *
+ * Each run uses mm.c with every placement policy and libc malloc.
+ */
+#include "memlib.h"
+#include "mm.h"
+#include "rng.h"
+#include "timer.h"
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_NODES 100000
+#define DEFAULT_ROUNDS 3 /* aging rounds */
+#define DEFAULT_REPS 5   /* timed traversals, the fastest is reported */
+#define LINE_SIZE 64
+#define PAGE_SIZE 4096
+
+/* The malloc package the structures are built with */
+typedef struct {
+    const char* name;
+    void* (*malloc)(size_t size);
+    void (*free)(void* ptr);
+    void* (*realloc)(void* ptr, size_t size);
+    int fit; /* mm.c placement policy, -1 for libc */
+} allocator_t;
+
+/* One benchmark: a structure and a way of traversing it */
+typedef struct {
+    const char* name;
+    size_t node_size;
+    void (*build)(void);
+    void (*age)(rng_t* r);
+    size_t (*traverse)(void** trail); /* returns the number of nodes visited */
+    void (*destroy)(void);
+} structure_t;
+
+typedef struct lnode {
+    struct lnode* next;
+    uint64_t key;
+} lnode_t;
+
+typedef struct tnode {
+    struct tnode* left;
+    struct tnode* right;
+    uint64_t key;
+} tnode_t;
+
+typedef struct hnode {
+    struct hnode* next;
+    uint64_t key;
+} hnode_t;
+
+static const allocator_t* A;
+static size_t nnodes = DEFAULT_NODES;
+static size_t extra; /* payload bytes added to every node */
+static uint64_t* keys;
+static uint64_t* lookup_order;
+static volatile uint64_t sink; /* keeps the traversals from being optimized out */
+
+static lnode_t* list_head;
+static tnode_t* tree_root;
+static hnode_t** buckets;
+static size_t nbuckets;
+
+static void** fillers;
+static size_t nfillers, max_fillers;
+
+static void* xalloc(size_t size) {
+    void* p = A->malloc(size);
+    if (p == NULL) {
+        fprintf(stderr, "%s malloc(%zu) failed\n", A->name, size);
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * move_node - give a node a new block, as an application does when it
+ *             replaces or grows an object; an unrelated filler block is
+ *             allocated now and then so the new block lands elsewhere
+ */
+static void* move_node(void* old, size_t size, rng_t* r) {
+    void* p;
+
+    if (rng_range(r, 0, 3) == 0) {
+        if (nfillers == max_fillers) {
+            max_fillers = max_fillers ? 2 * max_fillers : 4096;
+            if ((fillers = realloc(fillers, max_fillers * sizeof(void*))) == NULL) {
+                fprintf(stderr, "realloc failed in move_node\n");
+                exit(1);
+            }
+        }
+        fillers[nfillers++] = xalloc(rng_range(r, 16, 512));
+    }
+    if (rng_range(r, 0, 7) == 0) {
+        if ((p = A->realloc(old, 2 * size)) == NULL) {
+            fprintf(stderr, "%s realloc(%zu) failed\n", A->name, 2 * size);
+            exit(1);
+        }
+        return p;
+    }
+    p = xalloc(size);
+    memcpy(p, old, size);
+    A->free(old);
+    return p;
+}
+
+/*
+ * free_fillers - free a random half of the filler blocks, leaving holes
+ *                between the nodes
+ */
+static void free_fillers(rng_t* r) {
+    size_t kept = 0;
+
+    for (size_t i = 0; i < nfillers; i++) {
+        if (rng_range(r, 0, 1) == 0)
+            A->free(fillers[i]);
+        else
+            fillers[kept++] = fillers[i];
+    }
+    nfillers = kept;
+}
+
+/*
+ * Linked list
+ */
+
+static void list_build(void) {
+    lnode_t** link = &list_head;
+
+    for (size_t i = 0; i < nnodes; i++) {
+        lnode_t* n = xalloc(sizeof(lnode_t) + extra);
+        n->key = keys[i];
+        *link = n;
+        link = &n->next;
+    }
+    *link = NULL;
+}
+
+static void list_age(rng_t* r) {
+    for (lnode_t** link = &list_head; *link != NULL; link = &(*link)->next)
+        if (rng_range(r, 0, 1) == 0)
+            *link = move_node(*link, sizeof(lnode_t) + extra, r);
+}
+
+static size_t list_traverse(void** trail) {
+    uint64_t sum = 0;
+    size_t n = 0;
+
+    for (lnode_t* p = list_head; p != NULL; p = p->next) {
+        if (trail != NULL)
+            trail[n] = p;
+        sum += p->key;
+        n++;
+    }
+    sink = sum;
+    return n;
+}
+
+static void list_destroy(void) {
+    while (list_head != NULL) {
+        lnode_t* next = list_head->next;
+        A->free(list_head);
+        list_head = next;
+    }
+}
+
+/*
+ * Binary search tree
+ */
+
+static void tree_build(void) {
+    tree_root = NULL;
+    for (size_t i = 0; i < nnodes; i++) {
+        tnode_t** link = &tree_root;
+        while (*link != NULL)
+            link = keys[i] < (*link)->key ? &(*link)->left : &(*link)->right;
+        tnode_t* n = xalloc(sizeof(tnode_t) + extra);
+        n->left = n->right = NULL;
+        n->key = keys[i];
+        *link = n;
+    }
+}
+
+static void tree_age_subtree(tnode_t** link, rng_t* r) {
+    if (*link == NULL)
+        return;
+    if (rng_range(r, 0, 1) == 0)
+        *link = move_node(*link, sizeof(tnode_t) + extra, r);
+    tree_age_subtree(&(*link)->left, r);
+    tree_age_subtree(&(*link)->right, r);
+}
+
+static void tree_age(rng_t* r) {
+    tree_age_subtree(&tree_root, r);
+}
+
+static size_t tree_walk(const tnode_t* t, void** trail, size_t n, uint64_t* sum) {
+    while (t != NULL) {
+        n = tree_walk(t->left, trail, n, sum);
+        if (trail != NULL)
+            trail[n] = (void*)t;
+        *sum += t->key;
+        n++;
+        t = t->right;
+    }
+    return n;
+}
+
+static size_t tree_traverse(void** trail) {
+    uint64_t sum = 0;
+    size_t n = tree_walk(tree_root, trail, 0, &sum);
+    sink = sum;
+    return n;
+}
+
+static size_t tree_find(void** trail) {
+    uint64_t found = 0;
+    size_t n = 0;
+
+    for (size_t i = 0; i < nnodes; i++) {
+        uint64_t key = lookup_order[i];
+        const tnode_t* t = tree_root;
+        while (t != NULL && t->key != key) {
+            if (trail != NULL)
+                trail[n] = (void*)t;
+            n++;
+            t = key < t->key ? t->left : t->right;
+        }
+        if (t != NULL) {
+            if (trail != NULL)
+                trail[n] = (void*)t;
+            n++;
+            found++;
+        }
+    }
+    sink = found;
+    return n;
+}
+
+static void tree_destroy_subtree(tnode_t* t) {
+    while (t != NULL) {
+        tnode_t* right = t->right;
+        tree_destroy_subtree(t->left);
+        A->free(t);
+        t = right;
+    }
+}
+
+static void tree_destroy(void) {
+    tree_destroy_subtree(tree_root);
+    tree_root = NULL;
+}
+
+/*
+ * Chained hash table
+ */
+
+static size_t hash(uint64_t key) {
+    return (key * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+/*
+ * hash_grow - double the bucket array in place and split every chain
+ */
+static void hash_grow(void) {
+    size_t old = nbuckets;
+
+    nbuckets = old ? 2 * old : 16;
+    if (buckets == NULL)
+        buckets = xalloc(nbuckets * sizeof(hnode_t*));
+    else if ((buckets = A->realloc(buckets, nbuckets * sizeof(hnode_t*))) == NULL) {
+        fprintf(stderr, "%s realloc of the bucket array failed\n", A->name);
+        exit(1);
+    }
+    memset(buckets + old, 0, (nbuckets - old) * sizeof(hnode_t*));
+    for (size_t b = 0; b < old; b++) {
+        hnode_t** link = &buckets[b];
+        while (*link != NULL) {
+            hnode_t* n = *link;
+            size_t to = hash(n->key) & (nbuckets - 1);
+            if (to != b) {
+                *link = n->next;
+                n->next = buckets[to];
+                buckets[to] = n;
+            }
+            else {
+                link = &n->next;
+            }
+        }
+    }
+}
+
+static void hash_build(void) {
+    buckets = NULL;
+    nbuckets = 0;
+    hash_grow();
+    for (size_t i = 0; i < nnodes; i++) {
+        if (i == nbuckets)
+            hash_grow();
+        hnode_t* n = xalloc(sizeof(hnode_t) + extra);
+        size_t b = hash(keys[i]) & (nbuckets - 1);
+        n->key = keys[i];
+        n->next = buckets[b];
+        buckets[b] = n;
+    }
+}
+
+static void hash_age(rng_t* r) {
+    for (size_t b = 0; b < nbuckets; b++)
+        for (hnode_t** link = &buckets[b]; *link != NULL; link = &(*link)->next)
+            if (rng_range(r, 0, 1) == 0)
+                *link = move_node(*link, sizeof(hnode_t) + extra, r);
+}
+
+static size_t hash_find(void** trail) {
+    uint64_t found = 0;
+    size_t n = 0;
+
+    for (size_t i = 0; i < nnodes; i++) {
+        uint64_t key = lookup_order[i];
+        for (const hnode_t* p = buckets[hash(key) & (nbuckets - 1)]; p != NULL; p = p->next) {
+            if (trail != NULL)
+                trail[n] = (void*)p;
+            n++;
+            if (p->key == key) {
+                found++;
+                break;
+            }
+        }
+    }
+    sink = found;
+    return n;
+}
+
+static void hash_destroy(void) {
+    for (size_t b = 0; b < nbuckets; b++) {
+        while (buckets[b] != NULL) {
+            hnode_t* next = buckets[b]->next;
+            A->free(buckets[b]);
+            buckets[b] = next;
+        }
+    }
+    A->free(buckets);
+    buckets = NULL;
+    nbuckets = 0;
+}
+
+/*
+ * Locality measurements
+ */
+
+static int compare_addr(const void* a, const void* b) {
+    uintptr_t x = *(const uintptr_t*)a, y = *(const uintptr_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* count_distinct - sort v[0..n) and return the number of distinct values */
+static size_t count_distinct(uintptr_t* v, size_t n) {
+    size_t d = 0;
+
+    qsort(v, n, sizeof(uintptr_t), compare_addr);
+    for (size_t i = 0; i < n; i++)
+        if (i == 0 || v[i] != v[i - 1])
+            d++;
+    return d;
+}
+
+/*
+ * measure_locality - replay one traversal recording the nodes it visits
+ *                    and compute the density, nodes/page and near columns
+ */
+static void measure_locality(const structure_t* s, size_t max_visits, double* density,
+    double* per_page, double* near) {
+    void** trail = malloc(max_visits * sizeof(void*));
+    uintptr_t* v = malloc(2 * max_visits * sizeof(uintptr_t));
+    size_t n, nodes, lines, pages, close = 0, nv = 0;
+
+    if (trail == NULL || v == NULL) {
+        fprintf(stderr, "malloc failed in measure_locality\n");
+        exit(1);
+    }
+    n = s->traverse(trail);
+    for (size_t i = 1; i < n; i++) {
+        intptr_t d = (char*)trail[i] - (char*)trail[i - 1];
+        if (d > -PAGE_SIZE && d < PAGE_SIZE)
+            close++;
+    }
+
+    for (size_t i = 0; i < n; i++)
+        v[i] = (uintptr_t)trail[i];
+    nodes = count_distinct(v, n);
+
+    /* a node can straddle two lines; count every line it covers */
+    for (size_t i = 0; i < n; i++) {
+        uintptr_t first = (uintptr_t)trail[i] / LINE_SIZE;
+        uintptr_t last = ((uintptr_t)trail[i] + s->node_size - 1) / LINE_SIZE;
+        for (uintptr_t l = first; l <= last && nv < 2 * max_visits; l++)
+            v[nv++] = l;
+    }
+    lines = count_distinct(v, nv);
+
+    for (size_t i = 0; i < n; i++)
+        v[i] = (uintptr_t)trail[i] / PAGE_SIZE;
+    pages = count_distinct(v, n);
+
+    *density = lines ? (double)nodes * s->node_size / (lines * LINE_SIZE) : 0;
+    *per_page = pages ? (double)nodes / pages : 0;
+    *near = n > 1 ? (double)close / (n - 1) : 0;
+    free(trail);
+    free(v);
+}
+
+/*
+ * time_traversal - fastest of reps traversals in ns per visited node
+ */
+static double time_traversal(const structure_t* s, int reps, size_t* visits) {
+    double best = 0;
+
+    for (int i = 0; i < reps; i++) {
+        uint64_t start = now_ns();
+        *visits = s->traverse(NULL);
+        double ns = (double)(now_ns() - start) / *visits;
+        if (i == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+static void report(const structure_t* s, const char* heap, int reps) {
+    size_t visits = 0;
+    double ns = time_traversal(s, reps, &visits);
+    double density, per_page, near;
+
+    measure_locality(s, visits, &density, &per_page, &near);
+    printf("%-10s %-9s %-6s %9.2f %7.1f%% %11.1f %6.1f%%\n", s->name, A->name, heap, ns,
+        density * 100.0, per_page, near * 100.0);
+    fflush(stdout);
+}
+
+static void reset_allocator(void) {
+    if (A->fit < 0)
+        return;
+    struct mm_config config = { A->fit, 32, 1 << 16 };
+    mem_reset_brk();
+    if (mm_configure(&config) < 0 || mm_init() < 0) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: locbench [-h] [-n <nodes>] [-a <rounds>] [-r <reps>] [-s <bytes>]\n"
+                    "                [-S <seed>] [benchmark]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-a <n>     Aging rounds before the second traversal (default %d).\n",
+        DEFAULT_ROUNDS);
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-n <n>     Nodes in every structure (default %d).\n", DEFAULT_NODES);
+    fprintf(stderr, "\t-r <n>     Timed traversals, the fastest counts (default %d).\n",
+        DEFAULT_REPS);
+    fprintf(stderr, "\t-s <n>     Extra payload bytes per node (default 0).\n");
+    fprintf(stderr, "\t-S <seed>  Random seed.\n");
+}
+
+int main(int argc, char** argv) {
+    static const allocator_t allocators[] = {
+        { "mm-first", mm_malloc, mm_free, mm_realloc, MM_FIRST_FIT },
+        { "mm-next", mm_malloc, mm_free, mm_realloc, MM_NEXT_FIT },
+        { "mm-best", mm_malloc, mm_free, mm_realloc, MM_BEST_FIT },
+        { "libc", malloc, free, realloc, -1 },
+    };
+    structure_t structures[] = {
+        { "list", sizeof(lnode_t), list_build, list_age, list_traverse, list_destroy },
+        { "tree", sizeof(tnode_t), tree_build, tree_age, tree_traverse, tree_destroy },
+        { "tree/find", sizeof(tnode_t), tree_build, tree_age, tree_find, tree_destroy },
+        { "hash", sizeof(hnode_t), hash_build, hash_age, hash_find, hash_destroy },
+    };
+    const char* only = NULL;
+    int c, rounds = DEFAULT_ROUNDS, reps = DEFAULT_REPS;
+    uint64_t seed = 1;
+    rng_t r;
+
+    while ((c = getopt(argc, argv, "a:hn:r:s:S:")) != EOF) {
+        switch (c) {
+        case 'a':
+            rounds = atoi(optarg);
+            break;
+        case 'n':
+            nnodes = (size_t)strtod(optarg, NULL);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 's':
+            extra = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (optind < argc)
+        only = argv[optind];
+    if (nnodes < 1 || rounds < 0 || reps < 1) {
+        usage();
+        exit(1);
+    }
+
+    keys = malloc(nnodes * sizeof(uint64_t));
+    lookup_order = malloc(nnodes * sizeof(uint64_t));
+    if (keys == NULL || lookup_order == NULL) {
+        fprintf(stderr, "malloc failed in main\n");
+        exit(1);
+    }
+    rng_seed(&r, seed);
+    for (size_t i = 0; i < nnodes; i++)
+        keys[i] = lookup_order[i] = rng_next(&r);
+    for (size_t i = nnodes - 1; i > 0; i--) {
+        size_t j = rng_range(&r, 0, i);
+        uint64_t t = lookup_order[i];
+        lookup_order[i] = lookup_order[j];
+        lookup_order[j] = t;
+    }
+
+    mem_init();
+    printf("%zu nodes, %zu extra bytes per node, %d aging rounds\n", nnodes, extra, rounds);
+    printf("%-10s %-9s %-6s %9s %8s %11s %7s\n", "benchmark", "alloc", "heap", "ns/node",
+        "density", "nodes/page", "near");
+    for (size_t i = 0; i < sizeof(structures) / sizeof(structures[0]); i++) {
+        structure_t* s = &structures[i];
+        if (only != NULL && strcmp(only, s->name) != 0)
+            continue;
+        s->node_size += extra;
+        for (size_t k = 0; k < sizeof(allocators) / sizeof(allocators[0]); k++) {
+            A = &allocators[k];
+            reset_allocator();
+            rng_seed(&r, seed);
+            s->build();
+            report(s, "fresh", reps);
+            for (int a = 0; a < rounds; a++) {
+                s->age(&r);
+                free_fillers(&r);
+            }
+            report(s, "aged", reps);
+            s->destroy();
+            for (size_t f = 0; f < nfillers; f++)
+                A->free(fillers[f]);
+            nfillers = 0;
+        }
+    }
+    mem_deinit();
+    free(keys);
+    free(lookup_order);
+    free(fillers);
+    return 0;
+}
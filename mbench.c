@@ -0,0 +1,673 @@
+/*
+ * mbench.c - Microbenchmarks for the hot paths of mm.c
+ *
+ * Each benchmark sets up a heap in a known shape (untimed) and then
+ * times a batch of requests that exercise one path of the allocator:
+ *
+ *      find_fit        malloc that walks n too-small free blocks
+ *      place/split     malloc carved from the front of a large free block
+ *      place/exact     malloc that takes a free block without splitting
+ *      coalesce/1..4   free with each of the four neighbour combinations
+ *      extend_heap     malloc that always has to grow the heap
+ *      span            malloc and free of page heap spans, grown beforehand
+ *      span/realloc    realloc that grows a span in place by one page
+ *      hooks           workload/fixed/lifo/warm with counting hooks set
+ *
+ * followed by whole workloads that allocate n blocks drawn from a size
+ * distribution (fixed, uniform, power-law, bimodal) and free them in
+ * LIFO, FIFO or random order, on a cold (fresh) or warm (already grown
+ * and fragmented) heap.
+ *
+ * Every benchmark is repeated and reported as ns/op with a 95%
+ * confidence interval. -c prints CSV; -b compares against a CSV from an
+ * earlier run and exits with status 2 if any benchmark got slower by
+ * more than the two confidence intervals allow. -p also counts cycles,
+ * instructions, cache, TLB and branch misses per request in the timed
+ * part of each benchmark, where perf events are permitted.
+ */
+#include "memlib.h"
+#include "mm.h"
+#include "perfctr.h"
+#include "rng.h"
+#include "timer.h"
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_BLOCKS 4000 /* blocks per benchmark batch */
+#define DEFAULT_REPS 15     /* repetitions of each benchmark */
+#define SMALL 64            /* payload size used by the hot path benchmarks */
+#define EXTEND_REQUEST 60000 /* a block just under the page heap's SPAN_MIN in mm.c */
+#define EXTEND_CHUNK (EXTEND_REQUEST + 16) /* its block size with header and footer */
+#define SPAN_REQUEST (1 << 18) /* served by the page heap of mm.c */
+#define MAX_NAME 64
+
+enum dist { FIXED, UNIFORM, POWERLAW, BIMODAL };
+enum order { LIFO, FIFO, RANDOM };
+
+static const char* dist_names[] = { "fixed", "uniform", "powerlaw", "bimodal" };
+static const char* order_names[] = { "lifo", "fifo", "random" };
+
+/* Parameters of one benchmark */
+typedef struct bench {
+    char name[MAX_NAME];
+    /* runs one batch and returns its elapsed ns and number of requests */
+    uint64_t (*fn)(const struct bench* b, size_t* ops);
+    enum dist dist;
+    enum order order;
+    bool warm;
+} bench_t;
+
+/* Summary of the repetitions of one benchmark */
+typedef struct {
+    double mean; /* ns/op */
+    double ci;   /* half-width of the 95% confidence interval */
+    double min;
+    double stddev;
+    double counts[PC_NUM_EVENTS]; /* hardware events per request */
+} result_t;
+
+static size_t nblocks = DEFAULT_BLOCKS;
+static int reps = DEFAULT_REPS;
+static uint64_t seed = 1;
+static char** ptrs;
+static size_t* sizes;
+static size_t* order;
+static bool use_counters;
+static perfctr_t counters;
+
+/*
+ * begin_timed, end_timed - bracket the measured part of a benchmark
+ */
+static uint64_t begin_timed(void) {
+    if (use_counters)
+        perfctr_start(&counters);
+    return now_ns();
+}
+
+static uint64_t end_timed(uint64_t start) {
+    uint64_t ns = now_ns() - start;
+    if (use_counters)
+        perfctr_stop(&counters);
+    return ns;
+}
+
+/*
+ * reset_heap - start over with an empty heap
+ */
+static void reset_heap(void) {
+    mem_reset_brk();
+    if (mm_init() < 0) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+}
+
+static void* xmm_malloc(size_t size) {
+    void* p = mm_malloc(size);
+    if (p == NULL) {
+        fprintf(stderr, "mm_malloc(%zu) failed\n", size);
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * big_block, free_big - allocate at least size bytes as a row of adjacent
+ *                       blocks, each too small for the page heap, and
+ *                       free them again, which coalesces them into one
+ *                       free block
+ */
+static void** big_block(size_t size) {
+    size_t n = size / EXTEND_REQUEST + 1;
+    void** pieces = malloc((n + 1) * sizeof(void*));
+
+    if (pieces == NULL) {
+        fprintf(stderr, "malloc failed in big_block\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < n; i++)
+        pieces[i] = xmm_malloc(EXTEND_REQUEST);
+    pieces[n] = NULL;
+    return pieces;
+}
+
+static void free_big(void** pieces) {
+    for (size_t i = 0; pieces[i] != NULL; i++)
+        mm_free(pieces[i]);
+    free(pieces);
+}
+
+/*
+ * expect_free - exit unless the heap has a free block of at least largest
+ *               bytes and no more than max_blocks free blocks, the shape
+ *               a benchmark relies on
+ */
+static void expect_free(const char* name, size_t largest, size_t max_blocks) {
+    struct mm_stats s;
+
+    mm_stats(&s);
+    if (s.largest_free < largest || s.free_blocks > max_blocks) {
+        fprintf(stderr, "%s: expected a %zu byte free block among at most %zu, got %zu among %zu\n",
+            name, largest, max_blocks, s.largest_free, s.free_blocks);
+        exit(1);
+    }
+}
+
+/*
+ * Hot path benchmarks
+ */
+
+static uint64_t bench_find_fit(const bench_t* b, size_t* ops) {
+    size_t i;
+
+    /* a large free block at the tail of the free list, n small ones in front */
+    reset_heap();
+    void** big = big_block((SMALL + 32) * nblocks);
+    xmm_malloc(16);
+    for (i = 0; i < nblocks; i++) {
+        ptrs[i] = xmm_malloc(SMALL / 2);
+        xmm_malloc(16);
+    }
+    free_big(big);
+    for (i = 0; i < nblocks; i++)
+        mm_free(ptrs[i]);
+    expect_free(b->name, (SMALL + 32) * nblocks, nblocks + 2);
+
+    uint64_t start = begin_timed();
+    for (i = 0; i < nblocks; i++)
+        xmm_malloc(SMALL);
+    *ops = nblocks;
+    return end_timed(start);
+}
+
+static uint64_t bench_place_split(const bench_t* b, size_t* ops) {
+    size_t i;
+
+    reset_heap();
+    free_big(big_block((SMALL + 32) * nblocks));
+    expect_free(b->name, (SMALL + 32) * nblocks, 1);
+
+    uint64_t start = begin_timed();
+    for (i = 0; i < nblocks; i++)
+        xmm_malloc(SMALL);
+    *ops = nblocks;
+    return end_timed(start);
+}
+
+static uint64_t bench_place_exact(const bench_t* b, size_t* ops) {
+    size_t i;
+
+    reset_heap();
+    for (i = 0; i < nblocks; i++) {
+        ptrs[i] = xmm_malloc(SMALL);
+        xmm_malloc(16);
+    }
+    for (i = 0; i < nblocks; i++)
+        mm_free(ptrs[i]);
+
+    uint64_t start = begin_timed();
+    for (i = 0; i < nblocks; i++)
+        xmm_malloc(SMALL);
+    *ops = nblocks;
+    return end_timed(start);
+}
+
+/*
+ * setup_row - allocate n adjacent blocks between two guard blocks so
+ *             that every free has a known pair of neighbours
+ */
+static void setup_row(void) {
+    reset_heap();
+    xmm_malloc(16);
+    for (size_t i = 0; i < nblocks; i++)
+        ptrs[i] = xmm_malloc(SMALL);
+    xmm_malloc(16);
+}
+
+/* case 1: both neighbours allocated */
+static uint64_t bench_coalesce1(const bench_t* b, size_t* ops) {
+    setup_row();
+    uint64_t start = begin_timed();
+    for (size_t i = 0; i < nblocks; i += 2)
+        mm_free(ptrs[i]);
+    *ops = (nblocks + 1) / 2;
+    return end_timed(start);
+}
+
+/* case 2: next block free (free from the top of the row down) */
+static uint64_t bench_coalesce2(const bench_t* b, size_t* ops) {
+    setup_row();
+    uint64_t start = begin_timed();
+    for (size_t i = nblocks; i-- > 0;)
+        mm_free(ptrs[i]);
+    *ops = nblocks;
+    return end_timed(start);
+}
+
+/* case 3: previous block free (free from the bottom of the row up) */
+static uint64_t bench_coalesce3(const bench_t* b, size_t* ops) {
+    setup_row();
+    uint64_t start = begin_timed();
+    for (size_t i = 0; i < nblocks; i++)
+        mm_free(ptrs[i]);
+    *ops = nblocks;
+    return end_timed(start);
+}
+
+/* case 4: both neighbours free (free the odd blocks, then time the even ones) */
+static uint64_t bench_coalesce4(const bench_t* b, size_t* ops) {
+    setup_row();
+    for (size_t i = 1; i < nblocks; i += 2)
+        mm_free(ptrs[i]);
+    uint64_t start = begin_timed();
+    for (size_t i = 0; i < nblocks; i += 2)
+        mm_free(ptrs[i]);
+    *ops = (nblocks + 1) / 2;
+    return end_timed(start);
+}
+
+/*
+ * bench_extend_heap - with the growth step set to exactly one block, no
+ *                     remainder is left behind to build up into a fit,
+ *                     so every request extends the heap
+ */
+static uint64_t bench_extend_heap(const bench_t* b, size_t* ops) {
+    static const struct mm_config exact = { MM_FIRST_FIT, 32, EXTEND_CHUNK };
+    static const struct mm_config defaults = { MM_FIRST_FIT, 32, 1 << 16 };
+    /* bounded so the batch fits in the simulated heap */
+    size_t n = nblocks < 2000 ? nblocks : 2000;
+    struct mm_stats before, after;
+
+    if (mm_configure(&exact) < 0) {
+        fprintf(stderr, "%s: mm_configure failed\n", b->name);
+        exit(1);
+    }
+    reset_heap();
+    xmm_malloc(EXTEND_REQUEST); /* takes the initial heap */
+    mm_stats(&before);
+    uint64_t start = begin_timed();
+    for (size_t i = 0; i < n; i++)
+        xmm_malloc(EXTEND_REQUEST);
+    uint64_t elapsed = end_timed(start);
+    mm_stats(&after);
+    mm_configure(&defaults);
+    if (after.extends - before.extends != n) {
+        fprintf(stderr, "%s: %lu of %zu requests extended the heap\n", b->name,
+            (unsigned long)(after.extends - before.extends), n);
+        exit(1);
+    }
+    *ops = n;
+    return elapsed;
+}
+
+static uint64_t bench_span(const bench_t* b, size_t* ops) {
+    size_t n = nblocks < 1000 ? nblocks : 1000;
+    size_t i;
+
+    reset_heap();
+    for (i = 0; i < n; i++)
+        ptrs[i] = xmm_malloc(SPAN_REQUEST);
+    for (i = 0; i < n; i++)
+        mm_free(ptrs[i]);
+    uint64_t start = begin_timed();
+    for (i = 0; i < n; i++)
+        ptrs[i] = xmm_malloc(SPAN_REQUEST);
+    for (i = n; i-- > 0;)
+        mm_free(ptrs[i]);
+    *ops = 2 * n;
+    return end_timed(start);
+}
+
+static uint64_t bench_span_realloc(const bench_t* b, size_t* ops) {
+    char* p;
+
+    reset_heap();
+    p = xmm_malloc(SPAN_REQUEST);
+    uint64_t start = begin_timed();
+    for (size_t i = 1; i <= nblocks; i++)
+        p = mm_realloc(p, SPAN_REQUEST + i * 4096);
+    *ops = nblocks;
+    return end_timed(start);
+}
+
+/*
+ * Workload benchmarks
+ */
+
+static size_t draw_size(rng_t* r, enum dist d) {
+    switch (d) {
+    case FIXED:
+        return SMALL;
+    case UNIFORM:
+        return rng_range(r, 1, 4096);
+    case POWERLAW:
+        return rng_pareto(r, 16, 1 << 20, 1.2);
+    case BIMODAL:
+    default:
+        return rng_double(r) < 0.8 ? rng_range(r, 16, 64) : rng_range(r, 1024, 4096);
+    }
+}
+
+/*
+ * prepare_workload - draw the sizes and the free order for a workload
+ */
+static void prepare_workload(const bench_t* b) {
+    rng_t r;
+    size_t i;
+
+    rng_seed(&r, seed);
+    for (i = 0; i < nblocks; i++)
+        sizes[i] = draw_size(&r, b->dist);
+    for (i = 0; i < nblocks; i++)
+        order[i] = (b->order == LIFO) ? nblocks - 1 - i : i;
+    if (b->order == RANDOM) {
+        for (i = nblocks - 1; i > 0; i--) {
+            size_t j = rng_next(&r) % (i + 1);
+            size_t t = order[i];
+            order[i] = order[j];
+            order[j] = t;
+        }
+    }
+}
+
+static void run_workload(void) {
+    size_t i;
+    for (i = 0; i < nblocks; i++)
+        ptrs[i] = xmm_malloc(sizes[i]);
+    for (i = 0; i < nblocks; i++)
+        mm_free(ptrs[order[i]]);
+}
+
+static uint64_t bench_workload(const bench_t* b, size_t* ops) {
+    prepare_workload(b);
+    reset_heap();
+    if (b->warm)
+        run_workload();
+
+    uint64_t start = begin_timed();
+    run_workload();
+    *ops = 2 * nblocks;
+    return end_timed(start);
+}
+
+/* byte counts kept by the hooks of bench_hooks */
+static void count_malloc(size_t size, void* payload, void* arg) {
+    if (payload != NULL)
+        *(size_t*)arg += size;
+}
+
+static void count_free(void* payload, size_t size, void* arg) {
+    *(size_t*)arg -= size;
+}
+
+static uint64_t bench_hooks(const bench_t* b, size_t* ops) {
+    static size_t live;
+    static const struct mm_hooks counting = {
+        .malloc_post = count_malloc, .free_pre = count_free, .arg = &live
+    };
+    bench_t w = { .dist = FIXED, .order = LIFO, .warm = true };
+    uint64_t ns;
+
+    mm_set_hooks(&counting);
+    ns = bench_workload(&w, ops);
+    mm_set_hooks(NULL);
+    return ns;
+}
+
+/*
+ * Statistics and reporting
+ */
+
+/* two-sided 95% Student t quantiles for 1..30 degrees of freedom */
+static const double t95[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+static result_t run_bench(const bench_t* b) {
+    double* samples = malloc(reps * sizeof(double));
+    result_t res;
+    size_t ops, total_ops = 0;
+    int i;
+
+    memset(&res, 0, sizeof(res));
+    perfctr_reset(&counters);
+
+    if (samples == NULL) {
+        fprintf(stderr, "malloc failed in run_bench\n");
+        exit(1);
+    }
+    for (i = 0; i < reps; i++) {
+        uint64_t ns = b->fn(b, &ops);
+        samples[i] = (double)ns / ops;
+        total_ops += ops;
+        res.mean += samples[i];
+        if (i == 0 || samples[i] < res.min)
+            res.min = samples[i];
+    }
+    res.mean /= reps;
+    if (reps > 1) {
+        double var = 0;
+        for (i = 0; i < reps; i++)
+            var += (samples[i] - res.mean) * (samples[i] - res.mean);
+        res.stddev = sqrt(var / (reps - 1));
+        res.ci = (reps - 1 <= 30 ? t95[reps - 2] : 1.96) * res.stddev / sqrt(reps);
+    }
+    for (i = 0; i < PC_NUM_EVENTS; i++)
+        res.counts[i] = (double)counters.values[i] / total_ops;
+    free(samples);
+    return res;
+}
+
+/* A benchmark result read from a baseline CSV file */
+typedef struct {
+    char name[MAX_NAME];
+    double mean;
+    double ci;
+} baseline_t;
+
+static baseline_t* read_baseline(const char* path, int* count) {
+    FILE* fp = fopen(path, "r");
+    baseline_t* base = NULL;
+    char line[256];
+    int n = 0, cap = 0;
+
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open baseline %s\n", path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        baseline_t b;
+        if (sscanf(line, "%63[^,],%lf,%lf", b.name, &b.mean, &b.ci) != 3)
+            continue; /* header line */
+        if (n == cap) {
+            cap = cap ? 2 * cap : 64;
+            if ((base = realloc(base, cap * sizeof(baseline_t))) == NULL) {
+                fprintf(stderr, "realloc failed in read_baseline\n");
+                exit(1);
+            }
+        }
+        base[n++] = b;
+    }
+    fclose(fp);
+    *count = n;
+    return base;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: mbench [-hcp] [-n <blocks>] [-r <reps>] [-s <seed>] [-b <baseline.csv>] [filter]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b <file>  Compare against a CSV baseline; exit 2 on regressions.\n");
+    fprintf(stderr, "\t-c         Print results as CSV.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-n <n>     Blocks per benchmark batch (default %d).\n", DEFAULT_BLOCKS);
+    fprintf(stderr, "\t-p         Count hardware events per request.\n");
+    fprintf(stderr, "\t-r <n>     Repetitions of each benchmark (default %d).\n", DEFAULT_REPS);
+    fprintf(stderr, "\t-s <seed>  Seed for the workload size distributions.\n");
+    fprintf(stderr, "\tfilter     Only run benchmarks whose name contains this string.\n");
+}
+
+int main(int argc, char** argv) {
+    static const struct {
+        const char* name;
+        uint64_t (*fn)(const bench_t*, size_t*);
+    } hot[] = {
+        { "find_fit", bench_find_fit },
+        { "place/split", bench_place_split },
+        { "place/exact", bench_place_exact },
+        { "coalesce/1", bench_coalesce1 },
+        { "coalesce/2", bench_coalesce2 },
+        { "coalesce/3", bench_coalesce3 },
+        { "coalesce/4", bench_coalesce4 },
+        { "extend_heap", bench_extend_heap },
+        { "span", bench_span },
+        { "span/realloc", bench_span_realloc },
+        { "hooks", bench_hooks },
+    };
+    bench_t* benches;
+    baseline_t* base = NULL;
+    const char* filter = NULL;
+    bool csv = false;
+    int c, i, nbench = 0, nbase = 0, regressions = 0;
+
+    while ((c = getopt(argc, argv, "b:chn:pr:s:")) != EOF) {
+        switch (c) {
+        case 'b':
+            base = read_baseline(optarg, &nbase);
+            break;
+        case 'c':
+            csv = true;
+            break;
+        case 'n':
+            nblocks = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            use_counters = true;
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (optind < argc)
+        filter = argv[optind];
+    if (nblocks < 2 || reps < 1) {
+        usage();
+        exit(1);
+    }
+
+    ptrs = malloc(nblocks * sizeof(char*));
+    sizes = malloc(nblocks * sizeof(size_t));
+    order = malloc(nblocks * sizeof(size_t));
+    benches = malloc((sizeof(hot) / sizeof(hot[0]) + 4 * 3 * 2) * sizeof(bench_t));
+    if (ptrs == NULL || sizes == NULL || order == NULL || benches == NULL) {
+        fprintf(stderr, "malloc failed in main\n");
+        exit(1);
+    }
+
+    /* build the benchmark list */
+    for (i = 0; i < (int)(sizeof(hot) / sizeof(hot[0])); i++) {
+        bench_t* b = &benches[nbench++];
+        snprintf(b->name, MAX_NAME, "%s", hot[i].name);
+        b->fn = hot[i].fn;
+    }
+    for (int d = FIXED; d <= BIMODAL; d++) {
+        for (int o = LIFO; o <= RANDOM; o++) {
+            for (int w = 0; w <= 1; w++) {
+                bench_t* b = &benches[nbench++];
+                snprintf(b->name, MAX_NAME, "workload/%s/%s/%s", dist_names[d], order_names[o],
+                    w ? "warm" : "cold");
+                b->fn = bench_workload;
+                b->dist = d;
+                b->order = o;
+                b->warm = w;
+            }
+        }
+    }
+
+    mem_init();
+
+    if (use_counters && perfctr_open(&counters) == 0) {
+        fprintf(stderr, "Hardware counters unavailable (perf events not permitted?); continuing without\n");
+        use_counters = false;
+    }
+
+    if (csv) {
+        printf("benchmark,ns_per_op,ci95,min,stddev,reps,blocks");
+        for (i = 0; use_counters && i < PC_NUM_EVENTS; i++)
+            printf(",%s", perfctr_name(i));
+        printf("\n");
+    }
+    else {
+        printf("%-32s %10s %9s %10s", "benchmark", "ns/op", "+/-95%", "min");
+        for (i = 0; use_counters && i < PC_NUM_EVENTS; i++)
+            if (perfctr_available(&counters, i))
+                printf(" %13s", perfctr_name(i));
+        printf("\n");
+    }
+
+    for (i = 0; i < nbench; i++) {
+        bench_t* b = &benches[i];
+        if (filter != NULL && strstr(b->name, filter) == NULL)
+            continue;
+        result_t r = run_bench(b);
+        const char* verdict = "";
+
+        for (int j = 0; j < nbase; j++) {
+            if (strcmp(base[j].name, b->name) != 0)
+                continue;
+            /* slower with non-overlapping confidence intervals */
+            if (r.mean - r.ci > base[j].mean + base[j].ci) {
+                verdict = "  REGRESSION";
+                regressions++;
+            }
+            break;
+        }
+
+        if (csv) {
+            printf("%s,%.3f,%.3f,%.3f,%.3f,%d,%zu", b->name, r.mean, r.ci, r.min, r.stddev,
+                reps, nblocks);
+            for (int k = 0; use_counters && k < PC_NUM_EVENTS; k++) {
+                if (perfctr_available(&counters, k))
+                    printf(",%.2f", r.counts[k]);
+                else
+                    printf(",");
+            }
+            printf("\n");
+        }
+        else {
+            printf("%-32s %10.1f %9.1f %10.1f", b->name, r.mean, r.ci, r.min);
+            for (int k = 0; use_counters && k < PC_NUM_EVENTS; k++)
+                if (perfctr_available(&counters, k))
+                    printf(" %13.2f", r.counts[k]);
+            printf("%s\n", verdict);
+        }
+        fflush(stdout);
+    }
+
+    mem_deinit();
+    if (use_counters)
+        perfctr_close(&counters);
+    if (regressions > 0)
+        fprintf(stderr, "%d benchmark(s) regressed against the baseline\n", regressions);
+    free(base);
+    free(benches);
+    free(ptrs);
+    free(sizes);
+    free(order);
+    return regressions > 0 ? 2 : 0;
+}
@@ -0,0 +1,561 @@
+/*
+ * mdriver.c - Trace-replay driver for the allocator in mm.c
+ *
+ * Replays each allocation trace against mm_malloc/mm_free/mm_realloc,
+ * checking that every block is aligned, lies inside the heap, does not
+ * overlap another live block and keeps its payload intact. It then
+ * reports the peak utilization (peak live bytes / peak heap size) and the
+ * throughput (ops/sec) of each trace. With -l the same traces are
+ * replayed against the libc malloc package for comparison. With -p the
+ * timed replays are also measured with the hardware performance
+ * counters (see perfctr.h), reported per request. With -P the heap
+ * profiler samples every replay and the profile of each validation
+ * replay is written to <prefix>.<trace number>.heap for pprof.
+ *
+ * Every validation replay ends with a full parallel heap check; -I n
+ * also runs the incremental checker over n blocks after every request
+ * and -V the complete mm_checkheap.
+ */
+#include "config.h"
+#include "memlib.h"
+#include "mm.h"
+#include "perfctr.h"
+#include "timer.h"
+#include "trace.h"
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Summary statistics for one trace replayed against one allocator */
+typedef struct {
+    bool valid;  /* was the trace processed correctly by the allocator? */
+    double ops;  /* number of requests in the trace */
+    double secs; /* fastest replay time in seconds */
+    double util; /* peak live bytes / peak heap size (mm only) */
+    double counts[PC_NUM_EVENTS]; /* hardware events per request (-p) */
+} stats_t;
+
+/* Per block state kept by the validity checker */
+typedef struct {
+    char* payload;   /* address returned by the allocator, NULL if free */
+    size_t size;     /* requested payload size */
+    uint8_t pattern; /* byte the payload was filled with */
+} blockinfo_t;
+
+/* A function that replays a trace against some malloc package */
+typedef void (*replay_fn)(trace_t* trace, char** blocks);
+
+static int verbose = 0;
+static size_t check_step = 0; /* blocks checked incrementally per request (-I) */
+static bool use_counters = false;
+static perfctr_t counters;
+
+static void usage(void);
+static bool eval_mm_valid(trace_t* trace, const char* name, double* util);
+static double eval_speed(trace_t* trace, replay_fn replay, bool reset_mm, double* counts);
+static void replay_mm(trace_t* trace, char** blocks);
+static void replay_libc(trace_t* trace, char** blocks);
+static void printresults(int n, const char* const* names, stats_t* stats, bool show_util);
+static void printcounters(int n, const char* const* names, stats_t* stats);
+static void malformed(const char* name, int opnum, const char* msg);
+
+int main(int argc, char** argv) {
+    static const char* default_tracefiles[] = { DEFAULT_TRACEFILES, NULL };
+    const char* tracedir = TRACEDIR;
+    const char* const* names = default_tracefiles;
+    const char* single[2] = { NULL, NULL };
+    const char* profile = NULL;
+    const char* flight = NULL;
+    char path[4096];
+    bool run_libc = false;
+    int c, i, num_tracefiles, numcorrect = 0;
+
+    while ((c = getopt(argc, argv, "f:F:I:t:hlpP:vV")) != EOF) {
+        switch (c) {
+        case 'f': /* use one specific trace file only (relative to curr dir) */
+            single[0] = optarg;
+            names = single;
+            tracedir = "";
+            break;
+        case 'F': /* record the correctness replays with the flight recorder */
+            flight = optarg;
+            break;
+        case 't': /* directory where the default traces are located */
+            if (names == single)
+                break;
+            tracedir = optarg;
+            break;
+        case 'l': /* also replay the traces against libc malloc */
+            run_libc = true;
+            break;
+        case 'p': /* count hardware events in the timed replays */
+            use_counters = true;
+            break;
+        case 'I': /* check the heap incrementally after every request */
+            check_step = strtoul(optarg, NULL, 0);
+            break;
+        case 'P': /* sample the replays with the heap profiler */
+            profile = optarg;
+            break;
+        case 'v': /* print per-trace performance breakdown */
+            verbose = 1;
+            break;
+        case 'V': /* be more verbose and check the heap after every request */
+            verbose = 2;
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    for (num_tracefiles = 0; names[num_tracefiles] != NULL; num_tracefiles++)
+        ;
+
+    printf("Team: %s (%s)\n", team.name, team.uid);
+
+    stats_t* mm_stats = calloc(num_tracefiles, sizeof(stats_t));
+    stats_t* libc_stats = calloc(num_tracefiles, sizeof(stats_t));
+    if (mm_stats == NULL || libc_stats == NULL) {
+        fprintf(stderr, "calloc failed in main\n");
+        exit(1);
+    }
+
+    mem_init();
+    if (use_counters && perfctr_open(&counters) == 0) {
+        printf("Hardware counters unavailable (perf events not permitted?); ignoring -p\n");
+        use_counters = false;
+    }
+    if (profile != NULL)
+        mm_profile_start(0);
+    if (flight != NULL && (mm_flight_start(0) < 0 || mm_flight_dump_on_signal(flight) < 0)) {
+        printf("Flight recorder unavailable (rebuild with make MM_FLIGHT=1); ignoring -F\n");
+        flight = NULL;
+    }
+
+    for (i = 0; i < num_tracefiles; i++) {
+        snprintf(path, sizeof(path), "%s%s", tracedir, names[i]);
+        trace_t* trace = read_trace(path);
+        mm_stats[i].ops = trace->num_ops;
+        libc_stats[i].ops = trace->num_ops;
+
+        if (verbose > 1)
+            printf("Checking mm_malloc for correctness on %s\n", names[i]);
+        if (flight != NULL)
+            mm_flight_start(0);
+        mm_stats[i].valid = eval_mm_valid(trace, names[i], &mm_stats[i].util);
+        mm_flight_stop();
+        if (profile != NULL) {
+            snprintf(path, sizeof(path), "%s.%d.heap", profile, i);
+            if (mm_profile_dump(path) < 0)
+                fprintf(stderr, "Could not write the heap profile %s\n", path);
+        }
+        if (mm_stats[i].valid) {
+            numcorrect++;
+            mm_stats[i].secs = eval_speed(trace, replay_mm, true, mm_stats[i].counts);
+        }
+
+        if (run_libc) {
+            libc_stats[i].valid = true;
+            libc_stats[i].secs = eval_speed(trace, replay_libc, false, libc_stats[i].counts);
+        }
+        free_trace(trace);
+    }
+
+    mem_deinit();
+    if (flight != NULL && mm_flight_dump(flight) < 0)
+        fprintf(stderr, "Could not write the flight recording %s\n", flight);
+
+    if (run_libc && verbose) {
+        printf("\nResults for libc malloc:\n");
+        printresults(num_tracefiles, names, libc_stats, false);
+    }
+    if (run_libc && use_counters) {
+        printf("\nHardware events per request for libc malloc:\n");
+        printcounters(num_tracefiles, names, libc_stats);
+    }
+    if (verbose) {
+        printf("\nResults for mm malloc:\n");
+        printresults(num_tracefiles, names, mm_stats, true);
+        printf("\n");
+    }
+    if (use_counters) {
+        printf("%sHardware events per request for mm malloc:\n", verbose ? "" : "\n");
+        printcounters(num_tracefiles, names, mm_stats);
+        printf("\n");
+        perfctr_close(&counters);
+    }
+
+    if (numcorrect == num_tracefiles) {
+        double ops = 0, secs = 0, util = 0, libc_ops = 0, libc_secs = 0;
+        for (i = 0; i < num_tracefiles; i++) {
+            ops += mm_stats[i].ops;
+            secs += mm_stats[i].secs;
+            util += mm_stats[i].util;
+            libc_ops += libc_stats[i].ops;
+            libc_secs += libc_stats[i].secs;
+        }
+        double avg_util = util / num_tracefiles;
+        double thruput = (secs > 0) ? ops / secs : 0;
+        double libc_thruput = (run_libc && libc_secs > 0)
+            ? libc_ops / libc_secs
+            : AVG_LIBC_THRUPUT;
+        double rel = thruput / libc_thruput;
+        double perfindex = UTIL_WEIGHT * avg_util + (1.0 - UTIL_WEIGHT) * (rel < 1.0 ? rel : 1.0);
+
+        printf("Average utilization = %.1f%%. Throughput = %.0f Kops/sec (%s %.0f Kops/sec)\n",
+            avg_util * 100.0, thruput / 1e3, run_libc ? "libc" : "reference",
+            libc_thruput / 1e3);
+        printf("Perf index = %.1f/100\n", perfindex * 100.0);
+    }
+    else {
+        printf("Terminated with %d errors\n", num_tracefiles - numcorrect);
+    }
+
+    free(mm_stats);
+    free(libc_stats);
+    return numcorrect == num_tracefiles ? 0 : 1;
+}
+
+/* The segments of the heap, as seen by mm_heap_segments */
+typedef struct {
+    const char* lo;  /* the range looked for */
+    const char* hi;
+    bool inside;     /* it lies within one segment */
+    size_t total;    /* bytes of all segments */
+} segment_scan_t;
+
+static void scan_segment(void* start, size_t size, int mapped, void* arg) {
+    segment_scan_t* scan = arg;
+
+    (void)mapped;
+    if (scan->lo >= (char*)start && scan->hi < (char*)start + size)
+        scan->inside = true;
+    scan->total += size;
+}
+
+/*
+ * in_heap - true if size bytes at p lie within one segment of the heap,
+ *           which may be the break or a mapping of its own; the bytes
+ *           of all segments go to *heap
+ */
+static bool in_heap(const char* p, size_t size, size_t* heap) {
+    segment_scan_t scan = { p, p + (size ? size - 1 : 0), false, 0 };
+
+    mm_heap_segments(scan_segment, &scan);
+    *heap = scan.total;
+    return scan.inside;
+}
+
+/*
+ * eval_mm_valid - replay a trace against mm.c, checking every request.
+ *                 Returns true and the peak utilization if the trace ran
+ *                 correctly.
+ */
+static bool eval_mm_valid(trace_t* trace, const char* name, double* util) {
+    blockinfo_t* blocks;
+    size_t live = 0, peak_live = 0, heap, peak_heap = 0;
+    uint8_t next_pattern = 0x5a;
+    bool ok = false;
+    int i, j;
+
+    if ((blocks = calloc(trace->num_ids, sizeof(blockinfo_t))) == NULL) {
+        fprintf(stderr, "calloc failed in eval_mm_valid\n");
+        exit(1);
+    }
+
+    mem_reset_brk();
+    if (mm_init() < 0) {
+        malformed(name, 0, "mm_init failed");
+        goto out;
+    }
+
+    for (i = 0; i < trace->num_ops; i++) {
+        traceop_t* op = &trace->ops[i];
+        blockinfo_t* b = &blocks[op->index];
+        char* p;
+        size_t k, keep;
+
+        switch (op->type) {
+        case ALLOC:
+        case REALLOC:
+            if (op->type == ALLOC)
+                p = mm_malloc(op->size);
+            else
+                p = mm_realloc(b->payload, op->size);
+            if (p == NULL && op->size > 0) {
+                malformed(name, i, "allocator returned NULL");
+                goto out;
+            }
+
+            /* the payload must be aligned and lie inside the heap */
+            if ((uintptr_t)p % ALIGNMENT) {
+                malformed(name, i, "payload is not aligned");
+                goto out;
+            }
+            if (!in_heap(p, op->size, &heap)) {
+                malformed(name, i, "payload lies outside the heap");
+                goto out;
+            }
+            /* mapped segments are given back, so the heap can shrink */
+            if (heap > peak_heap)
+                peak_heap = heap;
+
+            /* realloc must preserve the old payload up to the smaller size */
+            if (op->type == REALLOC && b->payload != NULL) {
+                keep = b->size < op->size ? b->size : op->size;
+                for (k = 0; k < keep; k++) {
+                    if ((uint8_t)p[k] != b->pattern) {
+                        malformed(name, i, "mm_realloc did not preserve the payload");
+                        goto out;
+                    }
+                }
+                live -= b->size;
+            }
+            b->payload = NULL;
+
+            /* the new block must not overlap any other live block */
+            for (j = 0; j < trace->num_ids; j++) {
+                blockinfo_t* o = &blocks[j];
+                if (o->payload == NULL || o->size == 0)
+                    continue;
+                if (p < o->payload + o->size && o->payload < p + op->size) {
+                    malformed(name, i, "payload overlaps another block");
+                    goto out;
+                }
+            }
+
+            b->payload = p;
+            b->size = op->size;
+            b->pattern = next_pattern++;
+            memset(p, b->pattern, op->size);
+            live += op->size;
+            if (live > peak_live)
+                peak_live = live;
+            break;
+
+        case FREE:
+            if (b->payload == NULL) {
+                malformed(name, i, "free of a block that is not allocated");
+                goto out;
+            }
+            for (k = 0; k < b->size; k++) {
+                if ((uint8_t)b->payload[k] != b->pattern) {
+                    malformed(name, i, "payload was overwritten while allocated");
+                    goto out;
+                }
+            }
+            mm_free(b->payload);
+            live -= b->size;
+            b->payload = NULL;
+            b->size = 0;
+            break;
+        }
+
+        if (verbose > 1)
+            mm_checkheap(0);
+        if (check_step > 0 && mm_checkheap_step(check_step, NULL) > 0) {
+            malformed(name, i, "incremental heap check failed");
+            goto out;
+        }
+    }
+
+    if (mm_checkheap_parallel(sysconf(_SC_NPROCESSORS_ONLN)) > 0) {
+        malformed(name, trace->num_ops, "heap check failed");
+        goto out;
+    }
+
+    /* the incrementally kept statistics must agree with the driver */
+    struct mm_stats st;
+    in_heap(NULL, 0, &heap);
+    mm_stats(&st);
+    if (st.live_bytes != live || st.heap_size != heap) {
+        malformed(name, trace->num_ops, "mm_stats does not match the replayed trace");
+        goto out;
+    }
+
+    *util = peak_heap > 0 ? (double)peak_live / peak_heap : 0;
+    ok = true;
+out:
+    free(blocks);
+    return ok;
+}
+
+/*
+ * eval_speed - return the fastest of NUM_REPS replays of a trace in seconds;
+ *              with -p also store the hardware events per request in counts
+ */
+static double eval_speed(trace_t* trace, replay_fn replay, bool reset_mm, double* counts) {
+    char** blocks;
+    double best = 0;
+    int rep;
+
+    if ((blocks = calloc(trace->num_ids, sizeof(char*))) == NULL) {
+        fprintf(stderr, "calloc failed in eval_speed\n");
+        exit(1);
+    }
+    perfctr_reset(&counters);
+    for (rep = 0; rep < NUM_REPS; rep++) {
+        if (reset_mm) {
+            mem_reset_brk();
+            if (mm_init() < 0) {
+                fprintf(stderr, "mm_init failed in eval_speed\n");
+                exit(1);
+            }
+        }
+        if (use_counters)
+            perfctr_start(&counters);
+        uint64_t start = now_ns();
+        replay(trace, blocks);
+        double secs = (now_ns() - start) / 1e9;
+        if (use_counters)
+            perfctr_stop(&counters);
+        if (rep == 0 || secs < best)
+            best = secs;
+
+        /* blocks left allocated by the trace are released between reps */
+        if (!reset_mm) {
+            for (int i = 0; i < trace->num_ids; i++)
+                free(blocks[i]);
+        }
+        memset(blocks, 0, trace->num_ids * sizeof(char*));
+    }
+    free(blocks);
+    for (int i = 0; use_counters && i < PC_NUM_EVENTS; i++)
+        counts[i] = trace->num_ops ? (double)counters.values[i] / NUM_REPS / trace->num_ops : 0;
+    return best;
+}
+
+/*
+ * replay_mm - replay a trace against mm.c without any checking
+ */
+static void replay_mm(trace_t* trace, char** blocks) {
+    for (int i = 0; i < trace->num_ops; i++) {
+        traceop_t* op = &trace->ops[i];
+        switch (op->type) {
+        case ALLOC:
+            blocks[op->index] = mm_malloc(op->size);
+            break;
+        case REALLOC:
+            blocks[op->index] = mm_realloc(blocks[op->index], op->size);
+            break;
+        case FREE:
+            mm_free(blocks[op->index]);
+            blocks[op->index] = NULL;
+            break;
+        }
+    }
+}
+
+/*
+ * replay_libc - replay a trace against the libc malloc package
+ */
+static void replay_libc(trace_t* trace, char** blocks) {
+    for (int i = 0; i < trace->num_ops; i++) {
+        traceop_t* op = &trace->ops[i];
+        switch (op->type) {
+        case ALLOC:
+            blocks[op->index] = malloc(op->size);
+            break;
+        case REALLOC:
+            blocks[op->index] = realloc(blocks[op->index], op->size);
+            break;
+        case FREE:
+            free(blocks[op->index]);
+            blocks[op->index] = NULL;
+            break;
+        }
+    }
+}
+
+/*
+ * printresults - print a performance summary for some malloc package
+ */
+static void printresults(int n, const char* const* names, stats_t* stats, bool show_util) {
+    double ops = 0, secs = 0, util = 0;
+
+    printf("%5s%7s %6s%9s%11s%10s  %s\n", "trace", " valid", "util", "ops", "secs", "Kops", "name");
+    for (int i = 0; i < n; i++) {
+        if (stats[i].valid) {
+            if (show_util)
+                printf("%2d%10s%6.1f%%", i, "yes", stats[i].util * 100.0);
+            else
+                printf("%2d%10s%7s", i, "yes", "-");
+            printf("%9.0f%11.6f%10.0f  %s\n", stats[i].ops, stats[i].secs,
+                stats[i].secs > 0 ? stats[i].ops / stats[i].secs / 1e3 : 0, names[i]);
+            ops += stats[i].ops;
+            secs += stats[i].secs;
+            util += stats[i].util;
+        }
+        else {
+            printf("%2d%10s%7s%9s%11s%10s  %s\n", i, "no", "-", "-", "-", "-", names[i]);
+        }
+    }
+    if (show_util)
+        printf("%-12s%6.1f%%", "Total", n ? util / n * 100.0 : 0);
+    else
+        printf("%-12s%7s", "Total", "-");
+    printf("%9.0f%11.6f%10.0f\n", ops, secs,
+        secs > 0 ? ops / secs / 1e3 : 0);
+}
+
+/*
+ * printcounters - print the hardware events per request of each trace;
+ *                 events that could not be opened are left out
+ */
+static void printcounters(int n, const char* const* names, stats_t* stats) {
+    double total[PC_NUM_EVENTS] = { 0 }, ops = 0;
+    int e;
+
+    printf("%5s", "trace");
+    for (e = 0; e < PC_NUM_EVENTS; e++)
+        if (perfctr_available(&counters, e))
+            printf(" %13s", perfctr_name(e));
+    printf("  %s\n", "name");
+    for (int i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        printf("%2d   ", i);
+        for (e = 0; e < PC_NUM_EVENTS; e++) {
+            if (perfctr_available(&counters, e))
+                printf(" %13.2f", stats[i].counts[e]);
+            total[e] += stats[i].counts[e] * stats[i].ops;
+        }
+        printf("  %s\n", names[i]);
+        ops += stats[i].ops;
+    }
+    printf("%-5s", "Total");
+    for (e = 0; e < PC_NUM_EVENTS; e++)
+        if (perfctr_available(&counters, e))
+            printf(" %13.2f", ops > 0 ? total[e] / ops : 0);
+    printf("\n");
+}
+
+/*
+ * malformed - report an incorrect result for request opnum of a trace
+ */
+static void malformed(const char* name, int opnum, const char* msg) {
+    printf("ERROR [trace %s, request %d]: %s\n", name, opnum, msg);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: mdriver [-hlpvV] [-f <file>] [-t <dir>] [-F <file>] [-I <blocks>] [-P <prefix>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-F <file>  Record the last requests of the correctness runs in <file>.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-I <n>     Check n blocks of the heap after every request.\n");
+    fprintf(stderr, "\t-l         Replay the traces against libc malloc as well.\n");
+    fprintf(stderr, "\t-P <pre>   Profile the heap, writing <pre>.<n>.heap per trace.\n");
+    fprintf(stderr, "\t-p         Count hardware events (cycles, cache misses, ...) per request.\n");
+    fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
+    fprintf(stderr, "\t-V         Print diagnostics and check the heap after each request.\n");
+}
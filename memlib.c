@@ -0,0 +1,226 @@
+/*
+ * memlib.c - a module that simulates the memory system. Needed because it
+ *            allows us to interleave calls from the driver's allocator with
+ *            the system's malloc package in libc.
+ *
+ * The heap is one contiguous region of MAX_HEAP bytes of address space,
+ * reserved up front from a page provider (pages.h) without making it
+ * usable. mem_sbrk moves a simulated break through it and only commits
+ * the pages below the break, COMMIT_STEP bytes at a time, so most growth
+ * is a pointer bump and the heap stays contiguous. A commit that fails
+ * leaves the heap as it was; a later, smaller request may still succeed.
+ * mem_map and mem_unmap give the allocator further regions from the
+ * same provider.
+ *
+ * The provider is chosen with mem_set_pages before mem_init, or else by
+ * the environment:
+ *
+ *      MM_PAGES=<name>     provider of pages.h (default mmap)
+ *      MM_HUGEPAGES=1      ask for huge pages for every region
+ *      MM_NUMA_NODE=<n>    prefer NUMA node n for every region
+ */
+#include "config.h"
+#include "memlib.h"
+#include "pages.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COMMIT_STEP (2UL << 20) /* granularity of committing pages */
+
+/* private variables */
+static char* mem_start_brk;  /* points to first byte of heap */
+static char* mem_brk;        /* points to last byte of heap plus one */
+static char* mem_commit_brk; /* end of the accessible part of the reservation */
+static char* mem_max_addr;   /* largest legal heap address plus one */
+static const struct page_provider* pages; /* where the memory comes from */
+static bool hugepages;       /* hint huge pages for every region */
+static int numa_node = -1;   /* preferred NUMA node, -1 for none */
+static struct mem_page_stats page_stats;
+
+/*
+ * mem_set_pages - use the page provider called name; must be called
+ *                 before mem_init, returns -1 if there is no such provider
+ */
+int mem_set_pages(const char* name) {
+    const struct page_provider* p = pages_find(name);
+
+    if (p == NULL)
+        return -1;
+    pages = p;
+    return 0;
+}
+
+/*
+ * reserve - reserve size bytes from the provider and pass on the hints
+ */
+static void* reserve(size_t size) {
+    void* p = pages->reserve(size);
+
+    if (p == NULL)
+        return NULL;
+    if (hugepages && pages->hugepages != NULL)
+        pages->hugepages(p, size, true);
+    if (numa_node >= 0 && pages->bind != NULL)
+        pages->bind(p, size, numa_node);
+    page_stats.reserved += size;
+    return p;
+}
+
+static void release(void* addr, size_t size) {
+    pages->release(addr, size);
+    page_stats.reserved -= size;
+}
+
+/*
+ * mem_init - initialize the memory system model
+ */
+void mem_init(void) {
+    const char* env;
+
+    if (pages == NULL && (env = getenv("MM_PAGES")) != NULL && mem_set_pages(env) < 0) {
+        fprintf(stderr, "mem_init: unknown page provider %s\n", env);
+        exit(1);
+    }
+    if (pages == NULL)
+        pages = &pages_mmap;
+    hugepages = (env = getenv("MM_HUGEPAGES")) != NULL && strcmp(env, "0") != 0;
+    if ((env = getenv("MM_NUMA_NODE")) != NULL)
+        numa_node = atoi(env);
+    memset(&page_stats, 0, sizeof(page_stats));
+    page_stats.provider = pages->name;
+
+    /* reserve the address space used to model the available VM */
+    if ((mem_start_brk = reserve(MAX_HEAP)) == NULL) {
+        fprintf(stderr, "mem_init: %s could not reserve %lu bytes\n", pages->name,
+            (unsigned long)MAX_HEAP);
+        exit(1);
+    }
+
+    mem_max_addr = mem_start_brk + MAX_HEAP; /* max legal heap address */
+    mem_brk = mem_start_brk;                 /* heap is empty initially */
+    mem_commit_brk = mem_start_brk;          /* and nothing is accessible */
+}
+
+/*
+ * mem_deinit - free the storage used by the memory system model
+ */
+void mem_deinit(void) {
+    release(mem_start_brk, MAX_HEAP);
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap.
+ *                 The pages of the previous heap are decommitted, so the
+ *                 next run starts from fresh memory.
+ */
+void mem_reset_brk(void) {
+    if (mem_commit_brk > mem_start_brk) {
+        pages->decommit(mem_start_brk, mem_commit_brk - mem_start_brk);
+        page_stats.committed -= mem_commit_brk - mem_start_brk;
+        page_stats.decommits++;
+    }
+    mem_brk = mem_start_brk;
+    mem_commit_brk = mem_start_brk;
+}
+
+/*
+ * commit - make the heap accessible up to at least end, rounding up to a
+ *          multiple of COMMIT_STEP; -1 with errno ENOMEM if it cannot
+ */
+static int commit(char* end) {
+    size_t step = pages->page_size() > COMMIT_STEP ? pages->page_size() : COMMIT_STEP;
+    size_t len = (end - mem_commit_brk + step - 1) & ~(step - 1);
+
+    if (len > (size_t)(mem_max_addr - mem_commit_brk))
+        len = mem_max_addr - mem_commit_brk;
+    if (pages->commit(mem_commit_brk, len) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    mem_commit_brk += len;
+    page_stats.committed += len;
+    page_stats.commits++;
+    return 0;
+}
+
+/*
+ * mem_sbrk - simple model of the sbrk function. Extends the heap
+ *            by incr bytes and returns the start address of the new area.
+ *            In this model, the heap cannot be shrunk.
+ */
+void* mem_sbrk(intptr_t incr) {
+    char* old_brk = mem_brk;
+
+    if ((incr < 0) || (incr > mem_max_addr - mem_brk)) {
+        errno = ENOMEM;
+        return (void*)-1;
+    }
+    if (mem_brk + incr > mem_commit_brk && commit(mem_brk + incr) < 0)
+        return (void*)-1;
+    mem_brk += incr;
+    return (void*)old_brk;
+}
+
+/*
+ * mem_map - reserve and commit a region of size bytes, a multiple of
+ *           mem_pagesize(), apart from the heap; NULL if it cannot
+ */
+void* mem_map(size_t size) {
+    void* p = reserve(size);
+
+    if (p == NULL)
+        return NULL;
+    if (pages->commit(p, size) < 0) {
+        release(p, size);
+        return NULL;
+    }
+    page_stats.committed += size;
+    page_stats.commits++;
+    return p;
+}
+
+/*
+ * mem_unmap - give back a region from mem_map
+ */
+void mem_unmap(void* addr, size_t size) {
+    release(addr, size);
+    page_stats.committed -= size;
+}
+
+/*
+ * mem_heap_lo - return address of the first heap byte
+ */
+void* mem_heap_lo(void) {
+    return (void*)mem_start_brk;
+}
+
+/*
+ * mem_heap_hi - return address of last heap byte
+ */
+void* mem_heap_hi(void) {
+    return (void*)(mem_brk - 1);
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes
+ */
+size_t mem_heapsize(void) {
+    return (size_t)(mem_brk - mem_start_brk);
+}
+
+/*
+ * mem_pagesize() - returns the page size of the page provider
+ */
+size_t mem_pagesize(void) {
+    return pages->page_size();
+}
+
+/*
+ * mem_page_stats - what the page provider has handed out
+ */
+void mem_page_stats(struct mem_page_stats* out) {
+    *out = page_stats;
+}
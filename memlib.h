@@ -0,0 +1,32 @@
+/*
+ * memlib.h - Interface to the memory system model used by mm.c
+ */
+#ifndef MEMLIB_H
+#define MEMLIB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* What the page provider has handed out since mem_init */
+struct mem_page_stats {
+    const char* provider; /* name of the page provider (pages.h) */
+    size_t reserved;      /* bytes of address space reserved now */
+    size_t committed;     /* bytes committed now */
+    uint64_t commits;     /* commit calls */
+    uint64_t decommits;   /* decommit calls */
+};
+
+int mem_set_pages(const char* name);
+void mem_init(void);
+void mem_deinit(void);
+void* mem_sbrk(intptr_t incr);
+void mem_reset_brk(void);
+void* mem_map(size_t size);
+void mem_unmap(void* addr, size_t size);
+void* mem_heap_lo(void);
+void* mem_heap_hi(void);
+size_t mem_heapsize(void);
+size_t mem_pagesize(void);
+void mem_page_stats(struct mem_page_stats* out);
+
+#endif /* MEMLIB_H */
@@ -0,0 +1,284 @@
+/*
+ * metrics.c - Allocator statistics in the Prometheus text format
+ *
+ * mm_metrics_write renders mm_stats, the per-class and per-thread counts
+ * and, when mm.c is built with MM_LATENCY, the latency histograms as
+ * Prometheus text exposition format. The file is written under a temporary name and
+ * renamed into place, so a scraper never sees a partial file.
+ *
+ * mm_metrics_start runs a background thread that rewrites the file at a
+ * fixed interval. mm_init starts it by itself when the environment sets
+ * MM_METRICS_FILE (and optionally MM_METRICS_INTERVAL_MS), which gives
+ * a program allocator metrics without changing its code:
+ *
+ *      MM_METRICS_FILE=/var/lib/node_exporter/mm.prom ./app
+ *
+ * Latencies are exported in seconds, converted from ticks with the rate
+ * measured by ticks_per_ns; histogram buckets are the powers of two of
+ * the underlying hist_t.
+ */
+#include "metrics.h"
+#include "mm.h"
+#include "timer.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER; /* guards all below */
+static pthread_cond_t metrics_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t exporter;
+static bool running;  /* the exporter thread exists */
+static bool stopping; /* it has been asked to exit */
+static char metrics_path[4096];
+static unsigned metrics_interval_ms;
+
+/*
+ * print_metric - a HELP and TYPE line followed by one unlabelled sample
+ */
+static void print_metric(FILE* fp, const char* name, const char* type, const char* help,
+    double value) {
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
+
+/*
+ * print_histogram - one labelled series of a Prometheus histogram. Every
+ *                   power of two of h ends a bucket; values are
+ *                   divided by scale (ticks per second for latencies).
+ */
+static void print_histogram(FILE* fp, const char* name, const char* op, const hist_t* h,
+    double scale) {
+    uint64_t seen = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t high = hist_bucket_high(i);
+        seen += h->counts[i];
+        if (((high + 1) & high) == 0) {
+            fprintf(fp, "%s_bucket{op=\"%s\",le=\"%.9g\"} %lu\n", name, op, high / scale,
+                (unsigned long)seen);
+            if (seen == h->total)
+                break;
+        }
+    }
+    fprintf(fp, "%s_bucket{op=\"%s\",le=\"+Inf\"} %lu\n", name, op, (unsigned long)h->total);
+    fprintf(fp, "%s_sum{op=\"%s\"} %.17g\n", name, op, h->sum / scale);
+    fprintf(fp, "%s_count{op=\"%s\"} %lu\n", name, op, (unsigned long)h->total);
+}
+
+/* One per-thread counter of struct mm_thread_stats, printed for every thread */
+typedef struct {
+    FILE* fp;
+    const char* name;
+    size_t offset; /* of the counter in struct mm_thread_stats */
+} thread_metric_t;
+
+static void print_thread(const struct mm_thread_stats* t, void* arg) {
+    thread_metric_t* m = arg;
+
+    fprintf(m->fp, "%s{tid=\"%lu\"} %lu\n", m->name, (unsigned long)t->tid,
+        (unsigned long)*(const uint64_t*)((const char*)t + m->offset));
+}
+
+/*
+ * print_threads - the request counts of every running thread, labelled
+ *                 with its thread id
+ */
+static void print_threads(FILE* fp) {
+    static const struct {
+        const char* name;
+        const char* help;
+        size_t offset;
+    } counters[] = {
+        { "mm_thread_mallocs_total", "Allocation requests per thread.",
+            offsetof(struct mm_thread_stats, mallocs) },
+        { "mm_thread_frees_total", "Free requests per thread.",
+            offsetof(struct mm_thread_stats, frees) },
+        { "mm_thread_allocated_bytes_total", "Payload bytes requested per thread.",
+            offsetof(struct mm_thread_stats, bytes_allocated) },
+        { "mm_thread_freed_bytes_total", "Payload bytes freed per thread.",
+            offsetof(struct mm_thread_stats, bytes_freed) },
+    };
+
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        thread_metric_t m = { fp, counters[i].name, counters[i].offset };
+        fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n", m.name, counters[i].help, m.name);
+        mm_stats_threads(print_thread, &m);
+    }
+}
+
+static void print_latencies(FILE* fp) {
+    static const char* ops[] = { "malloc", "free", "realloc", NULL, "extend_heap" };
+    hist_t* h = malloc(sizeof(hist_t));
+
+    if (h == NULL || mm_latency(MM_LAT_MALLOC, h) < 0) {
+        free(h);
+        return;
+    }
+    fprintf(fp, "# HELP mm_latency_seconds Time spent in allocator operations.\n");
+    fprintf(fp, "# TYPE mm_latency_seconds histogram\n");
+    for (int op = 0; op < MM_LAT_NUM; op++) {
+        if (ops[op] == NULL)
+            continue;
+        mm_latency(op, h);
+        print_histogram(fp, "mm_latency_seconds", ops[op], h, ticks_per_ns() * 1e9);
+    }
+    fprintf(fp, "# HELP mm_fit_scan_blocks Free blocks looked at by one find_fit call.\n");
+    fprintf(fp, "# TYPE mm_fit_scan_blocks histogram\n");
+    mm_latency(MM_LAT_FIT_SCAN, h);
+    print_histogram(fp, "mm_fit_scan_blocks", "find_fit", h, 1.0);
+    free(h);
+}
+
+/*
+ * mm_metrics_write - Write the current statistics to path in Prometheus
+ *                    text format, replacing the file atomically; returns
+ *                    -1 if it cannot be written
+ */
+int mm_metrics_write(const char* path) {
+    struct mm_stats s;
+    char tmp[4096 + 8];
+    FILE* fp;
+    int k;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp) ||
+        (fp = fopen(tmp, "w")) == NULL)
+        return -1;
+    mm_stats(&s);
+
+    print_metric(fp, "mm_heap_bytes", "gauge", "Bytes of all heap segments.", s.heap_size);
+    print_metric(fp, "mm_live_bytes", "gauge", "Payload bytes requested by allocated blocks.",
+        s.live_bytes);
+    print_metric(fp, "mm_peak_live_bytes", "gauge", "Highest mm_live_bytes since mm_init.",
+        s.peak_live_bytes);
+    print_metric(fp, "mm_allocated_bytes", "gauge", "Bytes of allocated blocks, with overhead.",
+        s.alloc_bytes);
+    print_metric(fp, "mm_allocated_blocks", "gauge", "Allocated blocks.", s.alloc_blocks);
+    print_metric(fp, "mm_free_bytes", "gauge", "Bytes of free blocks.", s.free_bytes);
+    print_metric(fp, "mm_free_blocks", "gauge", "Free blocks.", s.free_blocks);
+    print_metric(fp, "mm_largest_free_bytes", "gauge", "Size of the largest free block.",
+        s.largest_free);
+    print_metric(fp, "mm_fragmentation_ratio", "gauge",
+        "Share of the heap not holding requested bytes.",
+        s.heap_size ? 1.0 - (double)s.live_bytes / s.heap_size : 0);
+    print_metric(fp, "mm_external_fragmentation_ratio", "gauge",
+        "Share of the free bytes outside the largest free block.",
+        s.free_bytes ? 1.0 - (double)s.largest_free / s.free_bytes : 0);
+    print_metric(fp, "mm_extends_total", "counter", "Times the heap was grown.", s.extends);
+    print_metric(fp, "mm_mallocs_total", "counter", "Allocation requests.", s.mallocs);
+    print_metric(fp, "mm_frees_total", "counter", "Free requests.", s.frees);
+    print_metric(fp, "mm_lock_acquisitions_total", "counter", "Acquisitions of the heap lock.",
+        s.lock.acquisitions);
+    print_metric(fp, "mm_lock_contended_total", "counter",
+        "Acquisitions of the heap lock that had to wait.", s.lock.contended);
+    print_metric(fp, "mm_lock_wait_seconds_total", "counter",
+        "Time spent waiting for the heap lock.", s.lock.wait_ns / 1e9);
+    print_metric(fp, "mm_lock_max_hold_seconds", "gauge",
+        "Longest sampled hold of the heap lock.", s.lock.max_hold_ns / 1e9);
+
+    /* size classes, labelled with the smallest block size they hold */
+    fprintf(fp, "# HELP mm_class_blocks Blocks per size class.\n# TYPE mm_class_blocks gauge\n");
+    for (k = 0; k < MM_STATS_CLASSES; k++) {
+        struct mm_class_stats* c = &s.classes[k];
+        if (c->alloc_blocks == 0 && c->free_blocks == 0 && c->mallocs == 0)
+            continue;
+        fprintf(fp, "mm_class_blocks{class=\"%lu\",state=\"allocated\"} %zu\n", 32UL << k,
+            c->alloc_blocks);
+        fprintf(fp, "mm_class_blocks{class=\"%lu\",state=\"free\"} %zu\n", 32UL << k,
+            c->free_blocks);
+    }
+    fprintf(fp, "# HELP mm_class_mallocs_total Requests placed per size class.\n");
+    fprintf(fp, "# TYPE mm_class_mallocs_total counter\n");
+    for (k = 0; k < MM_STATS_CLASSES; k++)
+        if (s.classes[k].mallocs != 0)
+            fprintf(fp, "mm_class_mallocs_total{class=\"%lu\"} %lu\n", 32UL << k,
+                (unsigned long)s.classes[k].mallocs);
+
+    print_threads(fp);
+    print_latencies(fp);
+
+    if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * export_loop - body of the exporter thread
+ */
+static void* export_loop(void* arg) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&metrics_lock);
+    while (!stopping) {
+        mm_metrics_write(metrics_path);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += metrics_interval_ms / 1000;
+        deadline.tv_nsec += (long)(metrics_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!stopping && pthread_cond_timedwait(&metrics_wake, &metrics_lock, &deadline) == 0)
+            ;
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    return arg;
+}
+
+/*
+ * mm_metrics_start - Rewrite path every interval_ms milliseconds
+ *                    (MM_METRICS_INTERVAL_MS if 0) from a background
+ *                    thread, replacing any exporter already running;
+ *                    returns -1 if the thread cannot be started
+ */
+int mm_metrics_start(const char* path, unsigned interval_ms) {
+    int err;
+
+    if (strlen(path) >= sizeof(metrics_path))
+        return -1;
+    mm_metrics_stop();
+    pthread_mutex_lock(&metrics_lock);
+    strcpy(metrics_path, path);
+    metrics_interval_ms = interval_ms ? interval_ms : MM_METRICS_INTERVAL_MS;
+    stopping = false;
+    err = pthread_create(&exporter, NULL, export_loop, NULL);
+    running = err == 0;
+    pthread_mutex_unlock(&metrics_lock);
+    return err == 0 ? 0 : -1;
+}
+
+/*
+ * mm_metrics_stop - Stop the exporter thread, if any, after it writes
+ *                   the file one last time
+ */
+void mm_metrics_stop(void) {
+    pthread_mutex_lock(&metrics_lock);
+    if (!running) {
+        pthread_mutex_unlock(&metrics_lock);
+        return;
+    }
+    stopping = true;
+    running = false;
+    pthread_cond_signal(&metrics_wake);
+    pthread_mutex_unlock(&metrics_lock);
+    pthread_join(exporter, NULL);
+    mm_metrics_write(metrics_path);
+}
+
+void metrics_from_env(void) {
+    const char* path = getenv("MM_METRICS_FILE");
+    const char* interval = getenv("MM_METRICS_INTERVAL_MS");
+    bool started;
+
+    if (path == NULL || *path == '\0')
+        return;
+    pthread_mutex_lock(&metrics_lock);
+    started = running;
+    pthread_mutex_unlock(&metrics_lock);
+    if (!started && mm_metrics_start(path, interval ? strtoul(interval, NULL, 10) : 0) < 0)
+        fprintf(stderr, "mm: could not start the metrics exporter for %s\n", path);
+}
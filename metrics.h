@@ -0,0 +1,16 @@
+/*
+ * metrics.h - Metrics exporter, internal interface used by mm.c
+ *
+ * The public controls (mm_metrics_start, mm_metrics_stop,
+ * mm_metrics_write) are declared in mm.h.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+ * metrics_from_env - start the exporter if MM_METRICS_FILE is set and
+ *                    it is not running yet; called by mm_init
+ */
+void metrics_from_env(void);
+
+#endif /* METRICS_H */
@@ -4,15 +4,22 @@
  *
  * Each block has header and footer of the form:
  *
- *      63       32   31        1   0
- *      --------------------------------
- *     |   unused   | block_size | a/f |
- *      --------------------------------
+ *      63            16 15       2   1    0
+ *      ------------------------------------
+ *     | block_size     |  slack   | s | a/f |
+ *      ------------------------------------
  *
- * a/f is 1 iff the block is allocated. The list has the following form:
+ * a/f is 1 iff the block is allocated. Block sizes are 48 bits wide, so
+ * a single block may span the whole address space. The header of an
+ * allocated block also records whether the heap profiler sampled it (s)
+ * and, as slack, how many bytes of the block exceed the payload size
+ * that was asked for (for mm_stats). The slack of a block is its
+ * alignment padding plus any remainder place did not split off, which
+ * the bound on split_min keeps within 14 bits. The heap is made of
+ * segments, each of the following form:
  *
  * begin                                       end
- * heap                                       heap
+ * segment                                 segment
  *  ----------------------------------------------
  * | hdr(8:a) | zero or more usr blks | hdr(0:a) |
  *  ----------------------------------------------
@@ -20,16 +27,77 @@
  * | block    |                       | block    |
  *
  * The allocated prologue and epilogue blocks are overhead that
- * eliminate edge conditions during coalescing.
+ * eliminate edge conditions during coalescing, and keep coalescing
+ * within a segment.
+ *
+ * Segments are grown at the break with mem_sbrk; where something else
+ * (the page heap, below) took the break since, a new segment starts
+ * after it. When the break can not grow (any further), mm_init and
+ * extend_heap map a new segment with mem_map instead; a mapped segment
+ * is unmapped as soon as its blocks coalesce into one free block, unless
+ * it is the last one left. The segments are kept in a table in address
+ * order, so every walk over the heap still visits the blocks in address
+ * order.
+ *
+ * Requests whose block would be SPAN_MIN bytes or more bypass the free
+ * list and take whole pages from the page heap: runs of pages (spans)
+ * carved from arenas, which are segments without prologue, epilogue or
+ * any other boundary tags. A span's metadata lives out of band, and a
+ * three-level radix tree over page numbers (the pagemap) leads from the
+ * first and the last page of every span to it; that is all mm_free
+ * needs to find a span and a freed span needs to find the spans next to
+ * it. Free spans sit on lists by length and are merged with their free
+ * neighbours in the same arena; a mapped arena that is all free again is
+ * unmapped. mm_realloc grows or shrinks a span in place when the pages
+ * after it are free, or when its arena ends at the break. Span payloads
+ * are page aligned, which mm_memalign relies on.
+ *
+ * The heap and its free list are shared by all threads and guarded by
+ * a single heap lock, taken by mm_malloc, mm_free, mm_checkheap,
+ * mm_heap_walk, mm_heap_dump and mm_stats.
+ *
+ * mm_checkheap checks every block and the free list in one pass.
+ * mm_checkheap_step checks a bounded number of blocks per call from a
+ * cursor that coalesce keeps on a block boundary, and
+ * mm_checkheap_parallel splits the heap among threads; both check the
+ * same per-block invariants, the free list links included.
+ *
+ * The statistics reported by mm_stats are updated as blocks change
+ * state: place, coalesce and extend_heap move bytes between the free
+ * and allocated counters, mm_malloc and mm_free track requested bytes.
+ *
+ * Built with -DMM_LATENCY (make MM_LATENCY=1), mm_malloc, mm_free,
+ * mm_realloc and extend_heap are timed with the tick counter and the
+ * free blocks each find_fit looks at are counted, into histograms of
+ * the calling thread that mm_latency adds up on demand.
+ *
+ * Built with -DMM_FLIGHT (make MM_FLIGHT=1), every request is also
+ * appended to the calling thread's flight recorder ring (flight.h).
+ *
+ * Hooks installed with mm_set_hooks run from separate, out-of-line
+ * wrappers (malloc_hooked and friends); the request paths themselves
+ * only test whether hooks are installed.
+ *
+ * The USDT probes of probes.h mark requests, find_fit misses, heap
+ * growth, coalescing and splits for bpftrace, perf and stap.
  */
+#include "flight.h"
+#include "heapdump.h"
+#include "heapprof.h"
 #include "memlib.h"
+#include "metrics.h"
 #include "mm.h"
+#include "probes.h"
+#include "timer.h"
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
  /* Your info */
@@ -78,17 +146,19 @@ team_t team = {
 #define SET_PREV(bp, np)   (GET_PREV(bp) = np)
 
 typedef struct {
-    uint32_t allocated : 1;
-    uint32_t block_size : 31;
-    uint32_t _;
+    uint64_t allocated : 1;
+    uint64_t sampled : 1;     /* tracked by the heap profiler */
+    uint64_t slack : 14;      /* block_size - OVERHEAD - requested bytes, allocated blocks only */
+    uint64_t block_size : 48;
 } header_t;
 
 typedef header_t footer_t;
 
 typedef struct block_t {
-    uint32_t allocated : 1;
-    uint32_t block_size : 31;
-    uint32_t _;
+    uint64_t allocated : 1;
+    uint64_t sampled : 1;
+    uint64_t slack : 14;
+    uint64_t block_size : 48;
     union {
         struct {
             struct block_t* next;
@@ -98,45 +168,257 @@ typedef struct block_t {
     } body;
 } block_t;
 
+_Static_assert(sizeof(header_t) == 8, "a header or footer must stay one word");
+
+/* A contiguous part of the heap: a prologue, blocks and an epilogue, or an arena of spans */
+typedef struct {
+    char* start;  /* the prologue; for an arena, the padding before its first page */
+    size_t size;  /* bytes, prologue and epilogue included */
+    bool mapped;  /* mapped with mem_map, not grown with mem_sbrk */
+    bool spans;   /* an arena of the page heap rather than blocks */
+} segment_t;
+
+/* A run of pages of the page heap, described out of band */
+typedef struct span {
+    char* start;        /* the first page, which is also the payload */
+    size_t npages;
+    char* arena;        /* start of the arena segment the span lies in */
+    struct span* next;  /* free spans: the free list; dead ones: the spare list */
+    struct span* prev;
+    size_t requested;   /* payload bytes asked for, allocated spans only */
+    uint8_t state;      /* one of enum span_state */
+    uint8_t sampled;    /* tracked by the heap profiler */
+} span_t;
+
+enum span_state {
+    SPAN_DEAD,  /* describes nothing; stale pagemap entries may still lead here */
+    SPAN_FREE,
+    SPAN_USED
+};
+
 /* This enum can be used to set the allocated bit in the block */
 enum block_state {
     FREE,
     ALLOC
 };
 
-#define CHUNKSIZE (1 << 16) /* initial heap size (bytes) */
+#define CHUNKSIZE (1 << 16) /* default initial heap size and growth step (bytes) */
 #define OVERHEAD (sizeof(header_t) + sizeof(footer_t)) /* overhead of the header and footer of an allocated block */
+#define LOCK_HOLD_SAMPLE 64 /* uncontended acquisitions per timed lock hold */
 #define MIN_BLOCK_SIZE (32) /* the minimum block size needed to keep in a freelist (header + footer + next pointer + prev pointer) */
+#define MAX_BLOCK_SIZE ((((size_t)1 << 48) - 1) & ~(size_t)7) /* largest size the header can hold */
+#define MAX_SPLIT_MIN 8192 /* keeps the slack of allocated blocks below 1 << 14 */
+#define MAX_SEGMENTS 4096 /* segments the heap can be made of */
+#define SEGMENT_MIN (1 << 20) /* smallest mapped segment (bytes) */
+#define PAGE_SHIFT 12 /* pages of the page heap are 4 KiB */
+#define PAGE_SIZE ((size_t)1 << PAGE_SHIFT)
+#define SPAN_MIN (1 << 16) /* smallest block that is a span instead (bytes, overhead included) */
+#define SPAN_LISTS 128 /* free span lists: one per length below SPAN_LISTS pages, then one for the rest */
+#define PAGEMAP_BITS 12 /* bits of the page number resolved by each level of the pagemap */
+#define PAGEMAP_MASK (((uintptr_t)1 << PAGEMAP_BITS) - 1)
+#define META_CHUNK (1 << 20) /* bytes mapped at a time for span and pagemap metadata */
+#define SMALL_SIZES (SPAN_MIN >> 3) /* free sizes below SPAN_MIN, counted one by one */
+#define LARGE_MIN_SIZES 256 /* room for larger free sizes to start with */
+
+/* Nodes of the pagemap, which covers 48-bit addresses in three levels */
+typedef struct {
+    span_t* spans[1 << PAGEMAP_BITS];
+} pagemap_leaf_t;
+
+typedef struct {
+    pagemap_leaf_t* leaves[1 << PAGEMAP_BITS];
+} pagemap_node_t;
+
+/* A free size of SPAN_MIN bytes or more, and the free blocks and spans of that size */
+typedef struct {
+    size_t size;
+    size_t count;
+} large_size_t;
+
+/* The requests of one thread; only that thread writes the counts */
+typedef struct thread_rec {
+    struct mm_thread_stats stats;
+    struct thread_rec* next;
+    struct thread_rec* prev;
+    bool listed; /* on thread_recs */
+} thread_rec_t;
 
 /* Global variables */
-static block_t* prologue; /* pointer to first block */
+static segment_t segments[MAX_SEGMENTS]; /* the heap, in address order */
+static int nsegments; /* segments in use */
+static size_t mapped_bytes; /* bytes of the mapped segments */
+static int narenas; /* segments that are arenas of the page heap */
+static pagemap_node_t* pagemap[1 << PAGEMAP_BITS]; /* page number to span, see pagemap_get */
+static span_t* span_lists[SPAN_LISTS]; /* free spans, by length */
+static span_t* spare_spans; /* dead span descriptors for reuse */
+static char* meta_next; /* unused part of the last metadata chunk */
+static char* meta_end;
 static block_t* freerootptr; /* pointer to first free block of explicit list*/
+static block_t* rover; /* next fit: free block the next search starts at */
+static block_t* check_cursor; /* next block for mm_checkheap_step, NULL at the start of a pass */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER; /* guards the heap and free list */
+static struct mm_stats stats; /* heap statistics, guarded by heap_lock; thread is unused */
+/* every free size, for the largest (see small_size); guarded by heap_lock */
+static size_t small_counts[SMALL_SIZES]; /* free blocks and spans of each size below SPAN_MIN */
+static uint64_t small_bits[SMALL_SIZES / 64]; /* the sizes whose count is not 0 */
+static uint64_t small_words[SMALL_SIZES / 64 / 64]; /* the words of small_bits that are not 0 */
+static large_size_t* large_sizes; /* the larger sizes, ascending */
+static size_t large_count; /* entries of large_sizes */
+static size_t large_capacity; /* entries large_sizes has room for */
+static uint64_t lock_acquired; /* ticks when heap_lock was taken, 0 if the hold is not timed */
+static __thread thread_rec_t thread_self; /* requests of this thread */
+static thread_rec_t* thread_recs; /* every running thread that has made a request */
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER; /* guards thread_recs */
+static pthread_key_t thread_key; /* unlinks a thread's record when it exits */
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static __thread int64_t sample_countdown; /* bytes until this thread's next profile sample */
+static const struct mm_hooks* volatile hooks; /* installed hooks, NULL if none */
+static __thread int hook_depth; /* inside a hooked request; nested requests run no hooks */
+
+/* Tunables, set by mm_configure before mm_init */
+static int fit_policy = MM_FIRST_FIT; /* placement policy of find_fit */
+static size_t split_min = MIN_BLOCK_SIZE; /* smallest remainder place splits off */
+static size_t chunksize = CHUNKSIZE; /* initial heap size and minimum growth step */
+
+#ifdef MM_LATENCY
+/* Latency histograms of one thread; only that thread writes them */
+typedef struct lat_thread {
+    struct lat_thread* next;
+    hist_t hists[MM_LAT_NUM];
+} lat_thread_t;
+
+static lat_thread_t* lat_threads; /* every thread that has recorded, newest first */
+static pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER; /* guards lat_threads */
+static __thread lat_thread_t* lat_self;
+
+static void lat_record(int op, uint64_t v);
+#define LAT_START(t) uint64_t t = read_ticks()
+#define LAT_END(op, t) lat_record(op, read_ticks() - (t))
+#define LAT_VALUE(op, v) lat_record(op, v)
+#else
+#define LAT_START(t)
+#define LAT_END(op, t)
+#define LAT_VALUE(op, v) ((void)(v))
+#endif
+
+#ifdef MM_FLIGHT
+/* inside mm_realloc, whose one event stands for its mm_malloc and mm_free */
+static __thread int flight_nested;
+#define FLIGHT(op, size, addr, newaddr)                \
+    do {                                               \
+        if (!flight_nested)                            \
+            flight_record(op, size, addr, newaddr);    \
+    } while (0)
+#define FLIGHT_NEST(d) (flight_nested += (d))
+#else
+#define FLIGHT(op, size, addr, newaddr)
+#define FLIGHT_NEST(d)
+#endif
 
 /* function prototypes for internal helper routines */
 static block_t* extend_heap(size_t words);
+static block_t* grow_brk(size_t* size);
+static block_t* map_segment(size_t* size);
+static segment_t* add_segment(char* start, size_t size, bool mapped, bool spans);
+static void remove_segment(segment_t* seg);
+static void release_segment(segment_t* seg, block_t* block);
+static segment_t* find_segment(const void* p);
+static segment_t* next_block_segment(segment_t* seg);
+static inline size_t segment_head(const segment_t* seg);
+static inline size_t segment_tail(const segment_t* seg);
+static span_t* alloc_span(size_t npages);
+static void free_span(span_t* span);
+static bool resize_span(span_t* span, size_t size);
+static inline span_t* span_of(const void* payload);
+static span_t* first_span(const segment_t* seg);
+static span_t* next_span(const segment_t* seg, const span_t* span);
+static int check_arena(const segment_t* seg, int verbose, size_t* alloc_bytes, size_t* free_bytes, size_t* free_spans);
+static int check_span_lists(size_t free_spans);
+static inline block_t* first_block(const segment_t* seg);
 static void place(block_t* block, size_t asize);
 static block_t* find_fit(size_t asize);
 static block_t* coalesce(block_t* block);
 static footer_t* get_footer(block_t* block);
+static inline size_t get_requested(const block_t* block);
+static inline void set_requested(block_t* block, size_t requested);
+static size_t requested_size(void* payload);
 static void printblock(block_t* block);
-static void checkblock(block_t* block);
+static int checkblock(const segment_t* seg, block_t* block);
+static bool in_heap(const void* p);
+static inline void count_free(size_t size, int delta);
+static inline void small_size(size_t size, int delta);
+static void large_size_add(size_t size);
+static void large_size_remove(size_t size);
+static void free_sizes_reset(void);
+static size_t largest_free_size(void);
+static inline void count_alloc(size_t size, int delta);
+static inline void thread_count(uint64_t* counter, uint64_t n);
+static inline void lock_heap(void);
+static inline void unlock_heap(void);
+static void* malloc_hooked(const struct mm_hooks* h, size_t size, bool pages);
+static void free_hooked(const struct mm_hooks* h, void* payload);
+static void* realloc_hooked(const struct mm_hooks* h, void* ptr, size_t size);
+
+/*
+ * mm_configure - Choose the placement policy, split threshold and heap
+ *                growth step. Must be called before mm_init; returns -1
+ *                and changes nothing if a value is out of range.
+ */
+int mm_configure(const struct mm_config* config) {
+    if (config->fit < MM_FIRST_FIT || config->fit > MM_BEST_FIT)
+        return -1;
+    if (config->split_min < MIN_BLOCK_SIZE || config->split_min > MAX_SPLIT_MIN || config->split_min % 8)
+        return -1;
+    if (config->chunksize < 4 * MIN_BLOCK_SIZE || config->chunksize % 8 || config->chunksize > MAX_BLOCK_SIZE)
+        return -1;
+    fit_policy = config->fit;
+    split_min = config->split_min;
+    chunksize = config->chunksize;
+    return 0;
+}
 
 /*
  * mm_init - Initialize the memory manager
  */
  /* $begin mminit */
 int mm_init(void) {
-    /* create the initial empty heap */
-    if ((prologue = mem_sbrk(CHUNKSIZE)) == (void*)-1)
+    block_t* init_block;
+    size_t size = chunksize - OVERHEAD;
+
+    /* the lock keeps mm_stats callers such as the metrics exporter out */
+    lock_heap();
+    /* give back the segments mapped for the previous heap, and the spans
+       of its arenas, whose descriptors outlive the heap's pages */
+    for (int i = 0; i < nsegments; i++) {
+        segment_t* seg = &segments[i];
+        for (span_t *span = first_span(seg), *next; span != NULL; span = next) {
+            next = next_span(seg, span);
+            span->state = SPAN_DEAD;
+            span->next = spare_spans;
+            spare_spans = span;
+        }
+        if (seg->mapped)
+            mem_unmap(seg->start, seg->size);
+    }
+    nsegments = 0;
+    narenas = 0;
+    mapped_bytes = 0;
+    memset(span_lists, 0, sizeof(span_lists));
+    memset(&stats, 0, sizeof(stats));
+    free_sizes_reset();
+    /* create the initial empty heap, in a mapped segment if the break can not grow */
+    if ((init_block = grow_brk(&size)) == NULL && (init_block = map_segment(&size)) == NULL) {
+        unlock_heap();
         return -1;
-    /* initialize the prologue */
-    prologue->allocated = ALLOC;
-    prologue->block_size = sizeof(header_t);
+    }
     /* initialize the first free block */
-    block_t* init_block = (void*)prologue + sizeof(header_t);
     init_block->allocated = FREE;
-    init_block->block_size = CHUNKSIZE - OVERHEAD;
+    init_block->block_size = size;
     freerootptr = init_block;
+    rover = NULL;
+    check_cursor = NULL;
+    count_free(init_block->block_size, 1);
+    heapprof_reset();
     freerootptr->body.next = NULL;
     freerootptr->body.prev = NULL;
     footer_t* init_footer = get_footer(init_block);
@@ -146,23 +428,35 @@ int mm_init(void) {
     block_t* epilogue = (void*)init_block + init_block->block_size;
     epilogue->allocated = ALLOC;
     epilogue->block_size = 0;
+    unlock_heap();
+    metrics_from_env();
     return 0;
 }
 /* $end mminit */
 
 /*
- * mm_malloc - Allocate a block with at least size bytes of payload
+ * malloc_request - Allocate a block with at least size bytes of payload,
+ *                  or a span of whole pages if pages is true or the block
+ *                  would be large
  */
- /* $begin mmmalloc */
-void* mm_malloc(size_t size) {
-    uint32_t asize;       /* adjusted block size */
-    uint32_t extendsize;  /* amount to extend heap if no fit */
-    uint32_t extendwords; /* number of words to extend heap if no fit */
-    block_t* block;
-
-    /* Ignore spurious requests */
-    if (size == 0)
+static inline __attribute__((always_inline)) void* malloc_request(size_t size, bool pages) {
+    size_t requested = size;
+    size_t asize;       /* adjusted block size */
+    size_t extendsize;  /* amount to extend heap if no fit */
+    size_t extendwords; /* number of words to extend heap if no fit */
+    block_t* block = NULL;
+    span_t* span = NULL;
+    void* payload;
+    const struct mm_hooks* h = hooks;
+
+    if (__builtin_expect(h != NULL, 0) && hook_depth == 0)
+        return malloc_hooked(h, size, pages);
+    MM_PROBE(malloc_entry, size);
+    /* Ignore spurious requests, and ones no block header can describe */
+    if (size == 0 || size > MAX_BLOCK_SIZE - OVERHEAD) {
+        MM_PROBE(malloc_return, size, NULL);
         return NULL;
+    }
 
     /* Adjust block size to include overhead and alignment reqs. */
     size += OVERHEAD;
@@ -173,58 +467,182 @@ void* mm_malloc(size_t size) {
         asize = MIN_BLOCK_SIZE;
     }
 
+    /* the mark is set under the lock, since other threads read the
+       header there; heapprof_sample takes the stack after unlocking */
+    bool sample = (sample_countdown -= requested) < 0;
+
+    LAT_START(lat_start);
+    lock_heap();
+
+    /* Large requests take whole pages from the page heap */
+    if (__builtin_expect(asize >= SPAN_MIN || pages, 0)) {
+        if ((span = alloc_span((requested + PAGE_SIZE - 1) >> PAGE_SHIFT)) == NULL)
+            goto fail;
+        span->sampled = sample;
+        span->requested = requested;
+        payload = span->start;
+        goto done;
+    }
+
     /* Search the free list for a fit */
     if ((block = find_fit(asize)) != NULL) {
         place(block, asize);
-        return block->body.payload;
+        goto placed;
     }
 
     /* No fit found. Get more memory and place the block */
-    extendsize = (asize > CHUNKSIZE) // extend by the larger of the two
+    extendsize = (asize > chunksize) // extend by the larger of the two
         ? asize
-        : CHUNKSIZE;
+        : chunksize;
     extendwords = extendsize >> 3; // extendsize/8
-    if ((block = extend_heap(extendwords)) != NULL) {
+    LAT_START(lat_extend);
+    block = extend_heap(extendwords);
+    LAT_END(MM_LAT_EXTEND, lat_extend);
+    if (block != NULL) {
         place(block, asize);
-        return block->body.payload;
+        goto placed;
     }
+fail:
+    unlock_heap();
+    LAT_END(MM_LAT_MALLOC, lat_start);
+    MM_PROBE(malloc_return, requested, NULL);
     /* no more memory :( */
     return NULL;
+
+placed:
+    block->sampled = sample;
+    set_requested(block, requested);
+    payload = block->body.payload;
+done:
+    stats.live_bytes += requested;
+    if (stats.live_bytes > stats.peak_live_bytes)
+        stats.peak_live_bytes = stats.live_bytes;
+    stats.mallocs++;
+    unlock_heap();
+    thread_count(&thread_self.stats.mallocs, 1);
+    thread_count(&thread_self.stats.bytes_allocated, requested);
+    /* a marked block the profiler did not take is only looked up in vain */
+    if (__builtin_expect(sample, 0))
+        heapprof_sample(payload, requested, &sample_countdown);
+    FLIGHT(TR_MALLOC, requested, payload, NULL);
+    LAT_END(MM_LAT_MALLOC, lat_start);
+    MM_PROBE(malloc_return, requested, payload);
+    return payload;
+}
+
+/*
+ * mm_malloc - Allocate a block with at least size bytes of payload
+ */
+ /* $begin mmmalloc */
+void* mm_malloc(size_t size) {
+    return malloc_request(size, false);
 }
 /* $end mmmalloc */
 
+/*
+ * mm_memalign - Allocate size bytes of payload aligned to alignment, a
+ *               power of two no larger than a page. Every payload is 8
+ *               byte aligned; anything more is served with a span, whose
+ *               payload starts a page. NULL if alignment is not valid.
+ */
+void* mm_memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > PAGE_SIZE)
+        return NULL;
+    return malloc_request(size, alignment > 8);
+}
+
 /*
  * mm_free - Free a block
  */
  /* $begin mmfree */
 void mm_free(void* payload) {
+    const struct mm_hooks* h = hooks;
+
+    if (__builtin_expect(h != NULL, 0) && hook_depth == 0) {
+        free_hooked(h, payload);
+        return;
+    }
+    LAT_START(lat_start);
+    FLIGHT(TR_FREE, 0, payload, NULL);
+    span_t* span = span_of(payload);
+    size_t requested;
+    if (__builtin_expect(span != NULL, 0)) {
+        requested = span->requested;
+        MM_PROBE(free, payload, requested);
+        if (span->sampled)
+            heapprof_forget(payload);
+        lock_heap();
+        stats.live_bytes -= requested;
+        stats.frees++;
+        free_span(span);
+        goto freed;
+    }
     block_t* block = payload - sizeof(header_t);
+    requested = get_requested(block);
+    MM_PROBE(free, payload, requested);
+    if (block->sampled)
+        heapprof_forget(payload);
+    lock_heap();
+    stats.live_bytes -= requested;
+    stats.frees++;
+    count_alloc(block->block_size, -1);
+    count_free(block->block_size, 1);
     block->allocated = FREE;
     footer_t* footer = get_footer(block);
     footer->allocated = FREE;
-    coalesce(block);
+    block = coalesce(block);
+    /* a free block between a prologue and an epilogue fills its segment */
+    if (((header_t*)((void*)block - sizeof(header_t)))->block_size == sizeof(header_t) &&
+        ((header_t*)((void*)block + block->block_size))->block_size == 0) {
+        segment_t* seg = find_segment(block);
+        if (seg->mapped && nsegments - narenas > 1)
+            release_segment(seg, block);
+    }
+freed:
+    unlock_heap();
+    thread_count(&thread_self.stats.frees, 1);
+    thread_count(&thread_self.stats.bytes_freed, requested);
+    LAT_END(MM_LAT_FREE, lat_start);
 }
 
 /* $end mmfree */
 
 /*
- * mm_realloc - naive implementation of mm_realloc
- * NO NEED TO CHANGE THIS CODE!
+ * mm_realloc - naive implementation of mm_realloc, except that spans
+ * are resized in place when the pages after them allow it
+ * (mm_malloc and mm_free take the heap lock; the old block stays
+ * allocated to the caller while it is copied, so the copy needs none)
  */
 void* mm_realloc(void* ptr, size_t size) {
     void* newp;
     size_t copySize;
-
+    const struct mm_hooks* h = hooks;
+
+    if (__builtin_expect(h != NULL, 0) && hook_depth == 0)
+        return realloc_hooked(h, ptr, size);
+    LAT_START(lat_start);
+    /* a span that stays one grows or shrinks in place where it can */
+    span_t* span = span_of(ptr);
+    if (span != NULL && size >= SPAN_MIN - OVERHEAD && size <= MAX_BLOCK_SIZE - OVERHEAD &&
+        resize_span(span, size)) {
+        FLIGHT(TR_REALLOC, size, ptr, ptr);
+        LAT_END(MM_LAT_REALLOC, lat_start);
+        return ptr;
+    }
+    FLIGHT_NEST(1);
     if ((newp = mm_malloc(size)) == NULL) {
         printf("ERROR: mm_malloc failed in mm_realloc\n");
         exit(1);
     }
     block_t* block = ptr - sizeof(header_t);
-    copySize = block->block_size;
+    copySize = span != NULL ? span->npages << PAGE_SHIFT : block->block_size;
     if (size < copySize)
         copySize = size;
     memcpy(newp, ptr, copySize);
     mm_free(ptr);
+    FLIGHT_NEST(-1);
+    FLIGHT(TR_REALLOC, size, ptr, newp);
+    LAT_END(MM_LAT_REALLOC, lat_start);
     return newp;
 }
 
@@ -232,44 +650,477 @@ void* mm_realloc(void* ptr, size_t size) {
  * mm_checkheap - Check the heap for consistency
  */
 void mm_checkheap(int verbose) {
-    block_t* block = prologue;
+    block_t* block;
+    size_t free_bytes = 0, free_blocks = 0, alloc_bytes = 0, heap_size = 0, listed = 0;
+    size_t free_spans = 0, largest = 0;
 
-    if (verbose)
-        printf("Heap (%p):\n", prologue);
+    lock_heap();
 
-    if (block->block_size != sizeof(header_t) || !block->allocated)
-        printf("Bad prologue header\n");
-    checkblock(prologue);
+    for (int i = 0; i < nsegments; i++) {
+        segment_t* seg = &segments[i];
+        header_t* prologue = (header_t*)seg->start;
+
+        if (verbose)
+            printf("Heap %s (%p, %zu bytes%s):\n", seg->spans ? "arena" : "segment", seg->start,
+                seg->size, seg->mapped ? ", mapped" : "");
+        if (i > 0 && seg->start < segments[i - 1].start + segments[i - 1].size)
+            printf("Error: segment at %p overlaps the one before\n", seg->start);
+        heap_size += seg->size;
+        if (seg->spans) {
+            check_arena(seg, verbose, &alloc_bytes, &free_bytes, &free_spans);
+            continue;
+        }
+
+        if (prologue->block_size != sizeof(header_t) || !prologue->allocated)
+            printf("Bad prologue header\n");
+
+        /* iterate through the segment (both free and allocated blocks will be present) */
+        for (block = first_block(seg); block->block_size > 0; block = (void*)block + block->block_size) {
+            if (verbose)
+                printblock(block);
+            if (checkblock(seg, block) < 0)
+                break;
+            if (block->allocated) {
+                alloc_bytes += block->block_size;
+            }
+            else {
+                free_bytes += block->block_size;
+                free_blocks++;
+            }
+        }
 
-    /* iterate through the heap (both free and allocated blocks will be present) */
-    for (block = (void*)prologue + prologue->block_size; block->block_size > 0; block = (void*)block + block->block_size) {
         if (verbose)
             printblock(block);
-        checkblock(block);
+        if (block->block_size != 0 || !block->allocated ||
+            (char*)block != seg->start + seg->size - sizeof(header_t))
+            printf("Bad epilogue header\n");
+    }
+
+    /* every free block must be on the free list, and nothing else */
+    for (block = freerootptr; block != NULL && listed <= free_blocks; block = block->body.next) {
+        listed++;
+        largest = MAX(largest, block->block_size);
+    }
+    if (listed > free_blocks)
+        printf("Error: free list is longer than the %zu free blocks in the heap\n", free_blocks);
+    else if (listed < free_blocks)
+        printf("Error: %zu free blocks in the heap but %zu on the free list\n", free_blocks, listed);
+    check_span_lists(free_spans);
+    for (int i = 0; i < SPAN_LISTS; i++)
+        for (span_t* span = span_lists[i]; span != NULL; span = span->next)
+            largest = MAX(largest, span->npages << PAGE_SHIFT);
+    if (largest != largest_free_size())
+        printf("Error: the largest free size is %zu, not %zu\n", largest, largest_free_size());
+    if (free_bytes != stats.free_bytes || free_blocks + free_spans != stats.free_blocks ||
+        alloc_bytes != stats.alloc_bytes || heap_size != stats.heap_size)
+        printf("Error: heap statistics do not match the heap\n");
+    unlock_heap();
+}
+
+/*
+ * mm_checkheap_step - Check at most max_blocks blocks, continuing where
+ *                     the previous call stopped. Returns the number of
+ *                     problems found; *wrapped (if not NULL) is set to 1
+ *                     when the call finished a pass over the heap.
+ */
+int mm_checkheap_step(size_t max_blocks, int* wrapped) {
+    int errors = 0, rc;
+    segment_t* seg;
+    block_t* block;
+
+    lock_heap();
+    if (check_cursor == NULL || (seg = find_segment(check_cursor)) == NULL) {
+        seg = next_block_segment(segments);
+        block = first_block(seg);
+    }
+    else {
+        block = check_cursor;
+    }
+    while (max_blocks > 0) {
+        if (block->block_size == 0) {
+            /* the epilogue of a segment; go on with the next one */
+            if (next_block_segment(seg + 1) == NULL)
+                break;
+            seg = next_block_segment(seg + 1);
+            block = first_block(seg);
+            continue;
+        }
+        if ((rc = checkblock(seg, block)) < 0) {
+            /* the heap can not be walked past a bad size; start over */
+            errors++;
+            seg = next_block_segment(segments);
+            block = first_block(seg);
+            break;
+        }
+        errors += rc;
+        block = (void*)block + block->block_size;
+        max_blocks--;
     }
+    if (block->block_size == 0 && next_block_segment(seg + 1) == NULL) {
+        check_cursor = NULL;
+        if (wrapped != NULL)
+            *wrapped = 1;
+    }
+    else {
+        check_cursor = block;
+        if (wrapped != NULL)
+            *wrapped = 0;
+    }
+    unlock_heap();
+    return errors;
+}
 
-    if (verbose)
-        printblock(block);
-    if (block->block_size != 0 || !block->allocated)
-        printf("Bad epilogue header\n");
+/* A range of the heap checked by one thread of mm_checkheap_parallel */
+typedef struct {
+    int seg;        /* segment of start */
+    block_t* start;
+    block_t* end;   /* start of the next range, NULL for the last */
+    int errors;
+} check_range_t;
+
+static void* check_range(void* arg) {
+    check_range_t* r = arg;
+    segment_t* seg = &segments[r->seg];
+    int rc;
+
+    for (block_t* b = r->start; b != r->end; ) {
+        if (b->block_size == 0) {
+            if ((seg = next_block_segment(seg + 1)) == NULL)
+                break;
+            b = first_block(seg);
+            continue;
+        }
+        if ((rc = checkblock(seg, b)) < 0) {
+            r->errors++;
+            break;
+        }
+        r->errors += rc;
+        b = (void*)b + b->block_size;
+    }
+    return NULL;
+}
+
+/*
+ * mm_checkheap_parallel - Check every block with nthreads threads, each
+ *                         taking an equal share of the heap's bytes,
+ *                         while the calling thread walks the free list
+ *                         and checks the page heap.
+ *                         Returns the number of problems found.
+ */
+int mm_checkheap_parallel(int nthreads) {
+    check_range_t ranges[MM_CHECK_MAX_THREADS];
+    pthread_t threads[MM_CHECK_MAX_THREADS];
+    size_t listed = 0, free_blocks, offset = 0, alloc_bytes = 0, free_bytes = 0, free_spans = 0;
+    int i, n = 0, errors = 0;
+    block_t* b;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > MM_CHECK_MAX_THREADS)
+        nthreads = MM_CHECK_MAX_THREADS;
+
+    lock_heap();
+    /* split at the first block boundary past every nth of the heap; only
+       the headers are read here, the checks themselves run in parallel */
+    size_t share = stats.heap_size / nthreads + 1;
+    ranges[0].seg = next_block_segment(segments) - segments;
+    ranges[0].start = first_block(&segments[ranges[0].seg]);
+    n = 1;
+    for (i = 0; i < nsegments && n < nthreads; offset += segments[i++].size) {
+        segment_t* seg = &segments[i];
+        if (seg->spans)
+            continue;
+        for (b = first_block(seg); n < nthreads && b->block_size > 0; ) {
+            if (offset + ((char*)b - seg->start) >= n * share) {
+                ranges[n].seg = i;
+                ranges[n++].start = b;
+            }
+            if ((char*)b + b->block_size > seg->start + seg->size - sizeof(header_t)) {
+                printf("Error: block at %p runs past the end of its segment\n", b);
+                unlock_heap();
+                return 1;
+            }
+            b = (void*)b + b->block_size;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        ranges[i].end = i + 1 < n ? ranges[i + 1].start : NULL;
+        ranges[i].errors = 0;
+    }
+    for (i = 1; i < n; i++)
+        if (pthread_create(&threads[i], NULL, check_range, &ranges[i]) != 0)
+            check_range(&ranges[i]), threads[i] = 0;
+    check_range(&ranges[0]);
+
+    /* the arenas are left to the calling thread */
+    for (i = 0; i < nsegments; i++)
+        if (segments[i].spans)
+            errors += check_arena(&segments[i], 0, &alloc_bytes, &free_bytes, &free_spans);
+    errors += check_span_lists(free_spans);
+
+    free_blocks = stats.free_blocks - free_spans;
+    for (b = freerootptr; b != NULL && listed <= free_blocks; b = b->body.next)
+        listed++;
+    if (listed > free_blocks) {
+        printf("Error: free list is longer than the %zu free blocks counted\n", free_blocks);
+        errors++;
+    }
+    else if (listed < free_blocks) {
+        printf("Error: %zu free blocks counted but %zu on the free list\n", free_blocks, listed);
+        errors++;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (i > 0 && threads[i] != 0)
+            pthread_join(threads[i], NULL);
+        errors += ranges[i].errors;
+    }
+    unlock_heap();
+    return errors;
+}
+
+/*
+ * mm_heap_segments - Call fn for every segment, in address order. fn runs
+ *                    with the heap lock held and must not call back into
+ *                    the allocator.
+ */
+void mm_heap_segments(mm_segment_fn fn, void* arg) {
+    lock_heap();
+    for (int i = 0; i < nsegments; i++)
+        fn(segments[i].start, segments[i].size, segments[i].mapped, arg);
+    unlock_heap();
+}
+
+/*
+ * mm_heap_walk - Call fn for every block of every segment and every span
+ *                of every arena, in address order. fn runs with the heap
+ *                lock held and must not call back into the allocator.
+ */
+void mm_heap_walk(mm_walk_fn fn, void* arg) {
+    block_t* block;
+
+    lock_heap();
+    for (int i = 0; i < nsegments; i++) {
+        segment_t* seg = &segments[i];
+        if (seg->spans) {
+            for (span_t* span = first_span(seg); span != NULL; span = next_span(seg, span))
+                fn(span->start, span->npages << PAGE_SHIFT, span->state == SPAN_USED, arg);
+            continue;
+        }
+        for (block = first_block(seg); block->block_size > 0; block = (void*)block + block->block_size)
+            fn(block->body.payload, block->block_size, block->allocated, arg);
+    }
+    unlock_heap();
+}
+
+/*
+ * write_all - write n bytes to fd, retrying short writes
+ */
+static int write_all(int fd, const uint8_t* buf, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+        if (w <= 0)
+            return -1;
+        buf += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/*
+ * mm_heap_dump - Write a snapshot of every block to fd in the format of
+ *                heapdump.h. The heap lock is held for the whole dump.
+ *                Free list membership is found by marking the slack
+ *                field of the free blocks, which free blocks do not use.
+ *                The segments are written one after the other, the
+ *                boundary between two as a gap record, and the spans
+ *                of an arena as blocks.
+ */
+int mm_heap_dump(int fd) {
+    static uint8_t buf[1 << 16];
+    uint8_t* p = buf;
+    size_t nblocks = 0, nfree = 0, listed = 0;
+    block_t* block;
+    int rc = 0;
+
+    lock_heap();
+    for (int i = 0; i < nsegments; i++) {
+        for (span_t* span = first_span(&segments[i]); span != NULL; span = next_span(&segments[i], span))
+            nblocks++;
+        if (segments[i].spans)
+            continue;
+        for (block = first_block(&segments[i]); block->block_size > 0; block = (void*)block + block->block_size) {
+            nblocks++;
+            if (!block->allocated) {
+                block->slack = 0;
+                nfree++;
+            }
+        }
+    }
+    /* the bound stops a corrupted, cyclic free list */
+    for (block = freerootptr; block != NULL && listed <= nfree; block = block->body.next, listed++)
+        block->slack = 1;
+
+    memcpy(p, HEAPDUMP_MAGIC, HEAPDUMP_MAGIC_LEN);
+    p += HEAPDUMP_MAGIC_LEN;
+    p = put_varint(p, (uintptr_t)segments[0].start);
+    p = put_varint(p, stats.heap_size);
+    p = put_varint(p, segment_head(&segments[0]));
+    p = put_varint(p, nblocks);
+    for (int i = 0; i < nsegments && rc == 0; i++) {
+        segment_t* seg = &segments[i];
+        /* the epilogue of the segment before and the prologue of this one */
+        if (i > 0)
+            p = put_varint(p, (segment_tail(seg - 1) + segment_head(seg)) | HD_SEGMENT);
+        for (span_t* span = first_span(seg); span != NULL; span = next_span(seg, span)) {
+            if (p > buf + sizeof(buf) - 20) {
+                if ((rc = write_all(fd, buf, p - buf)) < 0)
+                    break;
+                p = buf;
+            }
+            /* every free span is on a free list */
+            if (span->state == SPAN_USED) {
+                p = put_varint(p, (span->npages << PAGE_SHIFT) | HD_ALLOCATED);
+                p = put_varint(p, span->requested);
+            }
+            else {
+                p = put_varint(p, (span->npages << PAGE_SHIFT) | HD_LISTED);
+            }
+        }
+        if (seg->spans)
+            continue;
+        for (block = first_block(seg); block->block_size > 0; block = (void*)block + block->block_size) {
+            if (p > buf + sizeof(buf) - 20) {
+                if ((rc = write_all(fd, buf, p - buf)) < 0)
+                    break;
+                p = buf;
+            }
+            if (block->allocated) {
+                p = put_varint(p, block->block_size | HD_ALLOCATED);
+                p = put_varint(p, get_requested(block));
+            }
+            else {
+                p = put_varint(p, block->block_size | (block->slack ? HD_LISTED : 0));
+            }
+        }
+    }
+    if (rc == 0) {
+        p = put_varint(p, 0);
+        rc = write_all(fd, buf, p - buf);
+    }
+    unlock_heap();
+    return rc;
+}
+
+/*
+ * mm_stats - Copy the heap statistics to out, in constant time
+ */
+void mm_stats(struct mm_stats* out) {
+    lock_heap();
+    stats.largest_free = largest_free_size();
+    *out = stats;
+    unlock_heap();
+    out->internal_frag = out->alloc_bytes - out->live_bytes;
+    /* the lock times are kept in ticks */
+    out->lock.wait_ns = out->lock.wait_ns / ticks_per_ns();
+    out->lock.max_hold_ns = out->lock.max_hold_ns / ticks_per_ns();
+    out->thread = thread_self.stats;
+}
+
+/*
+ * mm_stats_threads - Call fn with the counts of every running thread
+ *                    that has made a request. fn runs with the thread
+ *                    list locked and must not call back into the
+ *                    allocator.
+ */
+void mm_stats_threads(mm_thread_fn fn, void* arg) {
+    struct mm_thread_stats s;
+
+    pthread_mutex_lock(&thread_lock);
+    for (thread_rec_t* t = thread_recs; t != NULL; t = t->next) {
+        s.tid = t->stats.tid;
+        s.mallocs = __atomic_load_n(&t->stats.mallocs, __ATOMIC_RELAXED);
+        s.frees = __atomic_load_n(&t->stats.frees, __ATOMIC_RELAXED);
+        s.bytes_allocated = __atomic_load_n(&t->stats.bytes_allocated, __ATOMIC_RELAXED);
+        s.bytes_freed = __atomic_load_n(&t->stats.bytes_freed, __ATOMIC_RELAXED);
+        fn(&s, arg);
+    }
+    pthread_mutex_unlock(&thread_lock);
+}
+
+/*
+ * mm_set_hooks - Install hooks, replacing any installed before; NULL
+ *                removes them
+ */
+void mm_set_hooks(const struct mm_hooks* new_hooks) {
+    hooks = new_hooks;
 }
 
 /* The remaining routines are internal helper routines */
 
 /*
- * extend_heap - Extend heap with free block and return its block pointer
+ * malloc_hooked, free_hooked, realloc_hooked - run a request between
+ *      the hooks of h. hook_depth makes the request itself, and anything
+ *      the hooks allocate, take the plain path.
+ */
+static void* malloc_hooked(const struct mm_hooks* h, size_t size, bool pages) {
+    void* payload;
+
+    hook_depth++;
+    if (h->malloc_pre != NULL)
+        h->malloc_pre(size, h->arg);
+    payload = malloc_request(size, pages);
+    if (h->malloc_post != NULL)
+        h->malloc_post(size, payload, h->arg);
+    hook_depth--;
+    return payload;
+}
+
+static void free_hooked(const struct mm_hooks* h, void* payload) {
+    size_t size = requested_size(payload);
+
+    hook_depth++;
+    if (h->free_pre != NULL)
+        h->free_pre(payload, size, h->arg);
+    mm_free(payload);
+    if (h->free_post != NULL)
+        h->free_post(payload, h->arg);
+    hook_depth--;
+}
+
+static void* realloc_hooked(const struct mm_hooks* h, void* ptr, size_t size) {
+    size_t old_size = requested_size(ptr);
+    void* newp;
+
+    hook_depth++;
+    if (h->realloc_pre != NULL)
+        h->realloc_pre(ptr, old_size, size, h->arg);
+    newp = mm_realloc(ptr, size);
+    if (h->realloc_post != NULL)
+        h->realloc_post(ptr, old_size, newp, size, h->arg);
+    hook_depth--;
+    return newp;
+}
+
+/*
+ * extend_heap - Extend heap with free block and return its block pointer.
+ *               The block is at least words long; if the break can not
+ *               grow, it fills a newly mapped segment.
  */
  /* $begin mmextendheap */
 static block_t* extend_heap(size_t words) {
     block_t* block;
-    uint32_t size;
+    size_t size;
     size = words << 3; // words*8
-    if (size == 0 || (block = mem_sbrk(size)) == (void*)-1)
+    if (size == 0) {
+        MM_PROBE(extend_heap, size, NULL);
+        return NULL;
+    }
+    if ((block = grow_brk(&size)) == NULL && (block = map_segment(&size)) == NULL) {
+        MM_PROBE(extend_heap, size, NULL);
         return NULL;
-    /* The newly acquired region will start directly after the epilogue block */
+    }
     /* Initialize free block header/footer and the new epilogue header */
-    /* use old epilogue as new free block header */
-    block = (void*)block - sizeof(header_t);
     block->allocated = FREE;
     block->block_size = size;
     /* free block footer */
@@ -280,6 +1131,9 @@ static block_t* extend_heap(size_t words) {
     header_t* new_epilogue = (void*)block_footer + sizeof(header_t);
     new_epilogue->allocated = ALLOC;
     new_epilogue->block_size = 0;
+    stats.extends++;
+    count_free(size, 1);
+    MM_PROBE(extend_heap, size, block);
     if (freerootptr == NULL)
     {
         freerootptr = block;
@@ -291,6 +1145,585 @@ static block_t* extend_heap(size_t words) {
 }
 /* $end mmextendheap */
 
+/*
+ * grow_brk - grow the heap at the break for a free block of *size bytes.
+ *            The segment ending at the break grows, or, if the break
+ *            moved on since (for the page heap), a new one starts there.
+ *            Returns the block, with no header yet, or NULL.
+ */
+static block_t* grow_brk(size_t* size) {
+    char* brk = mem_sbrk(0);
+    segment_t* seg = find_segment(brk - 1);
+    header_t* prologue;
+
+    if (seg != NULL && !seg->mapped && !seg->spans) {
+        if (mem_sbrk(*size) == (void*)-1)
+            return NULL;
+        /* The newly acquired region will start directly after the epilogue block */
+        /* use old epilogue as new free block header */
+        seg->size += *size;
+        stats.heap_size += *size;
+        return (block_t*)(brk - sizeof(header_t));
+    }
+    /* segments that start at the break grow with the heap so their number stays small */
+    *size = MAX(*size, (stats.heap_size / 32) & ~(size_t)7);
+    if (nsegments == MAX_SEGMENTS || (prologue = mem_sbrk(*size + 2 * sizeof(header_t))) == (void*)-1)
+        return NULL;
+    prologue->allocated = ALLOC;
+    prologue->block_size = sizeof(header_t);
+    return first_block(add_segment((char*)prologue, *size + 2 * sizeof(header_t), false, false));
+}
+
+/*
+ * mapped_size - bytes to map for a segment that must hold at least bytes
+ */
+static size_t mapped_size(size_t bytes) {
+    size_t page = mem_pagesize();
+
+    /* grow mapped segments with the heap so their number stays small */
+    bytes = MAX(bytes, MAX(SEGMENT_MIN, mapped_bytes / 4));
+    return (bytes + page - 1) & ~(page - 1);
+}
+
+/*
+ * map_segment - map a new segment for a free block of at least *size
+ *               bytes and set up its prologue; returns the block, with
+ *               its size in *size but no header yet, or NULL
+ */
+static block_t* map_segment(size_t* size) {
+    size_t bytes = mapped_size(*size + 2 * sizeof(header_t));
+    header_t* prologue;
+
+    if (nsegments == MAX_SEGMENTS || bytes - 2 * sizeof(header_t) > MAX_BLOCK_SIZE)
+        return NULL;
+    if ((prologue = mem_map(bytes)) == NULL)
+        return NULL;
+    prologue->allocated = ALLOC;
+    prologue->block_size = sizeof(header_t);
+    *size = bytes - 2 * sizeof(header_t);
+    return first_block(add_segment((char*)prologue, bytes, true, false));
+}
+
+/*
+ * add_segment - enter a new segment of size bytes at start in the table,
+ *               in address order; the caller made sure there is room
+ */
+static segment_t* add_segment(char* start, size_t size, bool mapped, bool spans) {
+    int i;
+
+    for (i = nsegments; i > 0 && segments[i - 1].start > start; i--)
+        segments[i] = segments[i - 1];
+    segments[i].start = start;
+    segments[i].size = size;
+    segments[i].mapped = mapped;
+    segments[i].spans = spans;
+    nsegments++;
+    if (mapped)
+        mapped_bytes += size;
+    if (spans)
+        narenas++;
+    stats.heap_size += size;
+    return &segments[i];
+}
+
+/*
+ * remove_segment - unmap the mapped segment seg and drop it from the table
+ */
+static void remove_segment(segment_t* seg) {
+    int i = seg - segments;
+    segment_t* next;
+
+    /* the cursor may rest anywhere in seg, its epilogue included */
+    if (check_cursor != NULL && find_segment(check_cursor) == seg)
+        check_cursor = (next = next_block_segment(seg + 1)) != NULL ? first_block(next) : NULL;
+    stats.heap_size -= seg->size;
+    mapped_bytes -= seg->size;
+    if (seg->spans)
+        narenas--;
+    mem_unmap(seg->start, seg->size);
+    for (nsegments--; i < nsegments; i++)
+        segments[i] = segments[i + 1];
+}
+
+/*
+ * release_segment - unmap the mapped segment seg, whose only block,
+ *                   block, is free
+ */
+static void release_segment(segment_t* seg, block_t* block) {
+    if (GET_PREV(block) != NULL)
+        SET_NEXT(GET_PREV(block), GET_NEXT(block));
+    else
+        freerootptr = GET_NEXT(block);
+    if (GET_NEXT(block) != NULL)
+        SET_PREV(GET_NEXT(block), GET_PREV(block));
+    if (rover == block)
+        rover = GET_NEXT(block);
+    count_free(block->block_size, -1);
+    remove_segment(seg);
+}
+
+/*
+ * find_segment - the segment holding address p, NULL if none does
+ */
+static segment_t* find_segment(const void* p) {
+    int lo = 0, hi = nsegments - 1;
+
+    /* the last segment starting at or below p */
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (segments[mid].start <= (const char*)p)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    if (nsegments == 0 || (const char*)p < segments[lo].start ||
+        (const char*)p >= segments[lo].start + segments[lo].size)
+        return NULL;
+    return &segments[lo];
+}
+
+/*
+ * next_block_segment - seg or the first segment after it that holds
+ *                      blocks rather than spans, NULL if there is none
+ */
+static segment_t* next_block_segment(segment_t* seg) {
+    while (seg < segments + nsegments && seg->spans)
+        seg++;
+    return seg < segments + nsegments ? seg : NULL;
+}
+
+/*
+ * segment_head, segment_tail - bytes of seg before its first block (the
+ *                              prologue, or an arena's padding up to its
+ *                              first page) and after its last (the epilogue)
+ */
+static inline size_t segment_head(const segment_t* seg) {
+    return seg->spans ? -(uintptr_t)seg->start & (PAGE_SIZE - 1) : sizeof(header_t);
+}
+
+static inline size_t segment_tail(const segment_t* seg) {
+    return seg->spans ? 0 : sizeof(header_t);
+}
+
+/*
+ * first_block - the block after the prologue of seg
+ */
+static inline block_t* first_block(const segment_t* seg) {
+    return (block_t*)(seg->start + sizeof(header_t));
+}
+
+/*
+ * meta_alloc - size bytes of zeroed memory for span descriptors and
+ *              pagemap nodes, carved from chunks that are never given
+ *              back; NULL if no chunk can be mapped
+ */
+static void* meta_alloc(size_t size) {
+    size_t page = mem_pagesize();
+    size_t chunk = (META_CHUNK + page - 1) & ~(page - 1);
+    void* p;
+
+    if (size > (size_t)(meta_end - meta_next)) {
+        if ((p = mem_map(chunk)) == NULL)
+            return NULL;
+        meta_next = p;
+        meta_end = meta_next + chunk;
+    }
+    p = meta_next;
+    meta_next += (size + 15) & ~(size_t)15;
+    return memset(p, 0, size);
+}
+
+static inline uintptr_t page_of(const void* p) {
+    return (uintptr_t)p >> PAGE_SHIFT;
+}
+
+/*
+ * pagemap_get - the span entered for page number page, NULL if none.
+ *               Nodes are zeroed before they are linked in and never
+ *               freed, so a lookup needs no lock; the entry it finds is
+ *               only stable if the caller owns the span.
+ */
+static inline span_t* pagemap_get(uintptr_t page) {
+    pagemap_node_t* node;
+    pagemap_leaf_t* leaf;
+
+    if (page >> (3 * PAGEMAP_BITS) != 0 ||
+        (node = __atomic_load_n(&pagemap[page >> (2 * PAGEMAP_BITS)], __ATOMIC_ACQUIRE)) == NULL ||
+        (leaf = __atomic_load_n(&node->leaves[(page >> PAGEMAP_BITS) & PAGEMAP_MASK], __ATOMIC_ACQUIRE)) == NULL)
+        return NULL;
+    return leaf->spans[page & PAGEMAP_MASK];
+}
+
+/*
+ * pagemap_set - enter span for page number page, creating the nodes on
+ *               the way; -1 if one can not be allocated
+ */
+static int pagemap_set(uintptr_t page, span_t* span) {
+    pagemap_node_t** node = &pagemap[page >> (2 * PAGEMAP_BITS)];
+    pagemap_leaf_t** leaf;
+    void* p;
+
+    if (page >> (3 * PAGEMAP_BITS) != 0)
+        return -1;
+    if (*node == NULL) {
+        if ((p = meta_alloc(sizeof(pagemap_node_t))) == NULL)
+            return -1;
+        __atomic_store_n(node, p, __ATOMIC_RELEASE);
+    }
+    leaf = &(*node)->leaves[(page >> PAGEMAP_BITS) & PAGEMAP_MASK];
+    if (*leaf == NULL) {
+        if ((p = meta_alloc(sizeof(pagemap_leaf_t))) == NULL)
+            return -1;
+        __atomic_store_n(leaf, p, __ATOMIC_RELEASE);
+    }
+    (*leaf)->spans[page & PAGEMAP_MASK] = span;
+    return 0;
+}
+
+/*
+ * map_span - enter span for its first and last page; -1 if the pagemap
+ *            can not grow
+ */
+static int map_span(span_t* span) {
+    if (pagemap_set(page_of(span->start), span) < 0)
+        return -1;
+    return pagemap_set(page_of(span->start) + span->npages - 1, span);
+}
+
+/*
+ * span_of - the allocated span whose payload is payload, NULL if payload
+ *           belongs to a block. Block payloads are rarely page aligned,
+ *           so most calls end at the first test.
+ */
+static inline span_t* span_of(const void* payload) {
+    span_t* span;
+
+    if (((uintptr_t)payload & (PAGE_SIZE - 1)) != 0 || (span = pagemap_get(page_of(payload))) == NULL)
+        return NULL;
+    return span->state == SPAN_USED && span->start == payload ? span : NULL;
+}
+
+/*
+ * new_span, kill_span - take a span descriptor, and give one back
+ */
+static span_t* new_span(void) {
+    span_t* span = spare_spans;
+
+    if (span != NULL)
+        spare_spans = span->next;
+    else if ((span = meta_alloc(sizeof(span_t))) == NULL)
+        return NULL;
+    span->state = SPAN_DEAD;
+    return span;
+}
+
+static void kill_span(span_t* span) {
+    span->state = SPAN_DEAD;
+    span->next = spare_spans;
+    spare_spans = span;
+}
+
+/*
+ * span_list - the free list of spans of npages pages
+ */
+static inline int span_list(size_t npages) {
+    return npages < SPAN_LISTS ? npages - 1 : SPAN_LISTS - 1;
+}
+
+static void push_span(span_t* span) {
+    span_t** head = &span_lists[span_list(span->npages)];
+
+    span->prev = NULL;
+    span->next = *head;
+    if (*head != NULL)
+        (*head)->prev = span;
+    *head = span;
+}
+
+static void unlink_span(span_t* span) {
+    if (span->prev != NULL)
+        span->prev->next = span->next;
+    else
+        span_lists[span_list(span->npages)] = span->next;
+    if (span->next != NULL)
+        span->next->prev = span->prev;
+}
+
+/*
+ * insert_span - make span free, merged with the free spans right before
+ *               and after it in its arena, and put the result on its
+ *               free list. Pagemap entries may be stale, so a neighbour
+ *               counts only if it is free and really ends (or starts)
+ *               where span does.
+ */
+static span_t* insert_span(span_t* span) {
+    span_t* prev = pagemap_get(page_of(span->start) - 1);
+    span_t* next = pagemap_get(page_of(span->start) + span->npages);
+
+    if (prev != NULL && prev->state == SPAN_FREE && prev->arena == span->arena &&
+        prev->start + (prev->npages << PAGE_SHIFT) == span->start) {
+        unlink_span(prev);
+        count_free(prev->npages << PAGE_SHIFT, -1);
+        prev->npages += span->npages;
+        kill_span(span);
+        span = prev;
+    }
+    if (next != NULL && next->state == SPAN_FREE && next->arena == span->arena &&
+        next->start == span->start + (span->npages << PAGE_SHIFT)) {
+        unlink_span(next);
+        count_free(next->npages << PAGE_SHIFT, -1);
+        span->npages += next->npages;
+        kill_span(next);
+    }
+    /* both ends were entered for the spans merged */
+    map_span(span);
+    span->state = SPAN_FREE;
+    push_span(span);
+    count_free(span->npages << PAGE_SHIFT, 1);
+    return span;
+}
+
+/*
+ * clear_span - clear the entries of span's first and last page, creating
+ *              the nodes on the way, so that a map_span of the same pages
+ *              can not fail; -1 if the nodes can not be allocated
+ */
+static int clear_span(span_t* span) {
+    if (pagemap_set(page_of(span->start), NULL) < 0)
+        return -1;
+    return pagemap_set(page_of(span->start) + span->npages - 1, NULL);
+}
+
+/*
+ * extend_arena - add npages pages at the break to the arena that ends
+ *                there. Returns the new free span, merged with any free
+ *                span before it, or NULL if no arena ends at the break
+ *                or the break can not grow.
+ */
+static span_t* extend_arena(size_t npages) {
+    size_t bytes = npages << PAGE_SHIFT;
+    char* brk = mem_sbrk(0);
+    segment_t* seg = find_segment(brk - 1);
+    span_t* span;
+
+    if (seg == NULL || !seg->spans || seg->mapped || (span = new_span()) == NULL)
+        return NULL;
+    span->start = brk;
+    span->npages = npages;
+    span->arena = seg->start;
+    if (clear_span(span) < 0 || mem_sbrk(bytes) == (void*)-1) {
+        kill_span(span);
+        return NULL;
+    }
+    map_span(span);
+    seg->size += bytes;
+    stats.heap_size += bytes;
+    stats.extends++;
+    return insert_span(span);
+}
+
+/*
+ * grow_pages - add a free span of at least npages pages to the page heap:
+ *              at the end of the arena at the break, in a new arena at
+ *              the break, or else in a newly mapped arena. Returns the
+ *              span, merged with any free span before it, or NULL.
+ */
+static span_t* grow_pages(size_t npages) {
+    size_t bytes = npages << PAGE_SHIFT, pad;
+    char* brk = mem_sbrk(0);
+    segment_t* seg = find_segment(brk - 1);
+    span_t* span;
+    char* start;
+
+    if (seg != NULL && seg->spans && !seg->mapped) {
+        if ((span = extend_arena(npages)) != NULL)
+            return span;
+    }
+    else if (nsegments < MAX_SEGMENTS && (span = new_span()) != NULL) {
+        /* the break follows a block segment; start the arena at a page,
+           and as large as a new block segment would be */
+        pad = -(uintptr_t)brk & (PAGE_SIZE - 1);
+        span->npages = MAX(npages, stats.heap_size / 32 >> PAGE_SHIFT);
+        span->start = brk + pad;
+        span->arena = brk;
+        if (clear_span(span) == 0 && mem_sbrk(pad + (span->npages << PAGE_SHIFT)) != (void*)-1) {
+            map_span(span);
+            add_segment(brk, pad + (span->npages << PAGE_SHIFT), false, true);
+            stats.extends++;
+            return insert_span(span);
+        }
+        kill_span(span);
+    }
+    bytes = mapped_size(bytes);
+    if (nsegments == MAX_SEGMENTS || (span = new_span()) == NULL)
+        return NULL;
+    if ((start = mem_map(bytes)) == NULL) {
+        kill_span(span);
+        return NULL;
+    }
+    span->start = span->arena = start;
+    span->npages = bytes >> PAGE_SHIFT;
+    if (map_span(span) < 0) {
+        mem_unmap(start, bytes);
+        kill_span(span);
+        return NULL;
+    }
+    add_segment(start, bytes, true, true);
+    stats.extends++;
+    return insert_span(span);
+}
+
+/*
+ * alloc_span - take an allocated span of npages pages from the page heap,
+ *              growing it if no free span is long enough: the first span
+ *              of the shortest list that fits, or the best fit among the
+ *              longest. The rest of a longer span stays free.
+ */
+static span_t* alloc_span(size_t npages) {
+    span_t* span = NULL;
+    span_t* rest;
+
+    for (int i = span_list(npages); i < SPAN_LISTS - 1 && span == NULL; i++)
+        span = span_lists[i];
+    if (span == NULL)
+        for (span_t* s = span_lists[SPAN_LISTS - 1]; s != NULL; s = s->next)
+            if (s->npages >= npages && (span == NULL || s->npages < span->npages))
+                span = s;
+    if (span == NULL && (span = grow_pages(npages)) == NULL)
+        return NULL;
+    unlink_span(span);
+    count_free(span->npages << PAGE_SHIFT, -1);
+    /* without a descriptor or pagemap entries for the rest, the caller gets it too */
+    if (span->npages > npages && (rest = new_span()) != NULL) {
+        rest->start = span->start + (npages << PAGE_SHIFT);
+        rest->npages = span->npages - npages;
+        rest->arena = span->arena;
+        if (map_span(rest) == 0 && pagemap_set(page_of(rest->start) - 1, span) == 0) {
+            span->npages = npages;
+            rest->state = SPAN_FREE;
+            push_span(rest);
+            count_free(rest->npages << PAGE_SHIFT, 1);
+        }
+        else {
+            kill_span(rest);
+            map_span(span);
+        }
+    }
+    span->state = SPAN_USED;
+    count_alloc(span->npages << PAGE_SHIFT, 1);
+    return span;
+}
+
+/*
+ * free_span - give the allocated span span back to the page heap; a
+ *             mapped arena that is left one free span is unmapped
+ */
+static void free_span(span_t* span) {
+    segment_t* seg;
+
+    count_alloc(span->npages << PAGE_SHIFT, -1);
+    span = insert_span(span);
+    seg = find_segment(span->start);
+    if (seg->mapped && span->start == seg->start &&
+        span->start + (span->npages << PAGE_SHIFT) == seg->start + seg->size) {
+        unlink_span(span);
+        count_free(span->npages << PAGE_SHIFT, -1);
+        kill_span(span);
+        remove_segment(seg);
+    }
+}
+
+/*
+ * resize_span - make the allocated span span hold size bytes without
+ *               moving it: pages it no longer needs are freed, pages it
+ *               needs are taken from the free span right after it, or
+ *               from the break if its arena ends there. Returns false,
+ *               changing nothing, if those pages are not to be had.
+ */
+static bool resize_span(span_t* span, size_t size) {
+    size_t npages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    char* end = span->start + (span->npages << PAGE_SHIFT);
+    span_t* next;
+
+    lock_heap();
+    if (npages > span->npages) {
+        size_t more = npages - span->npages;
+        next = pagemap_get(page_of(end));
+        if ((next == NULL || next->state != SPAN_FREE || next->start != end || next->arena != span->arena) &&
+            (end != mem_sbrk(0) || (next = extend_arena(more)) == NULL)) {
+            unlock_heap();
+            return false;
+        }
+        if (next->start != end || next->arena != span->arena || next->npages < more ||
+            (next->npages > more && (pagemap_set(page_of(end) + more, next) < 0 ||
+                                        pagemap_set(page_of(end) + more - 1, span) < 0))) {
+            unlock_heap();
+            return false;
+        }
+        unlink_span(next);
+        count_free(next->npages << PAGE_SHIFT, -1);
+        if (next->npages > more) {
+            next->start += more << PAGE_SHIFT;
+            next->npages -= more;
+            push_span(next);
+            count_free(next->npages << PAGE_SHIFT, 1);
+        }
+        else {
+            pagemap_set(page_of(end) + more - 1, span);
+            kill_span(next);
+        }
+    }
+    else if (npages < span->npages) {
+        /* without a descriptor or pagemap entries for the tail, keep it */
+        if ((next = new_span()) == NULL) {
+            npages = span->npages;
+        }
+        else {
+            next->start = span->start + (npages << PAGE_SHIFT);
+            next->npages = span->npages - npages;
+            next->arena = span->arena;
+            if (map_span(next) == 0 && pagemap_set(page_of(next->start) - 1, span) == 0) {
+                insert_span(next);
+            }
+            else {
+                kill_span(next);
+                map_span(span);
+                npages = span->npages;
+            }
+        }
+    }
+    count_alloc(span->npages << PAGE_SHIFT, -1);
+    count_alloc(npages << PAGE_SHIFT, 1);
+    span->npages = npages;
+    stats.live_bytes += size - span->requested;
+    if (stats.live_bytes > stats.peak_live_bytes)
+        stats.peak_live_bytes = stats.live_bytes;
+    span->requested = size;
+    unlock_heap();
+    /* the profile keeps a sample at its size; drop it rather than let it lie */
+    if (span->sampled) {
+        span->sampled = 0;
+        heapprof_forget(span->start);
+    }
+    return true;
+}
+
+/*
+ * first_span, next_span - walk the spans of seg in address order; NULL
+ *                         after the last, and for a block segment
+ */
+static span_t* first_span(const segment_t* seg) {
+    if (!seg->spans)
+        return NULL;
+    return pagemap_get(page_of(seg->start + segment_head(seg)));
+}
+
+static span_t* next_span(const segment_t* seg, const span_t* span) {
+    char* p = span->start + (span->npages << PAGE_SHIFT);
+
+    return p < seg->start + seg->size ? pagemap_get(page_of(p)) : NULL;
+}
+
 /*
  * place - Place block of asize bytes at start of free block block
  *         and split if remainder would be at least minimum block size
@@ -300,7 +1733,11 @@ static void place(block_t* block, size_t asize) {
 
     size_t split_size = block->block_size - asize;
 
-    if (split_size >= MIN_BLOCK_SIZE) {
+    count_free(block->block_size, -1);
+    if (split_size >= split_min) {
+        MM_PROBE(place_split, block, asize, split_size);
+        count_alloc(asize, 1);
+        count_free(split_size, 1);
 
         /* split the block by updating the header and marking it allocated*/
         block->block_size = asize;
@@ -331,9 +1768,11 @@ static void place(block_t* block, size_t asize) {
         SET_PREV(block, NULL);
         if (GET_PREV(new_block) == NULL)
             freerootptr = new_block;
+        rover = new_block;
     }
     else {
         /* splitting the block will cause a splinter so we just include it in the allocated block */
+        count_alloc(block->block_size, 1);
         block->allocated = ALLOC;
         footer_t* footer = get_footer(block);
         footer->allocated = ALLOC;
@@ -350,6 +1789,7 @@ static void place(block_t* block, size_t asize) {
         if ((GET_PREV(block) == NULL) && (GET_NEXT(block) == NULL))
             freerootptr = NULL;
 
+        rover = GET_NEXT(block);
         SET_NEXT(block, NULL);
         SET_PREV(block, NULL);
     }
@@ -360,16 +1800,53 @@ static void place(block_t* block, size_t asize) {
  * find_fit - Find a fit for a block with asize bytes
  */
 static block_t* find_fit(size_t asize) {
-    /* first fit search */
     block_t* b;
-
-    for (b = freerootptr; b != NULL; b = b->body.next) {
-        /* block must be free and the size must be large enough to hold the request */
-        if (asize <= b->block_size) {
-            return b;
+    block_t* fit = NULL;
+    size_t scanned = 0; /* free blocks looked at, for the latency histograms */
+
+    switch (fit_policy) {
+    case MM_NEXT_FIT:
+        /* next fit search: from the rover to the end, then from the root to the rover */
+        for (b = rover; b != NULL && fit == NULL; b = b->body.next) {
+            scanned++;
+            if (asize <= b->block_size)
+                fit = b;
         }
+        for (b = freerootptr; b != rover && fit == NULL; b = b->body.next) {
+            scanned++;
+            if (asize <= b->block_size)
+                fit = b;
+        }
+        break;
+
+    case MM_BEST_FIT:
+        /* best fit search: the smallest block that is large enough */
+        for (b = freerootptr; b != NULL; b = b->body.next) {
+            scanned++;
+            if (asize <= b->block_size && (fit == NULL || b->block_size < fit->block_size)) {
+                fit = b;
+                if (b->block_size == asize)
+                    break;
+            }
+        }
+        break;
+
+    default:
+        /* first fit search */
+        for (b = freerootptr; b != NULL; b = b->body.next) {
+            scanned++;
+            /* block must be free and the size must be large enough to hold the request */
+            if (asize <= b->block_size) {
+                fit = b;
+                break;
+            }
+        }
+        break;
     }
-    return NULL; /* no fit */
+    LAT_VALUE(MM_LAT_FIT_SCAN, scanned);
+    if (fit == NULL)
+        MM_PROBE(fit_miss, asize, scanned);
+    return fit; /* NULL if no fit */
 }
 
 /*
@@ -396,6 +1873,7 @@ static block_t* coalesce(block_t* block) {
             SET_PREV(block, NULL);
         }
         /* no coalesceing */
+        MM_PROBE(coalesce, 1, block, block->block_size);
         return block;
     }
 
@@ -431,6 +1909,11 @@ static block_t* coalesce(block_t* block) {
 
         SET_NEXT(next_block, NULL);
         SET_PREV(next_block, NULL);
+        if (rover == next_block)
+            rover = block;
+        count_free(block->block_size, -1);
+        count_free(next_block->block_size, -1);
+        count_free(block->block_size + next_block->block_size, 1);
 
 
 
@@ -463,6 +1946,9 @@ static block_t* coalesce(block_t* block) {
         SET_PREV(prev_block, NULL);
         SET_PREV(block, NULL);
         SET_NEXT(block, NULL);
+        count_free(prev_block->block_size, -1);
+        count_free(block->block_size, -1);
+        count_free(prev_block->block_size + block->block_size, 1);
 
         prev_block->block_size += block->block_size;
         footer_t* footer = get_footer(prev_block);
@@ -601,6 +2087,12 @@ static block_t* coalesce(block_t* block) {
 
 
 
+        if (rover == next_block)
+            rover = prev_block;
+        count_free(prev_block->block_size, -1);
+        count_free(block->block_size, -1);
+        count_free(next_block->block_size, -1);
+        count_free(prev_block->block_size + block->block_size + next_block->block_size, 1);
         prev_block->block_size += block->block_size + next_header->block_size;
         /* Update footer of next block to reflect new size */
         footer_t* next_footer = get_footer(prev_block);
@@ -611,6 +2103,12 @@ static block_t* coalesce(block_t* block) {
 
     }
 
+    if (MM_PROBE_ENABLED(coalesce))
+        MM_PROBE(coalesce, 4 - 2 * prev_alloc - next_alloc, block, block->block_size);
+
+    /* keep the incremental checker's cursor on a block boundary */
+    if (check_cursor > block && (void*)check_cursor < (void*)block + block->block_size)
+        check_cursor = block;
     return block;
 }
 
@@ -618,8 +2116,31 @@ static footer_t* get_footer(block_t* block) {
     return (void*)block + block->block_size - sizeof(footer_t);
 }
 
+/*
+ * get_requested, set_requested - payload bytes asked for by an allocated
+ *                                block, kept as its slack
+ */
+static inline size_t get_requested(const block_t* block) {
+    return block->block_size - OVERHEAD - block->slack;
+}
+
+static inline void set_requested(block_t* block, size_t requested) {
+    block->slack = block->block_size - OVERHEAD - requested;
+}
+
+/*
+ * requested_size - payload bytes asked for by the allocated block or span
+ *                  at payload
+ */
+static size_t requested_size(void* payload) {
+    span_t* span = span_of(payload);
+
+    return span != NULL ? span->requested : get_requested(payload - sizeof(header_t));
+}
+
 static void printblock(block_t* block) {
-    uint32_t hsize, halloc, fsize, falloc;
+    size_t hsize, fsize;
+    int halloc, falloc;
 
     hsize = block->block_size;
     halloc = block->allocated;
@@ -632,16 +2153,413 @@ static void printblock(block_t* block) {
         return;
     }
 
-    printf("%p: header: [%d:%c] footer: [%d:%c]\n", block, hsize,
+    printf("%p: header: [%zu:%c] footer: [%zu:%c]\n", block, hsize,
         (halloc ? 'a' : 'f'), fsize, (falloc ? 'a' : 'f'));
 }
 
-static void checkblock(block_t* block) {
+static bool in_heap(const void* p) {
+    return find_segment(p) != NULL;
+}
+
+/*
+ * checkblock - Check one block of seg: alignment, size, header against footer,
+ *              and for a free block that it is not next to another free
+ *              block and that its free list links are symmetric. Returns
+ *              the number of problems, or -1 if the size is so broken
+ *              that the next block can not be found.
+ */
+static int checkblock(const segment_t* seg, block_t* block) {
+    int errors = 0;
+
+    /* the next block may be the epilogue, but not past it */
+    if (block->block_size < MIN_BLOCK_SIZE || block->block_size % 8 ||
+        (char*)block + block->block_size > seg->start + seg->size - sizeof(header_t)) {
+        printf("Error: block at %p has a bad size %zu\n", block, (size_t)block->block_size);
+        return -1;
+    }
     if ((uint64_t)block->body.payload % 8) {
         printf("Error: payload for block at %p is not aligned\n", block);
+        errors++;
     }
     footer_t* footer = get_footer(block);
-    if (block->block_size != footer->block_size) {
+    if (block->block_size != footer->block_size || block->allocated != footer->allocated) {
         printf("Error: header does not match footer\n");
+        errors++;
+    }
+    if (block->allocated)
+        return errors;
+
+    block_t* next = (void*)block + block->block_size;
+    block_t* prev_link = GET_PREV(block);
+    block_t* next_link = GET_NEXT(block);
+    if (!next->allocated) {
+        printf("Error: free blocks at %p and %p were not coalesced\n", block, next);
+        errors++;
+    }
+    if (prev_link == NULL ? block != freerootptr
+                          : !in_heap(prev_link) || prev_link->allocated || GET_NEXT(prev_link) != block) {
+        printf("Error: free block at %p is not linked from its predecessor %p\n", block, prev_link);
+        errors++;
+    }
+    if (next_link != NULL && (!in_heap(next_link) || next_link->allocated || GET_PREV(next_link) != block)) {
+        printf("Error: free block at %p is not linked back from its successor %p\n", block, next_link);
+        errors++;
+    }
+    return errors;
+}
+
+/*
+ * check_arena - Check the spans of the arena seg: that the pagemap leads
+ *               from each to the next and from its last page back to it,
+ *               that they tile the arena and that no two free spans are
+ *               neighbours. Adds them to the totals; returns the number
+ *               of problems.
+ */
+static int check_arena(const segment_t* seg, int verbose, size_t* alloc_bytes, size_t* free_bytes, size_t* free_spans) {
+    char* p = seg->start + segment_head(seg);
+    char* end = seg->start + seg->size;
+    bool prev_free = false;
+    int errors = 0;
+
+    while (p < end) {
+        span_t* span = pagemap_get(page_of(p));
+        size_t bytes;
+
+        if (span == NULL || span->start != p || span->arena != seg->start || span->state == SPAN_DEAD ||
+            span->npages == 0 || span->npages > (size_t)(end - p) >> PAGE_SHIFT) {
+            printf("Error: no span starts at %p in the arena at %p\n", p, seg->start);
+            return errors + 1;
+        }
+        bytes = span->npages << PAGE_SHIFT;
+        if (verbose)
+            printf("%p: span of %zu pages [%c]\n", p, span->npages, span->state == SPAN_USED ? 'a' : 'f');
+        if (pagemap_get(page_of(p) + span->npages - 1) != span) {
+            printf("Error: the last page of the span at %p does not lead to it\n", p);
+            errors++;
+        }
+        if (span->state == SPAN_USED) {
+            *alloc_bytes += bytes;
+            if (span->requested > bytes) {
+                printf("Error: span at %p is smaller than the %zu bytes requested\n", p, span->requested);
+                errors++;
+            }
+        }
+        else {
+            *free_bytes += bytes;
+            (*free_spans)++;
+            if (prev_free) {
+                printf("Error: free span at %p was not merged with the one before\n", p);
+                errors++;
+            }
+        }
+        prev_free = span->state == SPAN_FREE;
+        p += bytes;
+    }
+    return errors;
+}
+
+/*
+ * check_span_lists - Check that the free span lists hold free_spans spans,
+ *                    each free, of the length of its list and linked back
+ *                    from its successor. Returns the number of problems.
+ */
+static int check_span_lists(size_t free_spans) {
+    size_t listed = 0;
+    int errors = 0;
+
+    for (int i = 0; i < SPAN_LISTS; i++) {
+        /* the bound stops a cyclic list */
+        for (span_t* span = span_lists[i]; span != NULL && listed <= free_spans; span = span->next, listed++) {
+            if (span->state != SPAN_FREE || span_list(span->npages) != i) {
+                printf("Error: span at %p does not belong on free span list %d\n", span->start, i);
+                errors++;
+            }
+            if (span->next != NULL && span->next->prev != span) {
+                printf("Error: span at %p is not linked back from its successor\n", span->start);
+                errors++;
+            }
+        }
+    }
+    if (listed != free_spans) {
+        printf("Error: %zu free spans in the arenas but %s%zu on the free span lists\n", free_spans,
+            listed > free_spans ? "over " : "", listed);
+        errors++;
+    }
+    return errors;
+}
+
+/*
+ * Free sizes. mm_stats reports the largest free block or span exactly
+ * and in constant time, so count_free keeps every free size: those below
+ * SPAN_MIN as counts in a two-level bitmap, whose highest bit is the
+ * largest, and the larger ones, which are few, as distinct sizes with
+ * their counts in an array sorted by size. Splitting the largest block
+ * or adding to it changes only the end of the array. A larger size is
+ * not kept if the array can not grow; largest_free may then be too small.
+ */
+
+/*
+ * small_size - count a free size below SPAN_MIN appearing (delta 1) or
+ *              disappearing (delta -1)
+ */
+static inline void small_size(size_t size, int delta) {
+    size_t i = size >> 3;
+
+    if (delta > 0 && small_counts[i]++ == 0) {
+        small_bits[i / 64] |= (uint64_t)1 << (i % 64);
+        small_words[i / 64 / 64] |= (uint64_t)1 << (i / 64 % 64);
+    }
+    else if (delta < 0 && --small_counts[i] == 0) {
+        small_bits[i / 64] &= ~((uint64_t)1 << (i % 64));
+        if (small_bits[i / 64] == 0)
+            small_words[i / 64 / 64] &= ~((uint64_t)1 << (i / 64 % 64));
+    }
+}
+
+/*
+ * large_search - the index in large_sizes of size, or of the first larger
+ *                size if size is not there; the largest sizes come and go
+ *                most often, so the end is tried first
+ */
+static size_t large_search(size_t size) {
+    size_t lo = 0, hi = large_count;
+
+    if (hi == 0 || large_sizes[hi - 1].size < size)
+        return hi;
+    if (large_sizes[hi - 1].size == size)
+        return hi - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (large_sizes[mid].size < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * large_grow - double large_sizes; -1 if the memory can not be mapped
+ */
+static int large_grow(void) {
+    size_t page = mem_pagesize();
+    size_t cap = large_capacity ? 2 * large_capacity : LARGE_MIN_SIZES;
+    size_t bytes = (cap * sizeof(large_size_t) + page - 1) & ~(page - 1);
+    size_t old_bytes = (large_capacity * sizeof(large_size_t) + page - 1) & ~(page - 1);
+    void* p;
+
+    if ((p = mem_map(bytes)) == NULL)
+        return -1;
+    if (large_sizes != NULL) {
+        memcpy(p, large_sizes, large_count * sizeof(large_size_t));
+        mem_unmap(large_sizes, old_bytes);
+    }
+    large_sizes = p;
+    large_capacity = cap;
+    return 0;
+}
+
+static void large_size_add(size_t size) {
+    size_t i = large_search(size);
+
+    if (i < large_count && large_sizes[i].size == size) {
+        large_sizes[i].count++;
+        return;
+    }
+    if (large_count == large_capacity && large_grow() < 0)
+        return;
+    memmove(&large_sizes[i + 1], &large_sizes[i], (large_count - i) * sizeof(large_size_t));
+    large_sizes[i].size = size;
+    large_sizes[i].count = 1;
+    large_count++;
+}
+
+static void large_size_remove(size_t size) {
+    size_t i = large_search(size);
+
+    if (i == large_count || large_sizes[i].size != size || --large_sizes[i].count > 0)
+        return;
+    large_count--;
+    memmove(&large_sizes[i], &large_sizes[i + 1], (large_count - i) * sizeof(large_size_t));
+}
+
+/*
+ * largest_free_size - the size of the largest free block or span
+ */
+static size_t largest_free_size(void) {
+    int w;
+
+    if (large_count > 0)
+        return large_sizes[large_count - 1].size;
+    for (w = SMALL_SIZES / 64 / 64 - 1; w >= 0 && small_words[w] == 0; w--)
+        ;
+    if (w < 0)
+        return 0;
+    w = w * 64 + 63 - __builtin_clzll(small_words[w]);
+    return ((size_t)w * 64 + 63 - __builtin_clzll(small_bits[w])) << 3;
+}
+
+static void free_sizes_reset(void) {
+    memset(small_counts, 0, sizeof(small_counts));
+    memset(small_bits, 0, sizeof(small_bits));
+    memset(small_words, 0, sizeof(small_words));
+    large_count = 0;
+}
+
+/*
+ * size_class - mm_stats size class of a block of size bytes
+ */
+static inline int size_class(size_t size) {
+    int k = 63 - __builtin_clzll(size) - 5;
+    if (k < 0)
+        return 0;
+    return k < MM_STATS_CLASSES ? k : MM_STATS_CLASSES - 1;
+}
+
+/*
+ * count_free - account for a free block of size bytes appearing (delta 1)
+ *              or disappearing (delta -1)
+ */
+static inline void count_free(size_t size, int delta) {
+    stats.free_blocks += delta;
+    stats.free_bytes += delta * (ptrdiff_t)size;
+    stats.classes[size_class(size)].free_blocks += delta;
+    if (size < SPAN_MIN)
+        small_size(size, delta);
+    else if (delta > 0)
+        large_size_add(size);
+    else
+        large_size_remove(size);
+}
+
+/*
+ * thread_detach - take an exiting thread's record off thread_recs
+ */
+static void thread_detach(void* arg) {
+    thread_rec_t* t = arg;
+
+    pthread_mutex_lock(&thread_lock);
+    if (t->prev != NULL)
+        t->prev->next = t->next;
+    else
+        thread_recs = t->next;
+    if (t->next != NULL)
+        t->next->prev = t->prev;
+    t->listed = false;
+    pthread_mutex_unlock(&thread_lock);
+}
+
+static void make_thread_key(void) {
+    pthread_key_create(&thread_key, thread_detach);
+}
+
+/*
+ * thread_attach - put the calling thread's record on thread_recs
+ */
+static void thread_attach(void) {
+    thread_rec_t* t = &thread_self;
+
+    pthread_once(&thread_once, make_thread_key);
+    t->stats.tid = syscall(SYS_gettid);
+    pthread_mutex_lock(&thread_lock);
+    t->prev = NULL;
+    t->next = thread_recs;
+    if (thread_recs != NULL)
+        thread_recs->prev = t;
+    thread_recs = t;
+    t->listed = true;
+    pthread_mutex_unlock(&thread_lock);
+    pthread_setspecific(thread_key, t);
+}
+
+/*
+ * thread_count - add n to a count of the calling thread, which
+ *                mm_stats_threads may be reading from another thread
+ */
+static inline void thread_count(uint64_t* counter, uint64_t n) {
+    if (__builtin_expect(!thread_self.listed, 0))
+        thread_attach();
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * count_alloc - account for an allocated block of size bytes appearing
+ *               (delta 1) or disappearing (delta -1)
+ */
+static inline void count_alloc(size_t size, int delta) {
+    struct mm_class_stats* c = &stats.classes[size_class(size)];
+
+    stats.alloc_blocks += delta;
+    stats.alloc_bytes += delta * (ptrdiff_t)size;
+    c->alloc_blocks += delta;
+    if (delta > 0)
+        c->mallocs++;
+}
+
+#ifdef MM_LATENCY
+/*
+ * lat_record - add v to the calling thread's histogram of op, creating
+ *              the thread's histograms on its first call
+ */
+static void lat_record(int op, uint64_t v) {
+    if (lat_self == NULL) {
+        if ((lat_self = calloc(1, sizeof(lat_thread_t))) == NULL)
+            return;
+        pthread_mutex_lock(&lat_lock);
+        lat_self->next = lat_threads;
+        lat_threads = lat_self;
+        pthread_mutex_unlock(&lat_lock);
+    }
+    hist_record(&lat_self->hists[op], v);
+}
+#endif
+
+/*
+ * mm_latency - Add up the histograms of op over all threads into out.
+ *              Threads keep recording meanwhile, so the sum is only
+ *              approximately a snapshot. Returns -1 if mm.c was built
+ *              without MM_LATENCY.
+ */
+int mm_latency(int op, hist_t* out) {
+    hist_reset(out);
+#ifdef MM_LATENCY
+    if (op < 0 || op >= MM_LAT_NUM)
+        return -1;
+    pthread_mutex_lock(&lat_lock);
+    for (lat_thread_t* t = lat_threads; t != NULL; t = t->next)
+        hist_merge(out, &t->hists[op]);
+    pthread_mutex_unlock(&lat_lock);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * lock_heap - take heap_lock, counting the acquisition in stats.lock.
+ *             Only an acquisition that finds the lock taken times its
+ *             wait, and only those and one in LOCK_HOLD_SAMPLE others
+ *             time the hold, so the uncontended path reads no clock
+ *             most of the time. The counters are guarded by the lock.
+ */
+static inline void lock_heap(void) {
+    if (pthread_mutex_trylock(&heap_lock) == 0) {
+        lock_acquired = ++stats.lock.acquisitions % LOCK_HOLD_SAMPLE == 0 ? read_ticks() : 0;
+    } else {
+        uint64_t start = read_ticks();
+        pthread_mutex_lock(&heap_lock);
+        lock_acquired = read_ticks();
+        stats.lock.acquisitions++;
+        stats.lock.contended++;
+        stats.lock.wait_ns += lock_acquired - start;
+    }
+}
+
+static inline void unlock_heap(void) {
+    if (lock_acquired != 0) {
+        uint64_t held = read_ticks() - lock_acquired;
+        if (held > stats.lock.max_hold_ns)
+            stats.lock.max_hold_ns = held;
     }
+    pthread_mutex_unlock(&heap_lock);
 }
@@ -0,0 +1,224 @@
+/*
+ * mm.h - Interface to the memory manager in mm.c
+ */
+#ifndef MM_H
+#define MM_H
+
+#include "hist.h"
+#include <stdint.h>
+#include <stdio.h>
+
+/* Placement policies for mm_config.fit */
+#define MM_FIRST_FIT 0 /* first block in the free list that is large enough */
+#define MM_NEXT_FIT 1  /* like first fit, starting where the last search ended */
+#define MM_BEST_FIT 2  /* smallest free block that is large enough */
+
+/* Allocator tunables, passed to mm_configure before mm_init */
+struct mm_config {
+    int fit;          /* placement policy, one of MM_*_FIT */
+    size_t split_min; /* smallest remainder split off a free block (32 to 8192) */
+    size_t chunksize; /* initial heap size and minimum heap growth (bytes) */
+};
+
+extern int mm_configure(const struct mm_config* config);
+extern int mm_init(void);
+extern void* mm_malloc(size_t size);
+extern void mm_free(void* ptr);
+extern void* mm_realloc(void* ptr, size_t size);
+extern void* mm_memalign(size_t alignment, size_t size); /* alignment: a power of two up to 4096 */
+extern void mm_checkheap(int verbose);
+
+/*
+ * Checkers that avoid long stalls. mm_checkheap_step checks at most
+ * max_blocks blocks per call, resuming where the last call stopped;
+ * mm_checkheap_parallel spreads one full check over up to
+ * MM_CHECK_MAX_THREADS threads. Both print each problem and return how
+ * many they found.
+ */
+#define MM_CHECK_MAX_THREADS 64
+
+extern int mm_checkheap_step(size_t max_blocks, int* wrapped);
+extern int mm_checkheap_parallel(int nthreads);
+
+/*
+ * mm_heap_walk calls fn once per block in address order with the block's
+ * payload address, its total size including overhead and whether it is
+ * allocated; a span of the page heap counts as one block of whole pages.
+ * fn must not call into the allocator.
+ */
+typedef void (*mm_walk_fn)(void* payload, size_t size, int allocated, void* arg);
+extern void mm_heap_walk(mm_walk_fn fn, void* arg);
+
+/*
+ * mm_heap_segments calls fn once per heap segment in address order with
+ * its first byte, its size and whether it was mapped rather than taken
+ * from the break. Their sizes add up to mm_stats' heap_size. fn must not
+ * call into the allocator.
+ */
+typedef void (*mm_segment_fn)(void* start, size_t size, int mapped, void* arg);
+extern void mm_heap_segments(mm_segment_fn fn, void* arg);
+
+/*
+ * mm_heap_dump writes a compact binary snapshot of every block (see
+ * heapdump.h) to the file descriptor fd; heapview renders and compares
+ * snapshots. Returns -1 if the write fails.
+ */
+extern int mm_heap_dump(int fd);
+
+/*
+ * Heap statistics, kept up to date by every request so that mm_stats is
+ * cheap enough to call at any time. Size class k counts blocks of
+ * 2^(k+5) to 2^(k+6)-1 bytes including overhead; the last class is open.
+ */
+#define MM_STATS_CLASSES 26
+
+struct mm_class_stats {
+    size_t alloc_blocks; /* allocated blocks in the class */
+    size_t free_blocks;  /* free blocks in the class */
+    uint64_t mallocs;    /* requests placed in a block of the class */
+};
+
+/* Requests made by one thread since it started */
+struct mm_thread_stats {
+    uint64_t tid; /* kernel thread id */
+    uint64_t mallocs;
+    uint64_t frees;
+    uint64_t bytes_allocated; /* requested payload bytes */
+    uint64_t bytes_freed;
+};
+
+/*
+ * Acquisitions of the heap lock. Contended acquisitions are the ones
+ * that found the lock taken and had to wait for it. To keep the counting
+ * cheap, max_hold_ns only covers contended acquisitions and a sample of
+ * one in 64 of the others.
+ */
+struct mm_lock_stats {
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_ns;     /* total time spent waiting for the lock */
+    uint64_t max_hold_ns; /* longest time the lock was held (sampled) */
+};
+
+struct mm_stats {
+    size_t heap_size;       /* bytes of all heap segments */
+    size_t live_bytes;      /* payload bytes requested by allocated blocks */
+    size_t alloc_bytes;     /* bytes of allocated blocks */
+    size_t alloc_blocks;
+    size_t free_bytes;      /* bytes of free blocks */
+    size_t free_blocks;
+    size_t largest_free;    /* size of the largest free block */
+    size_t internal_frag;   /* alloc_bytes - live_bytes: headers, footers, padding */
+    size_t peak_live_bytes; /* highest live_bytes since mm_init */
+    uint64_t extends;       /* times the heap was grown */
+    uint64_t mallocs;
+    uint64_t frees;
+    struct mm_class_stats classes[MM_STATS_CLASSES];
+    struct mm_lock_stats lock;
+    struct mm_thread_stats thread; /* the calling thread */
+};
+
+extern void mm_stats(struct mm_stats* out);
+
+/*
+ * mm_stats_threads calls fn with the counts of every running thread that
+ * has made a request, so that one thread (a metrics exporter, say) can
+ * see all of them; the counts of threads that have exited are dropped.
+ * fn must not call into the allocator.
+ */
+typedef void (*mm_thread_fn)(const struct mm_thread_stats* stats, void* arg);
+extern void mm_stats_threads(mm_thread_fn fn, void* arg);
+
+/*
+ * Sampling heap profiler (heapprof.c). Once started, allocations are
+ * sampled on average every interval bytes with their call stacks, and
+ * mm_profile_dump writes the live and cumulative profile in a format
+ * pprof reads. The default interval keeps the overhead to a few percent.
+ */
+#define MM_PROFILE_INTERVAL (512 * 1024)
+
+extern void mm_profile_start(size_t interval);
+extern void mm_profile_stop(void);
+extern int mm_profile_dump(const char* path);
+
+/*
+ * Latency instrumentation, compiled in with -DMM_LATENCY. Requests and
+ * heap extensions are recorded in ticks (see timer.h), find_fit as the
+ * number of free blocks it looked at. mm_latency returns -1 if the
+ * instrumentation is not compiled in.
+ */
+enum mm_latency_op {
+    MM_LAT_MALLOC,
+    MM_LAT_FREE,
+    MM_LAT_REALLOC,
+    MM_LAT_FIT_SCAN,
+    MM_LAT_EXTEND,
+    MM_LAT_NUM
+};
+
+extern int mm_latency(int op, hist_t* out);
+
+/*
+ * Allocation flight recorder (flight.c), compiled in with -DMM_FLIGHT.
+ * Once started, every thread keeps its last events requests in a ring;
+ * mm_flight_dump writes them as a binary trace that mdriver -f replays.
+ * mm_flight_dump_on_signal arranges for a dump when the process dies of
+ * a fatal signal. mm_flight_start returns -1 if the recorder is not
+ * compiled in, the others -1 if the file or handlers cannot be set up.
+ */
+#define MM_FLIGHT_EVENTS (128 * 1024)
+
+extern int mm_flight_start(size_t events);
+extern void mm_flight_stop(void);
+extern int mm_flight_dump(const char* path);
+extern int mm_flight_dump_on_signal(const char* path);
+
+/*
+ * Allocation hooks. While a set of hooks is installed, mm_malloc, mm_free
+ * and mm_realloc call its non-NULL members before and after doing their
+ * work, passing arg along; sizes are the requested payload sizes. The
+ * structure is used in place, so it must stay valid until it is replaced.
+ * A hook that calls back into the allocator is served without hooks,
+ * and mm_realloc runs only its own hooks, not those of the mm_malloc and
+ * mm_free it makes. With no hooks installed the cost is one branch per
+ * request. mm_set_hooks(NULL) removes the hooks.
+ */
+struct mm_hooks {
+    void (*malloc_pre)(size_t size, void* arg);
+    void (*malloc_post)(size_t size, void* payload, void* arg);
+    void (*free_pre)(void* payload, size_t size, void* arg);
+    void (*free_post)(void* payload, void* arg);
+    void (*realloc_pre)(void* ptr, size_t old_size, size_t size, void* arg);
+    void (*realloc_post)(void* ptr, size_t old_size, void* newp, size_t size, void* arg);
+    void* arg;
+};
+
+extern void mm_set_hooks(const struct mm_hooks* hooks);
+
+/*
+ * Metrics exporter (metrics.c). mm_metrics_write writes the statistics
+ * and latency histograms to path in the Prometheus text format, atomically
+ * replacing the file; mm_metrics_start does so periodically from a
+ * background thread. mm_init starts the thread when the environment sets
+ * MM_METRICS_FILE (interval in MM_METRICS_INTERVAL_MS). Return -1 on
+ * failure.
+ */
+#define MM_METRICS_INTERVAL_MS 10000
+
+extern int mm_metrics_start(const char* path, unsigned interval_ms);
+extern void mm_metrics_stop(void);
+extern int mm_metrics_write(const char* path);
+
+/*
+ * Students work in teams of one. Each team identifies itself
+ * in a team_t struct defined in mm.c.
+ */
+typedef struct {
+    char* name;    /* first and last name */
+    char* uid;     /* UID */
+    char* message; /* custom message (16 chars) */
+} team_t;
+
+extern team_t team;
+
+#endif /* MM_H */
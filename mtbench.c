@@ -0,0 +1,507 @@
+/*
+ * mtbench.c - Multi-threaded scalability benchmarks for mm.c and libc
+ *
+ * Runs the classic allocator stress patterns with a sweep of thread
+ * counts against both mm.c and the libc malloc package:
+ *
+ *      larson      server simulation: threads replace random blocks in a
+ *                  working set and hand it on to a successor thread
+ *      prodcons    producer/consumer pairs; every block is freed by a
+ *                  different thread than the one that allocated it
+ *      threadtest  each thread allocates a batch of blocks and frees it
+ *      xmalloc     producers push blocks into a shared pool, consumers
+ *                  pop and free them (many-to-many cross-thread frees)
+ *      scratch     cache-scratch: each thread frees an object allocated
+ *                  next to the others' by the main thread, then writes
+ *                  to small objects of its own (exposes false sharing)
+ *
+ * For every run it prints throughput, resident set size after the run
+ * and scalability efficiency, the throughput per thread relative to the
+ * same benchmark with one thread. The vs libc column compares mm.c with
+ * libc at the same thread count; the last two show how often mm.c's heap
+ * lock was contended and the average wait of a contended acquisition.
+ */
+#include "memlib.h"
+#include "mm.h"
+#include "rng.h"
+#include "timer.h"
+#include <getopt.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_OPS 200000    /* requests per thread and run */
+#define DEFAULT_MAX_THREADS 8
+#define LARSON_SLOTS 1000     /* working set of each larson thread */
+#define LARSON_GENERATIONS 4  /* threads each larson chain hands off to */
+#define THREADTEST_BATCH 100  /* blocks allocated before freeing in threadtest */
+#define RING_SIZE 1024        /* capacity of a producer/consumer ring */
+#define POOL_BATCH 64         /* blocks moved through the xmalloc pool at once */
+#define SCRATCH_WRITES 1000   /* writes to each cache-scratch object */
+
+/* The malloc package a benchmark runs against */
+typedef struct {
+    const char* name;
+    void* (*malloc)(size_t size);
+    void (*free)(void* ptr);
+    void (*reset)(void);
+} allocator_t;
+
+/* Shared parameters of a run */
+typedef struct {
+    const allocator_t* a;
+    int nthreads;
+    size_t ops;      /* requests per thread */
+    void* shared;    /* benchmark specific */
+} run_t;
+
+/* Per-thread arguments */
+typedef struct {
+    run_t* run;
+    int id;
+    uint64_t ops;    /* requests actually performed */
+    void* state;     /* benchmark specific */
+} worker_t;
+
+typedef struct {
+    const char* name;
+    void* (*worker)(void* arg);
+    void (*setup)(run_t* run, worker_t* workers);   /* optional */
+    void (*teardown)(run_t* run, worker_t* workers); /* optional */
+} benchmark_t;
+
+static void reset_mm(void) {
+    mem_reset_brk();
+    if (mm_init() < 0) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+}
+
+static void reset_libc(void) {
+    malloc_trim(0);
+}
+
+static void* xalloc(const allocator_t* a, size_t size) {
+    void* p = a->malloc(size);
+    if (p == NULL) {
+        fprintf(stderr, "%s malloc(%zu) failed\n", a->name, size);
+        exit(1);
+    }
+    return p;
+}
+
+static void* xmalloc(size_t size) {
+    void* p = malloc(size);
+    if (p == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * larson - replace random blocks of a working set, then pass the set on
+ *          to a new thread, as a server hands connections to new workers
+ */
+typedef struct {
+    worker_t* w;
+    void** slots;
+    rng_t rng;
+    int generation;
+} larson_t;
+
+static void* larson_worker(void* arg) {
+    larson_t* l = arg;
+    const allocator_t* a = l->w->run->a;
+    size_t rounds = l->w->run->ops / LARSON_GENERATIONS;
+
+    if (l->slots == NULL) {
+        l->slots = xmalloc(LARSON_SLOTS * sizeof(void*));
+        for (int i = 0; i < LARSON_SLOTS; i++)
+            l->slots[i] = xalloc(a, rng_range(&l->rng, 16, 128));
+    }
+    for (size_t i = 0; i < rounds; i++) {
+        int k = rng_next(&l->rng) % LARSON_SLOTS;
+        a->free(l->slots[k]);
+        l->slots[k] = xalloc(a, rng_range(&l->rng, 16, 128));
+    }
+    l->w->ops += 2 * rounds;
+
+    if (++l->generation < LARSON_GENERATIONS) {
+        pthread_t next;
+        if (pthread_create(&next, NULL, larson_worker, l) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+        pthread_join(next, NULL);
+        return NULL;
+    }
+    for (int i = 0; i < LARSON_SLOTS; i++)
+        a->free(l->slots[i]);
+    free(l->slots);
+    return NULL;
+}
+
+static void* larson_main(void* arg) {
+    worker_t* w = arg;
+    larson_t l = { w, NULL, { 0 }, 0 };
+    rng_seed(&l.rng, w->id + 1);
+    return larson_worker(&l);
+}
+
+/*
+ * prodcons - pairs of threads connected by a single-producer ring
+ */
+typedef struct {
+    _Atomic size_t head; /* next slot the consumer reads */
+    char pad1[64];
+    _Atomic size_t tail; /* next slot the producer writes */
+    char pad2[64];
+    void* slots[RING_SIZE];
+} ring_t;
+
+static void prodcons_setup(run_t* run, worker_t* workers) {
+    int nrings = (run->nthreads + 1) / 2;
+    ring_t* rings = calloc(nrings, sizeof(ring_t));
+    if (rings == NULL) {
+        fprintf(stderr, "calloc failed\n");
+        exit(1);
+    }
+    run->shared = rings;
+}
+
+static void prodcons_teardown(run_t* run, worker_t* workers) {
+    free(run->shared);
+}
+
+static void* prodcons_worker(void* arg) {
+    worker_t* w = arg;
+    const allocator_t* a = w->run->a;
+    ring_t* ring = (ring_t*)w->run->shared + w->id / 2;
+    size_t n = w->run->ops;
+    bool consumer = (w->id % 2 == 1);
+    /* with an odd thread count the last thread frees its own blocks */
+    bool self = !consumer && (w->id + 1 == w->run->nthreads);
+    size_t h, t;
+
+    if (consumer) {
+        for (h = 0; h < n; h++) {
+            while (atomic_load_explicit(&ring->tail, memory_order_acquire) == h)
+                sched_yield();
+            a->free(ring->slots[h % RING_SIZE]);
+            atomic_store_explicit(&ring->head, h + 1, memory_order_release);
+        }
+        w->ops += n;
+        return NULL;
+    }
+
+    for (t = 0; t < n; t++) {
+        while (t - atomic_load_explicit(&ring->head, memory_order_acquire) == RING_SIZE) {
+            if (self) {
+                h = atomic_load_explicit(&ring->head, memory_order_relaxed);
+                a->free(ring->slots[h % RING_SIZE]);
+                atomic_store_explicit(&ring->head, h + 1, memory_order_release);
+            }
+            else {
+                sched_yield();
+            }
+        }
+        ring->slots[t % RING_SIZE] = xalloc(a, 64);
+        atomic_store_explicit(&ring->tail, t + 1, memory_order_release);
+    }
+    if (self) {
+        for (h = atomic_load_explicit(&ring->head, memory_order_relaxed); h < n; h++)
+            a->free(ring->slots[h % RING_SIZE]);
+    }
+    w->ops += self ? 2 * n : n;
+    return NULL;
+}
+
+/*
+ * threadtest - allocate a batch of blocks, then free the whole batch
+ */
+static void* threadtest_worker(void* arg) {
+    worker_t* w = arg;
+    const allocator_t* a = w->run->a;
+    void* batch[THREADTEST_BATCH];
+    size_t rounds = w->run->ops / (2 * THREADTEST_BATCH);
+
+    for (size_t r = 0; r < rounds; r++) {
+        for (int i = 0; i < THREADTEST_BATCH; i++)
+            batch[i] = xalloc(a, 64);
+        for (int i = 0; i < THREADTEST_BATCH; i++)
+            a->free(batch[i]);
+    }
+    w->ops += rounds * 2 * THREADTEST_BATCH;
+    return NULL;
+}
+
+/*
+ * xmalloc - producers move batches of blocks into a shared pool and
+ *           consumers take and free them
+ */
+typedef struct batch {
+    struct batch* next;
+    void* blocks[POOL_BATCH];
+} batch_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    batch_t* batches;
+    int producers_left;
+} pool_t;
+
+static void xmalloc_setup(run_t* run, worker_t* workers) {
+    pool_t* pool = xmalloc(sizeof(pool_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->nonempty, NULL);
+    pool->batches = NULL;
+    pool->producers_left = run->nthreads > 1 ? (run->nthreads + 1) / 2 : 1;
+    run->shared = pool;
+}
+
+static void xmalloc_teardown(run_t* run, worker_t* workers) {
+    pool_t* pool = run->shared;
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->nonempty);
+    free(pool);
+}
+
+/* take and free one batch; returns false once the producers are done */
+static bool xmalloc_consume(pool_t* pool, const allocator_t* a, worker_t* w, bool wait) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->batches == NULL && pool->producers_left > 0 && wait)
+        pthread_cond_wait(&pool->nonempty, &pool->lock);
+    batch_t* b = pool->batches;
+    if (b != NULL)
+        pool->batches = b->next;
+    pthread_mutex_unlock(&pool->lock);
+    if (b == NULL)
+        return false;
+    for (int i = 0; i < POOL_BATCH; i++)
+        a->free(b->blocks[i]);
+    free(b);
+    w->ops += POOL_BATCH;
+    return true;
+}
+
+static void* xmalloc_worker(void* arg) {
+    worker_t* w = arg;
+    const allocator_t* a = w->run->a;
+    pool_t* pool = w->run->shared;
+    bool single = w->run->nthreads == 1;
+
+    if (w->id % 2 == 0 || single) {
+        size_t nbatches = w->run->ops / POOL_BATCH;
+        rng_t r;
+        rng_seed(&r, w->id + 1);
+        for (size_t n = 0; n < nbatches; n++) {
+            batch_t* b = xmalloc(sizeof(batch_t));
+            for (int i = 0; i < POOL_BATCH; i++)
+                b->blocks[i] = xalloc(a, rng_range(&r, 8, 512));
+            w->ops += POOL_BATCH;
+            pthread_mutex_lock(&pool->lock);
+            b->next = pool->batches;
+            pool->batches = b;
+            pthread_cond_signal(&pool->nonempty);
+            pthread_mutex_unlock(&pool->lock);
+            if (single)
+                xmalloc_consume(pool, a, w, false);
+        }
+        pthread_mutex_lock(&pool->lock);
+        pool->producers_left--;
+        pthread_cond_broadcast(&pool->nonempty);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    /* consumers, and producers once they are done, drain the pool */
+    while (xmalloc_consume(pool, a, w, true))
+        ;
+    return NULL;
+}
+
+/*
+ * scratch - cache-scratch: objects handed out by the main thread sit
+ *           next to each other; each thread frees its own and then
+ *           writes to small objects it allocates itself
+ */
+static void scratch_setup(run_t* run, worker_t* workers) {
+    for (int i = 0; i < run->nthreads; i++)
+        workers[i].state = xalloc(run->a, 8);
+}
+
+static void* scratch_worker(void* arg) {
+    worker_t* w = arg;
+    const allocator_t* a = w->run->a;
+    size_t iterations = w->run->ops / 2;
+
+    a->free(w->state);
+    for (size_t i = 0; i < iterations; i++) {
+        volatile char* p = xalloc(a, 8);
+        for (int k = 0; k < SCRATCH_WRITES; k++)
+            p[k % 8] += 1;
+        a->free((void*)p);
+    }
+    w->ops += 2 * iterations;
+    return NULL;
+}
+
+/*
+ * rss_bytes - resident set size of the process
+ */
+static size_t rss_bytes(void) {
+    unsigned long size, resident = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp != NULL) {
+        if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+            resident = 0;
+        fclose(fp);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * run_benchmark - run one benchmark with nthreads threads and return its
+ *                 throughput in ops/sec; *rss receives the RSS at the end
+ */
+static double run_benchmark(const benchmark_t* bench, const allocator_t* a, int nthreads,
+    size_t ops, size_t* rss) {
+    run_t run = { a, nthreads, ops, NULL };
+    worker_t* workers = calloc(nthreads, sizeof(worker_t));
+    pthread_t* threads = calloc(nthreads, sizeof(pthread_t));
+    uint64_t total = 0;
+    int i;
+
+    if (workers == NULL || threads == NULL) {
+        fprintf(stderr, "calloc failed\n");
+        exit(1);
+    }
+    a->reset();
+    for (i = 0; i < nthreads; i++) {
+        workers[i].run = &run;
+        workers[i].id = i;
+    }
+    if (bench->setup != NULL)
+        bench->setup(&run, workers);
+
+    uint64_t start = now_ns();
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, bench->worker, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    double secs = (now_ns() - start) / 1e9;
+
+    *rss = rss_bytes();
+    for (i = 0; i < nthreads; i++)
+        total += workers[i].ops;
+    if (bench->teardown != NULL)
+        bench->teardown(&run, workers);
+    free(workers);
+    free(threads);
+    return secs > 0 ? total / secs : 0;
+}
+
+/*
+ * print_mm_columns - the mm.c only columns: the comparison with libc and
+ *                    the heap lock counters of the run
+ */
+static void print_mm_columns(double vs_libc, const struct mm_lock_stats* lock) {
+    printf(" %7.2fx %7.1f%% %8.0f", vs_libc,
+        lock->acquisitions ? 100.0 * lock->contended / lock->acquisitions : 0,
+        lock->contended ? (double)lock->wait_ns / lock->contended : 0);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: mtbench [-h] [-n <ops>] [-t <max threads>] [benchmark]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-n <ops>   Requests per thread (default %d).\n", DEFAULT_OPS);
+    fprintf(stderr, "\t-t <n>     Sweep 1, 2, 4, ... up to n threads (default %d).\n",
+        DEFAULT_MAX_THREADS);
+    fprintf(stderr, "\tbenchmark  larson, prodcons, threadtest, xmalloc or scratch.\n");
+}
+
+int main(int argc, char** argv) {
+    static const allocator_t allocators[] = {
+        { "mm", mm_malloc, mm_free, reset_mm },
+        { "libc", malloc, free, reset_libc },
+    };
+    static const benchmark_t benchmarks[] = {
+        { "larson", larson_main, NULL, NULL },
+        { "prodcons", prodcons_worker, prodcons_setup, prodcons_teardown },
+        { "threadtest", threadtest_worker, NULL, NULL },
+        { "xmalloc", xmalloc_worker, xmalloc_setup, xmalloc_teardown },
+        { "scratch", scratch_worker, scratch_setup, NULL },
+    };
+    const int nallocs = sizeof(allocators) / sizeof(allocators[0]);
+    const char* only = NULL;
+    size_t ops = DEFAULT_OPS;
+    int max_threads = DEFAULT_MAX_THREADS;
+    int c;
+
+    while ((c = getopt(argc, argv, "hn:t:")) != EOF) {
+        switch (c) {
+        case 'n':
+            ops = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (optind < argc)
+        only = argv[optind];
+    if (max_threads < 1 || ops < 2 * THREADTEST_BATCH) {
+        usage();
+        exit(1);
+    }
+
+    mem_init();
+    printf("%-11s %-5s %7s %12s %9s %7s %8s %8s %8s\n", "benchmark", "alloc", "threads",
+        "ops/sec", "rss(MB)", "effic", "vs libc", "contend", "wait(ns)");
+
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        const benchmark_t* bench = &benchmarks[b];
+        double base[2] = { 0, 0 };
+        if (only != NULL && strcmp(only, bench->name) != 0)
+            continue;
+        for (int t = 1; t <= max_threads; t *= 2) {
+            double thru[2];
+            size_t rss[2];
+            struct mm_stats mm_run;
+            for (int i = 0; i < nallocs; i++) {
+                thru[i] = run_benchmark(bench, &allocators[i], t, ops, &rss[i]);
+                if (i == 0)
+                    mm_stats(&mm_run);
+                if (t == 1)
+                    base[i] = thru[i];
+            }
+            for (int i = 0; i < nallocs; i++) {
+                printf("%-11s %-5s %7d %12.0f %9.1f %6.0f%%", bench->name, allocators[i].name, t,
+                    thru[i], rss[i] / 1048576.0, base[i] > 0 ? 100.0 * thru[i] / (t * base[i]) : 0);
+                if (i == 0)
+                    print_mm_columns(thru[1] > 0 ? thru[0] / thru[1] : 0, &mm_run.lock);
+                printf("\n");
+            }
+            fflush(stdout);
+        }
+    }
+    mem_deinit();
+    return 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * mtrace.c - LD_PRELOAD allocation recorder
+ *
+ *     LD_PRELOAD=./libmtrace.so MTRACE_FILE=app.bin ./app
+ *
+ * Interposes malloc, free, realloc and calloc and logs every call with
+ * its thread id, size, addresses and a tick delta. Each thread encodes
+ * its events into a private buffer and only takes the file lock to
+ * write a full buffer out as one chunk, in the format of tracefmt.h.
+ * The result can be replayed directly with mdriver -f app.bin.
+ *
+ * The recorder calls the glibc entry points (__libc_malloc and friends)
+ * rather than looking up the next definition with dlsym, because dlsym
+ * itself allocates. Memory the recorder needs for itself comes from
+ * mmap. Calls made while a thread is inside the recorder are not logged.
+ *
+ * At exit the recorder stops first: new events are dropped, the threads
+ * still inside record are waited out, and only then are their buffers
+ * written and the file closed. Events of threads that outlive the
+ * destructor are lost.
+ */
+#define _GNU_SOURCE
+#include "timer.h"
+#include "tracefmt.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+extern void* __libc_malloc(size_t size);
+extern void __libc_free(void* ptr);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+
+#define TBUF_SIZE (64 * 1024) /* bytes of records per thread buffer */
+
+/* Per-thread event buffer */
+typedef struct tbuf {
+    struct tbuf* next;     /* list of all live thread buffers */
+    struct tbuf* prev;
+    uint64_t tid;          /* kernel thread id */
+    uint64_t chunk_start;  /* ticks of the first record in the buffer */
+    uint64_t last_ticks;   /* ticks of the previous record */
+    uintptr_t last_addr;   /* previous address encoded in the buffer */
+    size_t len;            /* bytes of records in data */
+    int active;            /* the owner is appending or flushing */
+    uint8_t data[TBUF_SIZE];
+} tbuf_t;
+
+static __thread tbuf_t* mybuf __attribute__((tls_model("initial-exec")));
+static __thread int busy __attribute__((tls_model("initial-exec")));
+
+static int trace_fd = -1;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static tbuf_t* all_bufs;
+static int stopping; /* set once by mtrace_fini; no events after it */
+static pthread_key_t exit_key;
+
+/*
+ * write_all - write a whole buffer, retrying short writes
+ */
+static void write_all(const uint8_t* p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(trace_fd, p, len);
+        if (n <= 0)
+            return;
+        p += n;
+        len -= n;
+    }
+}
+
+/*
+ * write_clock - write a clock chunk pairing the tick counter with time.
+ *               Caller holds trace_lock.
+ */
+static void write_clock(void) {
+    uint8_t hdr[32], * p = hdr;
+    p = put_varint(p, 0);
+    p = put_varint(p, read_ticks());
+    p = put_varint(p, now_ns());
+    write_all(hdr, p - hdr);
+}
+
+/*
+ * write_chunk - write the records of a thread buffer out as one chunk.
+ *               Caller holds trace_lock.
+ */
+static void write_chunk(tbuf_t* t) {
+    uint8_t hdr[32], * p = hdr;
+
+    if (t->len == 0)
+        return;
+    p = put_varint(p, t->tid);
+    p = put_varint(p, t->chunk_start);
+    p = put_varint(p, t->len);
+    if (trace_fd >= 0) {
+        write_all(hdr, p - hdr);
+        write_all(t->data, t->len);
+    }
+    t->len = 0;
+}
+
+static void flush(tbuf_t* t) {
+    pthread_mutex_lock(&trace_lock);
+    write_chunk(t);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * enter - claim the calling thread's buffer for appending; false once
+ *         the recorder has stopped. Paired with leave.
+ */
+static bool enter(tbuf_t* t) {
+    __atomic_store_n(&t->active, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&t->active, 0, __ATOMIC_RELEASE);
+        return false;
+    }
+    return true;
+}
+
+static void leave(tbuf_t* t) {
+    __atomic_store_n(&t->active, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * thread_exit - flush and release the buffer of an exiting thread
+ */
+static void thread_exit(void* arg) {
+    tbuf_t* t = arg;
+
+    busy++;
+    if (enter(t)) {
+        flush(t);
+        leave(t);
+    }
+    pthread_mutex_lock(&trace_lock);
+    if (t->prev != NULL)
+        t->prev->next = t->next;
+    else
+        all_bufs = t->next;
+    if (t->next != NULL)
+        t->next->prev = t->prev;
+    pthread_mutex_unlock(&trace_lock);
+    mybuf = NULL;
+    munmap(t, sizeof(tbuf_t));
+    busy--;
+}
+
+/*
+ * get_buf - return the calling thread's buffer, creating it on first use
+ */
+static tbuf_t* get_buf(void) {
+    tbuf_t* t;
+
+    if (mybuf != NULL)
+        return mybuf;
+    busy++;
+    t = mmap(NULL, sizeof(tbuf_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (t == MAP_FAILED) {
+        busy--;
+        return NULL;
+    }
+    t->tid = syscall(SYS_gettid);
+    t->len = 0;
+    pthread_mutex_lock(&trace_lock);
+    t->prev = NULL;
+    t->next = all_bufs;
+    if (all_bufs != NULL)
+        all_bufs->prev = t;
+    all_bufs = t;
+    pthread_mutex_unlock(&trace_lock);
+    pthread_setspecific(exit_key, t);
+    mybuf = t;
+    busy--;
+    return t;
+}
+
+/*
+ * record - append one event, stamped now, to the calling thread's buffer
+ */
+static void record(enum trace_record op, uint64_t now, size_t size, uintptr_t a, uintptr_t b) {
+    tbuf_t* t;
+    uint8_t* p;
+
+    if (busy || __atomic_load_n(&stopping, __ATOMIC_RELAXED) || (t = get_buf()) == NULL ||
+        !enter(t))
+        return;
+    if (now < t->last_ticks && t->len > 0)
+        now = t->last_ticks; /* stamped before a record made since */
+    if (t->len + TR_RECORD_MAX > TBUF_SIZE) {
+        busy++;
+        flush(t);
+        busy--;
+    }
+    if (t->len == 0) {
+        t->chunk_start = now;
+        t->last_ticks = now;
+        t->last_addr = 0;
+    }
+
+    p = t->data + t->len;
+    *p++ = op;
+    p = put_varint(p, now - t->last_ticks);
+    if (op != TR_FREE)
+        p = put_varint(p, size);
+    p = put_varint(p, zigzag((int64_t)(a - t->last_addr)));
+    t->last_addr = a;
+    if (op == TR_REALLOC) {
+        p = put_varint(p, zigzag((int64_t)(b - t->last_addr)));
+        t->last_addr = b;
+    }
+    t->last_ticks = now;
+    t->len = p - t->data;
+    leave(t);
+}
+
+void* malloc(size_t size) {
+    void* p = __libc_malloc(size);
+    if (p != NULL)
+        record(TR_MALLOC, read_ticks(), size, (uintptr_t)p, 0);
+    return p;
+}
+
+void free(void* ptr) {
+    if (ptr != NULL)
+        record(TR_FREE, read_ticks(), 0, (uintptr_t)ptr, 0);
+    __libc_free(ptr);
+}
+
+void* realloc(void* ptr, size_t size) {
+    /* stamped before the call, which may free ptr for another thread to
+       reuse; the realloc must sort before that reuse */
+    uint64_t now = read_ticks();
+    void* p = __libc_realloc(ptr, size);
+    /* a failed realloc leaves the old block alone */
+    if (p != NULL || size == 0)
+        record(TR_REALLOC, now, size, (uintptr_t)ptr, (uintptr_t)p);
+    return p;
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    void* p = __libc_calloc(nmemb, size);
+    if (p != NULL)
+        record(TR_CALLOC, read_ticks(), nmemb * size, (uintptr_t)p, 0);
+    return p;
+}
+
+__attribute__((constructor)) static void mtrace_init(void) {
+    const char* path = getenv("MTRACE_FILE");
+    int fd;
+
+    busy++;
+    if (path == NULL)
+        path = "mtrace.bin";
+    if (pthread_key_create(&exit_key, thread_exit) != 0 ||
+        (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+        busy--;
+        return;
+    }
+    pthread_mutex_lock(&trace_lock);
+    trace_fd = fd;
+    write_all((const uint8_t*)TRACE_MAGIC, TRACE_MAGIC_LEN);
+    write_clock();
+    pthread_mutex_unlock(&trace_lock);
+    busy--;
+}
+
+__attribute__((destructor)) static void mtrace_fini(void) {
+    bool waiting;
+
+    busy++;
+    if (trace_fd < 0)
+        return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+    /* wait out the threads inside record; a buffer that is not active
+       once stopping is set stays untouched */
+    for (;;) {
+        pthread_mutex_lock(&trace_lock);
+        waiting = false;
+        for (tbuf_t* t = all_bufs; t != NULL; t = t->next)
+            waiting |= __atomic_load_n(&t->active, __ATOMIC_ACQUIRE) != 0;
+        if (!waiting)
+            break;
+        pthread_mutex_unlock(&trace_lock);
+        sched_yield();
+    }
+    /* threads still running at exit get their buffers written here */
+    for (tbuf_t* t = all_bufs; t != NULL; t = t->next)
+        write_chunk(t);
+    write_clock();
+    close(trace_fd);
+    trace_fd = -1;
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,289 @@
+/*
+ * pages.c - The page providers of pages.h
+ *
+ * None of the providers lock: memlib calls them from mem_init and
+ * mem_deinit, and otherwise only for the allocator, under its heap lock.
+ */
+#define _GNU_SOURCE
+#include "pages.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define HUGE_PAGE_SIZE (2UL << 20) /* the default huge page size on x86-64 and arm64 */
+#define MAX_NODES 1024             /* NUMA nodes bind can name */
+#define SIM_BASE ((char*)((uintptr_t)1 << 44)) /* where the sim arena is asked for */
+#define SIM_ARENA ((size_t)1 << 40)            /* address space of the sim arena */
+
+static size_t system_page_size(void) {
+    return (size_t)getpagesize();
+}
+
+static size_t huge_page_size(void) {
+    return HUGE_PAGE_SIZE;
+}
+
+/* bind_node - make node the preferred NUMA node of a range */
+static int bind_node(void* addr, size_t size, int node) {
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+
+    if (node < 0 || node >= MAX_NODES) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    return syscall(SYS_mbind, addr, size, MPOL_PREFERRED, mask, MAX_NODES, 0);
+}
+
+static int advise_hugepages(void* addr, size_t size, bool on) {
+    return madvise(addr, size, on ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+}
+
+static void* mmap_reserve(size_t size);
+static int mmap_commit(void* addr, size_t size);
+static int mmap_decommit(void* addr, size_t size);
+static void mmap_release(void* addr, size_t size);
+
+/*
+ * sbrk - the process break, owned from sbrk_lo to sbrk_hi. Only one
+ *        reservation can live in the break; any further ones are
+ *        anonymous mappings, which never overlap the break's pages.
+ */
+static char* sbrk_lo; /* start of the reservation, NULL if there is none */
+static char* sbrk_hi; /* end of what was taken from the break */
+
+static bool in_break(const void* addr) {
+    return sbrk_lo != NULL && (const char*)addr >= sbrk_lo && (const char*)addr <= sbrk_hi;
+}
+
+static void* sbrk_reserve(size_t size) {
+    size_t page = system_page_size();
+    char* p;
+
+    if (sbrk_lo != NULL)
+        return mmap_reserve(size);
+    if ((p = sbrk(0)) == (void*)-1)
+        return NULL;
+    /* start on a page boundary */
+    if (((uintptr_t)p & (page - 1)) != 0 &&
+        (p = sbrk(page - ((uintptr_t)p & (page - 1)))) == (void*)-1)
+        return NULL;
+    p = sbrk(0);
+    sbrk_lo = sbrk_hi = p;
+    return p;
+}
+
+static int sbrk_commit(void* addr, size_t size) {
+    char* end = (char*)addr + size;
+
+    if (!in_break(addr))
+        return mmap_commit(addr, size);
+    /* pages given back with madvise are still ours */
+    if (end <= sbrk_hi)
+        return 0;
+    if (sbrk(0) != sbrk_hi || sbrk(end - sbrk_hi) == (void*)-1) {
+        errno = ENOMEM;
+        return -1;
+    }
+    sbrk_hi = end;
+    return 0;
+}
+
+static int sbrk_decommit(void* addr, size_t size) {
+    if (!in_break(addr))
+        return mmap_decommit(addr, size);
+    if ((char*)addr + size == sbrk_hi && sbrk(0) == sbrk_hi &&
+        sbrk(-(intptr_t)size) != (void*)-1) {
+        sbrk_hi = addr;
+        return 0;
+    }
+    return madvise(addr, size, MADV_DONTNEED);
+}
+
+static void sbrk_release(void* addr, size_t size) {
+    if (addr != sbrk_lo) {
+        mmap_release(addr, size);
+        return;
+    }
+    if (sbrk_hi > sbrk_lo)
+        sbrk_decommit(sbrk_lo, sbrk_hi - sbrk_lo);
+    sbrk_lo = sbrk_hi = NULL;
+}
+
+const struct page_provider pages_sbrk = {
+    "sbrk", system_page_size, sbrk_reserve, sbrk_commit, sbrk_decommit, sbrk_release,
+    advise_hugepages, bind_node,
+};
+
+/*
+ * mmap - anonymous mappings without access until committed
+ */
+static void* mmap_reserve(size_t size) {
+    void* p = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static int mmap_commit(void* addr, size_t size) {
+    return mprotect(addr, size, PROT_READ | PROT_WRITE);
+}
+
+static int mmap_decommit(void* addr, size_t size) {
+    if (madvise(addr, size, MADV_DONTNEED) < 0)
+        return -1;
+    return mprotect(addr, size, PROT_NONE);
+}
+
+static void mmap_release(void* addr, size_t size) {
+    munmap(addr, size);
+}
+
+const struct page_provider pages_mmap = {
+    "mmap", system_page_size, mmap_reserve, mmap_commit, mmap_decommit, mmap_release,
+    advise_hugepages, bind_node,
+};
+
+/*
+ * file - shared mappings of one file; every reservation gets a range of
+ *        the file of its own, which stays sparse until pages are written
+ */
+static int file_fd = -1;
+static off_t file_end; /* file offset of the next reservation */
+
+static void* file_reserve(size_t size) {
+    const char* path = getenv("MM_PAGES_FILE");
+    void* p;
+
+    if (file_fd < 0) {
+        file_fd = path != NULL ? open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)
+                               : memfd_create("mm-heap", MFD_CLOEXEC);
+        if (file_fd < 0)
+            return NULL;
+    }
+    if (ftruncate(file_fd, file_end + size) < 0)
+        return NULL;
+    p = mmap(NULL, size, PROT_NONE, MAP_SHARED | MAP_NORESERVE, file_fd, file_end);
+    if (p == MAP_FAILED)
+        return NULL;
+    file_end += size;
+    return p;
+}
+
+static int file_decommit(void* addr, size_t size) {
+    if (madvise(addr, size, MADV_REMOVE) < 0)
+        return -1;
+    return mprotect(addr, size, PROT_NONE);
+}
+
+static void file_release(void* addr, size_t size) {
+    madvise(addr, size, MADV_REMOVE);
+    munmap(addr, size);
+}
+
+const struct page_provider pages_file = {
+    "file", system_page_size, file_reserve, mmap_commit, file_decommit, file_release,
+    advise_hugepages, bind_node,
+};
+
+/*
+ * hugetlb - reservations aligned to huge pages; commit maps huge pages
+ *           over the reserved range
+ */
+static void* hugetlb_reserve(size_t size) {
+    size_t extra = HUGE_PAGE_SIZE - system_page_size();
+    char* p = mmap_reserve(size + extra);
+    char* aligned;
+
+    if (p == NULL)
+        return NULL;
+    /* trim to a huge page boundary */
+    aligned = (char*)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (aligned > p)
+        munmap(p, aligned - p);
+    if (aligned + size < p + size + extra)
+        munmap(aligned + size, p + size + extra - (aligned + size));
+    return aligned;
+}
+
+static int hugetlb_commit(void* addr, size_t size) {
+    void* p = mmap(addr, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_FIXED, -1, 0);
+
+    if (p != MAP_FAILED)
+        return 0;
+    /* a failed MAP_FIXED may leave a hole; put the reservation back */
+    mmap(addr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    errno = ENOMEM;
+    return -1;
+}
+
+static int hugetlb_decommit(void* addr, size_t size) {
+    void* p = mmap(addr, size, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    return p == MAP_FAILED ? -1 : 0;
+}
+
+const struct page_provider pages_hugetlb = {
+    "hugetlb", huge_page_size, hugetlb_reserve, hugetlb_commit, hugetlb_decommit, mmap_release,
+    NULL, bind_node,
+};
+
+/*
+ * sim - one arena, mapped once and carved up from the bottom
+ */
+static char* sim_arena;
+static char* sim_top; /* end of the reservations made so far */
+
+static void* sim_reserve(size_t size) {
+    size_t page = system_page_size();
+    char* p;
+
+    if (sim_arena == NULL) {
+        p = mmap(SIM_BASE, SIM_ARENA, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+        sim_arena = sim_top = p;
+    }
+    size = (size + page - 1) & ~(page - 1);
+    if (size > (size_t)(sim_arena + SIM_ARENA - sim_top))
+        return NULL;
+    p = sim_top;
+    sim_top += size;
+    return p;
+}
+
+static int sim_commit(void* addr, size_t size) {
+    (void)addr;
+    (void)size;
+    return 0;
+}
+
+/* only the last reservation gives its address space back */
+static void sim_release(void* addr, size_t size) {
+    size_t page = system_page_size();
+
+    if ((char*)addr + ((size + page - 1) & ~(page - 1)) == sim_top)
+        sim_top = addr;
+}
+
+const struct page_provider pages_sim = {
+    "sim", system_page_size, sim_reserve, sim_commit, sim_commit, sim_release, NULL, NULL,
+};
+
+const struct page_provider* pages_find(const char* name) {
+    static const struct page_provider* all[] = {
+        &pages_sbrk, &pages_mmap, &pages_file, &pages_hugetlb, &pages_sim,
+    };
+
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++)
+        if (strcmp(all[i]->name, name) == 0)
+            return all[i];
+    return NULL;
+}
@@ -0,0 +1,57 @@
+/*
+ * pages.h - Page providers: where memlib gets the memory of the heap
+ *
+ * A provider hands out memory in two steps. reserve sets aside a range
+ * of address space without making it usable; commit makes part of a
+ * reserved range readable and writable; decommit gives the pages of a
+ * committed part back but keeps the range reserved; release gives back
+ * a whole reservation. Addresses and sizes passed to commit, decommit
+ * and release are multiples of the provider's page size and lie within
+ * one range returned by reserve. The heap never relies on committed
+ * memory being zero.
+ *
+ * hugepages and bind are hints, NULL where a provider has no use for
+ * them; memlib ignores their failures.
+ *
+ *      sbrk     the process break. It holds one reservation, which grows
+ *               and shrinks only at its end and only while no one else
+ *               (libc malloc, say) has moved the break; other
+ *               reservations are anonymous mappings as with mmap.
+ *      mmap     anonymous mappings; commit and decommit are mprotect
+ *               and madvise (the default)
+ *      file     shared mappings of a memfd, or of the file named by
+ *               MM_PAGES_FILE; decommitted pages are punched out of it
+ *      hugetlb  anonymous mappings from the huge page pool (the pool
+ *               hugetlbfs uses); commit fails once the pool is empty
+ *      sim      an in-memory simulation: reservations are carved from
+ *               one arena at a fixed address and commits only count, so
+ *               benchmarks see no system calls and the same addresses
+ *               every run
+ */
+#ifndef PAGES_H
+#define PAGES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct page_provider {
+    const char* name;
+    size_t (*page_size)(void);
+    void* (*reserve)(size_t size);            /* NULL if it can not */
+    int (*commit)(void* addr, size_t size);   /* -1 if it can not */
+    int (*decommit)(void* addr, size_t size); /* -1 if it can not */
+    void (*release)(void* addr, size_t size);
+    int (*hugepages)(void* addr, size_t size, bool on); /* back with huge pages */
+    int (*bind)(void* addr, size_t size, int node);     /* prefer NUMA node */
+};
+
+extern const struct page_provider pages_sbrk;
+extern const struct page_provider pages_mmap;
+extern const struct page_provider pages_file;
+extern const struct page_provider pages_hugetlb;
+extern const struct page_provider pages_sim;
+
+/* pages_find - the provider called name, NULL if there is none */
+const struct page_provider* pages_find(const char* name);
+
+#endif /* PAGES_H */
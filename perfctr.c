@@ -0,0 +1,113 @@
+/*
+ * perfctr.c - Hardware performance counters around benchmark phases
+ */
+#include "perfctr.h"
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const struct {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+} events[PC_NUM_EVENTS] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "L1d-misses", PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { "LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "dTLB-misses", PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+/* layout of a read with PERF_FORMAT_TOTAL_TIME_ENABLED | _RUNNING */
+struct reading {
+    uint64_t value;
+    uint64_t enabled;
+    uint64_t running;
+};
+
+/*
+ * perfctr_open - open every event for the calling thread; returns the
+ *                number of events that are available
+ */
+int perfctr_open(perfctr_t* pc) {
+    struct perf_event_attr attr;
+    int n = 0;
+
+    for (int i = 0; i < PC_NUM_EVENTS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pc->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (pc->fd[i] >= 0)
+            n++;
+    }
+    perfctr_reset(pc);
+    return n;
+}
+
+void perfctr_close(perfctr_t* pc) {
+    for (int i = 0; i < PC_NUM_EVENTS; i++) {
+        if (pc->fd[i] >= 0)
+            close(pc->fd[i]);
+        pc->fd[i] = -1;
+    }
+}
+
+/*
+ * perfctr_reset - zero the accumulated counts
+ */
+void perfctr_reset(perfctr_t* pc) {
+    memset(pc->values, 0, sizeof(pc->values));
+}
+
+/*
+ * perfctr_start - start counting a phase
+ */
+void perfctr_start(perfctr_t* pc) {
+    for (int i = 0; i < PC_NUM_EVENTS; i++) {
+        if (pc->fd[i] >= 0) {
+            ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+/*
+ * perfctr_stop - stop counting and add the phase to the accumulated
+ *                counts, scaled up if the kernel had to multiplex
+ */
+void perfctr_stop(perfctr_t* pc) {
+    struct reading r;
+
+    for (int i = 0; i < PC_NUM_EVENTS; i++) {
+        if (pc->fd[i] >= 0)
+            ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (int i = 0; i < PC_NUM_EVENTS; i++) {
+        if (pc->fd[i] < 0 || read(pc->fd[i], &r, sizeof(r)) != sizeof(r))
+            continue;
+        if (r.running > 0 && r.running < r.enabled)
+            r.value = (uint64_t)((double)r.value * r.enabled / r.running);
+        pc->values[i] += r.value;
+    }
+}
+
+bool perfctr_available(const perfctr_t* pc, int event) {
+    return pc->fd[event] >= 0;
+}
+
+const char* perfctr_name(int event) {
+    return events[event].name;
+}
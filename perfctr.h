@@ -0,0 +1,38 @@
+/*
+ * perfctr.h - Hardware performance counters around benchmark phases
+ *
+ * Wraps perf_event_open for the calling thread, user space only. Each
+ * event is opened on its own so that a machine or container lacking one
+ * of them (or forbidding perf events altogether) still gets the rest;
+ * perfctr_open returns how many could be opened and the others read 0.
+ */
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum perfctr_event {
+    PC_CYCLES,
+    PC_INSTRUCTIONS,
+    PC_L1D_MISSES,
+    PC_LLC_MISSES,
+    PC_DTLB_MISSES,
+    PC_BRANCH_MISSES,
+    PC_NUM_EVENTS
+};
+
+typedef struct {
+    int fd[PC_NUM_EVENTS];               /* -1 if the event is unavailable */
+    uint64_t values[PC_NUM_EVENTS];      /* accumulated counts */
+} perfctr_t;
+
+int perfctr_open(perfctr_t* pc);
+void perfctr_close(perfctr_t* pc);
+void perfctr_reset(perfctr_t* pc);
+void perfctr_start(perfctr_t* pc);
+void perfctr_stop(perfctr_t* pc);
+bool perfctr_available(const perfctr_t* pc, int event);
+const char* perfctr_name(int event);
+
+#endif /* PERFCTR_H */
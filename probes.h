@@ -0,0 +1,54 @@
+/*
+ * probes.h - USDT static probes in mm.c
+ *
+ * With <sys/sdt.h> (systemtap-sdt-dev) installed, mm.c carries
+ * SystemTap-compatible probes of provider "mm" that bpftrace, perf and
+ * stap attach to in an unmodified binary:
+ *
+ *      malloc_entry   size
+ *      malloc_return  size, payload (NULL if out of memory)
+ *      free           payload, requested size
+ *      fit_miss       adjusted size, free blocks scanned
+ *      extend_heap    bytes, new free block (NULL if sbrk failed)
+ *      coalesce       case (1-4 as in coalesce), resulting free block, its size
+ *      place_split    allocated block, its size, remainder split off
+ *
+ *      bpftrace -e 'usdt:./mdriver:mm:fit_miss { @[arg1] = count(); }'
+ *
+ * A probe site is a single NOP until a tracer attaches. Every probe has
+ * a semaphore, which a tracer increments while attached, so
+ * MM_PROBE_ENABLED can skip work done only to compute probe arguments.
+ * Without <sys/sdt.h> the probes compile to nothing.
+ */
+#ifndef PROBES_H
+#define PROBES_H
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define MM_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef MM_HAVE_SDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define MM_SEMAPHORE(name) \
+    __extension__ unsigned short mm_##name##_semaphore __attribute__((unused, section(".probes")))
+
+MM_SEMAPHORE(malloc_entry);
+MM_SEMAPHORE(malloc_return);
+MM_SEMAPHORE(free);
+MM_SEMAPHORE(fit_miss);
+MM_SEMAPHORE(extend_heap);
+MM_SEMAPHORE(coalesce);
+MM_SEMAPHORE(place_split);
+
+#define MM_PROBE(name, ...) STAP_PROBEV(mm, name, ##__VA_ARGS__)
+#define MM_PROBE_ENABLED(name) __builtin_expect(mm_##name##_semaphore, 0)
+#else
+#define MM_PROBE(name, ...) ((void)0)
+#define MM_PROBE_ENABLED(name) 0
+#endif
+
+#endif /* PROBES_H */
@@ -0,0 +1,49 @@
+/*
+ * rng.h - Small deterministic random number generator for the benchmarks
+ *
+ * xorshift64* is fast and good enough to draw sizes and lifetimes; the
+ * same seed always yields the same workload on every machine.
+ */
+#ifndef RNG_H
+#define RNG_H
+
+#include <math.h>
+#include <stdint.h>
+
+typedef struct {
+    uint64_t s;
+} rng_t;
+
+static inline void rng_seed(rng_t* r, uint64_t seed) {
+    r->s = seed ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+static inline uint64_t rng_next(rng_t* r) {
+    r->s ^= r->s >> 12;
+    r->s ^= r->s << 25;
+    r->s ^= r->s >> 27;
+    return r->s * 0x2545f4914f6cdd1dULL;
+}
+
+/* rng_double - uniform in [0, 1) */
+static inline double rng_double(rng_t* r) {
+    return (rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* rng_range - uniform integer in [lo, hi] */
+static inline uint64_t rng_range(rng_t* r, uint64_t lo, uint64_t hi) {
+    return lo + rng_next(r) % (hi - lo + 1);
+}
+
+/* rng_pareto - power-law value >= lo with tail exponent alpha, capped at hi */
+static inline uint64_t rng_pareto(rng_t* r, uint64_t lo, uint64_t hi, double alpha) {
+    double v = lo / pow(1.0 - rng_double(r), 1.0 / alpha);
+    return v > hi ? hi : (uint64_t)v;
+}
+
+/* rng_exponential - exponentially distributed value with the given mean */
+static inline double rng_exponential(rng_t* r, double mean) {
+    return -mean * log(1.0 - rng_double(r));
+}
+
+#endif /* RNG_H */
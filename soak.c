@@ -0,0 +1,303 @@
+/*
+ * soak.c - Long-running fragmentation simulator
+ *
+ * Drives the allocator with a stationary allocate/free process: every
+ * step allocates one object whose size and lifetime (in steps) are drawn
+ * from configurable distributions, after freeing the objects whose
+ * lifetime has run out. With exponential lifetimes of mean L the live
+ * population settles around L objects (Little's law), so any drift in
+ * heap size over time is fragmentation, not growth of the workload.
+ *
+ * Every -i steps the simulator walks the heap and prints one CSV row:
+ *
+ *      step, heap bytes, live bytes, live/heap, free blocks,
+ *      largest free block, 1 - largest/total free, and the number of
+ *      free blocks in each power-of-two size bucket (h5 = 32..63 bytes,
+ *      h6 = 64..127, ...)
+ *
+ * Runs of billions of steps are the intended use; -n accepts 1e9.
+ * -p selects the placement policy, so runs with the same seed compare
+ * the long-run fragmentation of the policies. With -d every sample also
+ * writes a heap snapshot (mm_heap_dump) to <prefix>.<step>.snap, for
+ * heapview to render or diff.
+ */
+#include "memlib.h"
+#include "mm.h"
+#include "rng.h"
+#include "timer.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_STEPS 10000000
+#define DEFAULT_INTERVAL 1000000
+#define DEFAULT_LIFETIME 10000 /* mean lifetime in steps */
+#define HIST_MIN 5             /* smallest bucket: 2^5 bytes */
+#define HIST_MAX 30            /* largest bucket: 2^30 bytes and up */
+
+enum size_dist { FIXED, UNIFORM, POWERLAW, BIMODAL };
+enum life_dist { EXPONENTIAL, PARETO, BYSIZE };
+
+/* An object waiting to be freed, ordered by the step it dies at */
+typedef struct {
+    uint64_t death;
+    void* ptr;
+    size_t size;
+} object_t;
+
+/* Min-heap of live objects keyed by death step */
+static object_t* objects;
+static size_t num_objects, max_objects;
+
+/* Free block statistics gathered by one heap walk */
+typedef struct {
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t largest_free;
+    size_t hist[HIST_MAX - HIST_MIN + 1];
+} walk_t;
+
+static void push(object_t o) {
+    size_t i;
+
+    if (num_objects == max_objects) {
+        max_objects = max_objects ? 2 * max_objects : 4096;
+        if ((objects = realloc(objects, max_objects * sizeof(object_t))) == NULL) {
+            fprintf(stderr, "realloc failed in push\n");
+            exit(1);
+        }
+    }
+    for (i = num_objects++; i > 0 && objects[(i - 1) / 2].death > o.death; i = (i - 1) / 2)
+        objects[i] = objects[(i - 1) / 2];
+    objects[i] = o;
+}
+
+static object_t pop(void) {
+    object_t top = objects[0];
+    object_t last = objects[--num_objects];
+    size_t i = 0, child;
+
+    while ((child = 2 * i + 1) < num_objects) {
+        if (child + 1 < num_objects && objects[child + 1].death < objects[child].death)
+            child++;
+        if (last.death <= objects[child].death)
+            break;
+        objects[i] = objects[child];
+        i = child;
+    }
+    objects[i] = last;
+    return top;
+}
+
+static size_t draw_size(rng_t* r, enum size_dist d, size_t max_size) {
+    switch (d) {
+    case FIXED:
+        return 64;
+    case UNIFORM:
+        return rng_range(r, 1, max_size);
+    case POWERLAW:
+        return rng_pareto(r, 16, max_size, 1.2);
+    case BIMODAL:
+    default:
+        return rng_double(r) < 0.8 ? rng_range(r, 16, 64) : rng_range(r, max_size / 4, max_size);
+    }
+}
+
+static uint64_t draw_lifetime(rng_t* r, enum life_dist d, double mean, size_t size, size_t max_size) {
+    switch (d) {
+    case EXPONENTIAL:
+        return 1 + (uint64_t)rng_exponential(r, mean);
+    case PARETO:
+        /* heavy tail with the same mean: most objects die young, a few live very long */
+        return rng_pareto(r, mean / 3, UINT64_MAX / 2, 1.5);
+    case BYSIZE:
+    default:
+        /* large objects live longer; for uniform sizes the mean is unchanged */
+        return 1 + (uint64_t)rng_exponential(r, mean * ((double)size / max_size + 0.5));
+    }
+}
+
+static void walk_block(void* payload, size_t size, int allocated, void* arg) {
+    walk_t* w = arg;
+    int bucket;
+
+    if (allocated)
+        return;
+    w->free_blocks++;
+    w->free_bytes += size;
+    if (size > w->largest_free)
+        w->largest_free = size;
+    bucket = 63 - __builtin_clzll(size);
+    if (bucket < HIST_MIN)
+        bucket = HIST_MIN;
+    if (bucket > HIST_MAX)
+        bucket = HIST_MAX;
+    w->hist[bucket - HIST_MIN]++;
+}
+
+static void sample(FILE* out, uint64_t step, size_t live, const char* snapshots) {
+    walk_t w;
+    struct mm_stats st;
+    size_t heap;
+
+    mm_stats(&st);
+    heap = st.heap_size;
+
+    if (snapshots != NULL) {
+        char path[4096];
+        int fd;
+        snprintf(path, sizeof(path), "%s.%lu.snap", snapshots, (unsigned long)step);
+        if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 || mm_heap_dump(fd) < 0) {
+            fprintf(stderr, "Could not write the heap snapshot %s\n", path);
+            exit(1);
+        }
+        close(fd);
+    }
+
+    memset(&w, 0, sizeof(w));
+    mm_heap_walk(walk_block, &w);
+    fprintf(out, "%lu,%zu,%zu,%.4f,%zu,%zu,%.4f", (unsigned long)step, heap, live,
+        heap ? (double)live / heap : 0, w.free_blocks, w.largest_free,
+        w.free_bytes ? 1.0 - (double)w.largest_free / w.free_bytes : 0);
+    for (int i = 0; i <= HIST_MAX - HIST_MIN; i++)
+        fprintf(out, ",%zu", w.hist[i]);
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+static int lookup(const char* name, const char* const* names, int n) {
+    for (int i = 0; i < n; i++)
+        if (strcmp(name, names[i]) == 0)
+            return i;
+    fprintf(stderr, "Unknown name %s\n", name);
+    exit(1);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: soak [-h] [-n <steps>] [-i <interval>] [-s <sizes>] [-m <max size>]\n"
+                    "            [-l <lifetimes>] [-L <mean>] [-p <policy>] [-S <seed>] [-o <file>]\n"
+                    "            [-d <prefix>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-d <pre>   Write a heap snapshot to <pre>.<step>.snap at every sample.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-i <n>     Steps between samples (default %d).\n", DEFAULT_INTERVAL);
+    fprintf(stderr, "\t-l <dist>  Lifetimes: exp, pareto or bysize (default exp).\n");
+    fprintf(stderr, "\t-L <n>     Mean lifetime in steps (default %d).\n", DEFAULT_LIFETIME);
+    fprintf(stderr, "\t-m <n>     Largest object size (default 4096).\n");
+    fprintf(stderr, "\t-n <n>     Steps to simulate (default %d).\n", DEFAULT_STEPS);
+    fprintf(stderr, "\t-o <file>  Write the samples to <file> instead of stdout.\n");
+    fprintf(stderr, "\t-p <fit>   Placement policy: first, next or best (default first).\n");
+    fprintf(stderr, "\t-s <dist>  Sizes: fixed, uniform, powerlaw or bimodal (default uniform).\n");
+    fprintf(stderr, "\t-S <seed>  Random seed.\n");
+}
+
+int main(int argc, char** argv) {
+    static const char* size_names[] = { "fixed", "uniform", "powerlaw", "bimodal" };
+    static const char* life_names[] = { "exp", "pareto", "bysize" };
+    static const char* fit_names[] = { "first", "next", "best" };
+    struct mm_config config = { MM_FIRST_FIT, 32, 1 << 16 };
+    enum size_dist sdist = UNIFORM;
+    enum life_dist ldist = EXPONENTIAL;
+    uint64_t steps = DEFAULT_STEPS, interval = DEFAULT_INTERVAL, seed = 1, step;
+    double mean_life = DEFAULT_LIFETIME;
+    size_t max_size = 4096, live = 0;
+    FILE* out = stdout;
+    const char* snapshots = NULL;
+    rng_t r;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:hi:l:L:m:n:o:p:s:S:")) != EOF) {
+        switch (c) {
+        case 'd':
+            snapshots = optarg;
+            break;
+        case 'i':
+            interval = (uint64_t)strtod(optarg, NULL);
+            break;
+        case 'l':
+            ldist = lookup(optarg, life_names, 3);
+            break;
+        case 'L':
+            mean_life = strtod(optarg, NULL);
+            break;
+        case 'm':
+            max_size = (size_t)strtod(optarg, NULL);
+            break;
+        case 'n':
+            steps = (uint64_t)strtod(optarg, NULL);
+            break;
+        case 'o':
+            if ((out = fopen(optarg, "w")) == NULL) {
+                fprintf(stderr, "Could not open %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'p':
+            config.fit = lookup(optarg, fit_names, 3);
+            break;
+        case 's':
+            sdist = lookup(optarg, size_names, 4);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (interval == 0 || mean_life < 1 || max_size < 16) {
+        usage();
+        exit(1);
+    }
+
+    rng_seed(&r, seed);
+    mem_init();
+    if (mm_configure(&config) < 0 || mm_init() < 0) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+
+    fprintf(out, "step,heap,live,util,free_blocks,largest_free,frag");
+    for (int i = HIST_MIN; i <= HIST_MAX; i++)
+        fprintf(out, ",h%d", i);
+    fprintf(out, "\n");
+
+    uint64_t start = now_ns();
+    for (step = 1; step <= steps; step++) {
+        while (num_objects > 0 && objects[0].death <= step) {
+            object_t o = pop();
+            mm_free(o.ptr);
+            live -= o.size;
+        }
+
+        object_t o;
+        o.size = draw_size(&r, sdist, max_size);
+        o.death = step + draw_lifetime(&r, ldist, mean_life, o.size, max_size);
+        if ((o.ptr = mm_malloc(o.size)) == NULL) {
+            fprintf(stderr, "mm_malloc(%zu) failed at step %lu: heap exhausted\n", o.size,
+                (unsigned long)step);
+            sample(out, step, live, snapshots);
+            break;
+        }
+        push(o);
+        live += o.size;
+
+        if (step % interval == 0)
+            sample(out, step, live, snapshots);
+    }
+    fprintf(stderr, "%lu steps in %.1f s\n", (unsigned long)(step - 1), (now_ns() - start) / 1e9);
+
+    if (out != stdout)
+        fclose(out);
+    free(objects);
+    mem_deinit();
+    return 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * timer.c - Calibration of the tick counter in timer.h
+ */
+#include "timer.h"
+
+/*
+ * ticks_per_ns - rate of read_ticks, measured against the monotonic
+ *                clock over about 20ms on first use
+ */
+double ticks_per_ns(void) {
+    static double rate;
+    uint64_t t0, t1, n0, n1;
+
+    if (rate > 0)
+        return rate;
+    n0 = now_ns();
+    t0 = read_ticks();
+    do {
+        n1 = now_ns();
+    } while (n1 - n0 < 20000000);
+    t1 = read_ticks();
+    rate = (double)(t1 - t0) / (n1 - n0);
+    return rate;
+}
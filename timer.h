@@ -0,0 +1,32 @@
+/*
+ * timer.h - Wall clock and cycle counter timing for the driver and tools
+ */
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* now_ns - monotonic time in nanoseconds */
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * read_ticks - a cheap, monotonic tick counter. This is the TSC on x86
+ *              and nanoseconds elsewhere; callers that need time must
+ *              convert with a rate measured against now_ns.
+ */
+static inline uint64_t read_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+double ticks_per_ns(void);
+
+#endif /* TIMER_H */
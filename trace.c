@@ -0,0 +1,347 @@
+/*
+ * trace.c - Reading allocation traces
+ *
+ * Traces come either in the text format described in trace.h or in the
+ * binary format of tracefmt.h written by the mtrace recorder. Binary
+ * traces are memory-mapped and decoded in a single pass; their events
+ * are put in time order across threads and the recorded addresses are
+ * renumbered into dense block ids.
+ */
+#include "trace.h"
+#include "tracefmt.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* One decoded event of a binary trace */
+typedef struct {
+    uint64_t ticks;     /* time stamp of the event */
+    uint64_t seq;       /* position in the file, to keep sorting stable */
+    uint8_t op;         /* enum trace_record */
+    size_t size;
+    uintptr_t addr;     /* block address (old address for realloc) */
+    uintptr_t newaddr;  /* new address for realloc */
+} event_t;
+
+/* Open-addressing table mapping live addresses to block ids */
+typedef struct {
+    uintptr_t* keys; /* 0 marks an empty slot */
+    int* ids;
+    size_t mask;
+} addrmap_t;
+
+static trace_t* read_binary_trace(const char* filename, const uint8_t* buf, size_t len);
+
+/*
+ * read_trace - read a trace file and return it, or exit on malformed input
+ */
+trace_t* read_trace(const char* filename) {
+    FILE* fp;
+    trace_t* trace;
+    char type[2];
+    int index, op_index, sugg_heapsize;
+    size_t size;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        fprintf(stderr, "Could not open %s in read_trace\n", filename);
+        exit(1);
+    }
+
+    /* binary traces start with the magic string */
+    char magic[TRACE_MAGIC_LEN];
+    if (fread(magic, 1, TRACE_MAGIC_LEN, fp) == TRACE_MAGIC_LEN &&
+        memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0) {
+        struct stat st;
+        void* buf;
+        if (fstat(fileno(fp), &st) < 0 ||
+            (buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0)) == MAP_FAILED) {
+            fprintf(stderr, "Could not map %s in read_trace\n", filename);
+            exit(1);
+        }
+        madvise(buf, st.st_size, MADV_SEQUENTIAL);
+        trace = read_binary_trace(filename, buf, st.st_size);
+        munmap(buf, st.st_size);
+        fclose(fp);
+        return trace;
+    }
+    rewind(fp);
+    if ((trace = malloc(sizeof(trace_t))) == NULL) {
+        fprintf(stderr, "malloc failed in read_trace\n");
+        exit(1);
+    }
+
+    /* read the trace header */
+    if (fscanf(fp, "%d", &sugg_heapsize) != 1 ||
+        fscanf(fp, "%d", &trace->num_ids) != 1 ||
+        fscanf(fp, "%d", &trace->num_ops) != 1 ||
+        fscanf(fp, "%d", &trace->weight) != 1 ||
+        trace->num_ids < 0 || trace->num_ops < 0) {
+        fprintf(stderr, "Bad header in %s\n", filename);
+        exit(1);
+    }
+
+    if ((trace->ops = malloc(trace->num_ops * sizeof(traceop_t) + 1)) == NULL) {
+        fprintf(stderr, "malloc failed in read_trace\n");
+        exit(1);
+    }
+
+    /* read every request in the trace file */
+    op_index = 0;
+    while (fscanf(fp, "%1s", type) == 1) {
+        if (op_index == trace->num_ops) {
+            fprintf(stderr, "%s has more than %d requests\n", filename, trace->num_ops);
+            exit(1);
+        }
+        switch (type[0]) {
+        case 'a':
+        case 'r':
+            if (fscanf(fp, "%d %zu", &index, &size) != 2)
+                goto bad;
+            trace->ops[op_index].type = (type[0] == 'a') ? ALLOC : REALLOC;
+            trace->ops[op_index].size = size;
+            break;
+        case 'f':
+            if (fscanf(fp, "%d", &index) != 1)
+                goto bad;
+            trace->ops[op_index].type = FREE;
+            trace->ops[op_index].size = 0;
+            break;
+        default:
+            goto bad;
+        }
+        if (index < 0 || index >= trace->num_ids)
+            goto bad;
+        trace->ops[op_index].index = index;
+        op_index++;
+    }
+    fclose(fp);
+    if (op_index != trace->num_ops) {
+        fprintf(stderr, "%s has %d requests, header says %d\n", filename, op_index, trace->num_ops);
+        exit(1);
+    }
+    return trace;
+
+bad:
+    fprintf(stderr, "Bad request %d in %s\n", op_index, filename);
+    exit(1);
+}
+
+/*
+ * free_trace - free a trace returned by read_trace
+ */
+void free_trace(trace_t* trace) {
+    free(trace->ops);
+    free(trace);
+}
+
+/*
+ * addrmap_find - return the slot holding addr, or the empty slot where
+ *                it would go
+ */
+static size_t addrmap_find(addrmap_t* map, uintptr_t addr) {
+    size_t i = (addr * 0x9e3779b97f4a7c15ULL >> 17) & map->mask;
+    while (map->keys[i] != 0 && map->keys[i] != addr)
+        i = (i + 1) & map->mask;
+    return i;
+}
+
+/*
+ * addrmap_remove - delete the entry in slot i, shifting later entries of
+ *                  the same probe run back so lookups stay correct
+ */
+static void addrmap_remove(addrmap_t* map, size_t i) {
+    size_t j = i;
+    for (;;) {
+        map->keys[i] = 0;
+        for (;;) {
+            j = (j + 1) & map->mask;
+            if (map->keys[j] == 0)
+                return;
+            size_t home = (map->keys[j] * 0x9e3779b97f4a7c15ULL >> 17) & map->mask;
+            /* move j into the hole unless its home lies cyclically in (i, j] */
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+                continue;
+            break;
+        }
+        map->keys[i] = map->keys[j];
+        map->ids[i] = map->ids[j];
+        i = j;
+    }
+}
+
+static int compare_events(const void* a, const void* b) {
+    const event_t* x = a;
+    const event_t* y = b;
+    if (x->ticks != y->ticks)
+        return x->ticks < y->ticks ? -1 : 1;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+/*
+ * read_binary_trace - decode a binary trace held in buf
+ *
+ * Addresses the trace frees without having allocated (blocks from
+ * before recording started, or from memalign and friends) are skipped,
+ * and zero-byte requests are replayed as one-byte requests.
+ */
+static trace_t* read_binary_trace(const char* filename, const uint8_t* buf, size_t len) {
+    const uint8_t* p = buf + TRACE_MAGIC_LEN;
+    const uint8_t* end = buf + len;
+    event_t* events = NULL;
+    size_t num_events = 0, max_events = 0;
+    uint64_t tid, v;
+    trace_t* trace;
+
+    /* decode every chunk into the events array */
+    while (p < end) {
+        if ((p = get_varint(p, end, &tid)) == NULL)
+            goto bad;
+        if (tid == 0) { /* clock chunk */
+            if ((p = get_varint(p, end, &v)) == NULL || (p = get_varint(p, end, &v)) == NULL)
+                goto bad;
+            continue;
+        }
+
+        uint64_t ticks, nbytes;
+        if ((p = get_varint(p, end, &ticks)) == NULL ||
+            (p = get_varint(p, end, &nbytes)) == NULL || nbytes > (uint64_t)(end - p))
+            goto bad;
+        const uint8_t* cend = p + nbytes;
+        uintptr_t last_addr = 0;
+        while (p < cend) {
+            if (num_events == max_events) {
+                max_events = max_events ? 2 * max_events : 4096;
+                if ((events = realloc(events, max_events * sizeof(event_t))) == NULL) {
+                    fprintf(stderr, "realloc failed in read_binary_trace\n");
+                    exit(1);
+                }
+            }
+            event_t* e = &events[num_events];
+            e->op = *p++;
+            e->seq = num_events;
+            e->size = 0;
+            e->newaddr = 0;
+            if (e->op > TR_CALLOC || (p = get_varint(p, cend, &v)) == NULL)
+                goto bad;
+            ticks += v;
+            e->ticks = ticks;
+            if (e->op != TR_FREE) {
+                if ((p = get_varint(p, cend, &v)) == NULL)
+                    goto bad;
+                e->size = v;
+            }
+            if ((p = get_varint(p, cend, &v)) == NULL)
+                goto bad;
+            last_addr += unzigzag(v);
+            e->addr = last_addr;
+            if (e->op == TR_REALLOC) {
+                if ((p = get_varint(p, cend, &v)) == NULL)
+                    goto bad;
+                last_addr += unzigzag(v);
+                e->newaddr = last_addr;
+            }
+            num_events++;
+        }
+    }
+
+    qsort(events, num_events, sizeof(event_t), compare_events);
+
+    /* turn addresses into block ids, reusing the ids of freed blocks */
+    addrmap_t map;
+    size_t slots = 16;
+    while (slots < 2 * num_events)
+        slots <<= 1;
+    map.mask = slots - 1;
+    map.keys = calloc(slots, sizeof(uintptr_t));
+    map.ids = malloc(slots * sizeof(int));
+    int* free_ids = malloc((num_events + 1) * sizeof(int));
+    trace = malloc(sizeof(trace_t));
+    if (map.keys == NULL || map.ids == NULL || free_ids == NULL || trace == NULL ||
+        (trace->ops = malloc((2 * num_events + 1) * sizeof(traceop_t))) == NULL) {
+        fprintf(stderr, "malloc failed in read_binary_trace\n");
+        exit(1);
+    }
+    int num_free_ids = 0;
+    trace->num_ids = 0;
+    trace->num_ops = 0;
+    trace->weight = 1;
+
+#define EMIT(t, i, s)                                   \
+    do {                                                \
+        traceop_t* op = &trace->ops[trace->num_ops++]; \
+        op->type = (t);                                 \
+        op->index = (i);                                \
+        op->size = (s);                                 \
+    } while (0)
+
+    for (size_t n = 0; n < num_events; n++) {
+        event_t* e = &events[n];
+        uintptr_t addr = e->addr;
+        size_t slot;
+
+        if (e->op == TR_REALLOC && addr != 0 && e->newaddr != 0) {
+            /* resize: the block keeps its id under its new address */
+            slot = addrmap_find(&map, addr);
+            if (map.keys[slot] != 0) {
+                int id = map.ids[slot];
+                addrmap_remove(&map, slot);
+                EMIT(REALLOC, id, e->size ? e->size : 1);
+                slot = addrmap_find(&map, e->newaddr);
+                if (map.keys[slot] != 0) {
+                    /* the new address is still live: it was freed out of sight */
+                    EMIT(FREE, map.ids[slot], 0);
+                    free_ids[num_free_ids++] = map.ids[slot];
+                    addrmap_remove(&map, slot);
+                    slot = addrmap_find(&map, e->newaddr);
+                }
+                map.keys[slot] = e->newaddr;
+                map.ids[slot] = id;
+                continue;
+            }
+            /* unknown old block: replay as a fresh allocation */
+            addr = e->newaddr;
+        }
+        else if (e->op == TR_REALLOC && addr == 0) {
+            addr = e->newaddr; /* realloc(NULL, size) allocates */
+        }
+        else if (e->op == TR_REALLOC || e->op == TR_FREE) {
+            /* free, or realloc(ptr, 0) which frees */
+            slot = addrmap_find(&map, addr);
+            if (map.keys[slot] != 0) {
+                EMIT(FREE, map.ids[slot], 0);
+                free_ids[num_free_ids++] = map.ids[slot];
+                addrmap_remove(&map, slot);
+            }
+            continue;
+        }
+
+        /* an allocation; an address that is still live was freed out of sight */
+        slot = addrmap_find(&map, addr);
+        if (map.keys[slot] != 0) {
+            EMIT(FREE, map.ids[slot], 0);
+            free_ids[num_free_ids++] = map.ids[slot];
+            addrmap_remove(&map, slot);
+            slot = addrmap_find(&map, addr);
+        }
+        int id = num_free_ids > 0 ? free_ids[--num_free_ids] : trace->num_ids++;
+        map.keys[slot] = addr;
+        map.ids[slot] = id;
+        EMIT(ALLOC, id, e->size ? e->size : 1);
+    }
+#undef EMIT
+
+    free(map.keys);
+    free(map.ids);
+    free(free_ids);
+    free(events);
+    return trace;
+
+bad:
+    fprintf(stderr, "Corrupt binary trace %s after %zu events\n", filename, num_events);
+    exit(1);
+}
@@ -0,0 +1,42 @@
+/*
+ * trace.h - Allocation traces shared by the driver and the benchmark tools
+ *
+ * A trace is a sequence of requests on numbered blocks. The text format
+ * starts with a four line header followed by one request per line:
+ *
+ *      <suggested heap size>   (ignored)
+ *      <number of block ids>
+ *      <number of requests>
+ *      <weight>                (ignored)
+ *      a <id> <size>           allocate block id with size bytes
+ *      r <id> <size>           reallocate block id to size bytes
+ *      f <id>                  free block id
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+
+enum traceop_type {
+    ALLOC,
+    FREE,
+    REALLOC
+};
+
+typedef struct {
+    enum traceop_type type; /* type of request */
+    int index;              /* id of the block the request refers to */
+    size_t size;            /* byte size of alloc/realloc requests */
+} traceop_t;
+
+typedef struct {
+    int num_ids;     /* number of distinct block ids */
+    int num_ops;     /* number of requests */
+    int weight;      /* weight of the trace (unused) */
+    traceop_t* ops;  /* array of requests */
+} trace_t;
+
+trace_t* read_trace(const char* filename);
+void free_trace(trace_t* trace);
+
+#endif /* TRACE_H */
@@ -0,0 +1,75 @@
+/*
+ * tracefmt.h - Compact binary trace format written by the recorder
+ *
+ * A binary trace is the magic string followed by a sequence of chunks.
+ * Every integer is an unsigned LEB128 varint; addresses are stored as
+ * zigzag-encoded deltas from the previous address in the same chunk.
+ *
+ *      clock chunk:  0 <ticks> <ns>
+ *      event chunk:  <tid> <start ticks> <nbytes> <nbytes of records>
+ *
+ * Clock chunks pair a tick count with CLOCK_MONOTONIC nanoseconds so
+ * readers can convert ticks to time. Each record in an event chunk is
+ *
+ *      TR_MALLOC  <dticks> <size> <daddr>
+ *      TR_CALLOC  <dticks> <size> <daddr>
+ *      TR_FREE    <dticks> <daddr>
+ *      TR_REALLOC <dticks> <size> <dold> <dnew>
+ *
+ * where dticks is the time since the previous record of the chunk (the
+ * first record is relative to the chunk start).
+ */
+#ifndef TRACEFMT_H
+#define TRACEFMT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC "MMTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+enum trace_record {
+    TR_MALLOC,
+    TR_FREE,
+    TR_REALLOC,
+    TR_CALLOC
+};
+
+/* Largest encoded record: an op byte and four 10-byte varints */
+#define TR_RECORD_MAX 41
+
+static inline uint8_t* put_varint(uint8_t* p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+/* get_varint - decode a varint, returning NULL if it runs past end */
+static inline const uint8_t* get_varint(const uint8_t* p, const uint8_t* end, uint64_t* v) {
+    uint64_t result = 0;
+    int shift = 0;
+
+    while (p < end && shift < 64) {
+        uint8_t byte = *p++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *v = result;
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+static inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+#endif /* TRACEFMT_H */
@@ -0,0 +1,467 @@
+/*
+ * tracegen.c - Synthetic workloads calibrated from captured traces
+ *
+ *     tracegen fit app.bin -o app.model
+ *     tracegen gen app.model -n 10000000 -s 7 -o synthetic.rep
+ *
+ * "fit" reads a trace (text or binary) and writes a statistical model of
+ * it: the request size distribution, the lifetime distribution of blocks
+ * conditioned on their size class (lifetimes are counted in requests,
+ * blocks never freed are "immortal"), and how often and by what ratio
+ * blocks are reallocated (growth is capped at the largest size seen).
+ * The model is a small text file that can be shared where the trace
+ * itself cannot.
+ *
+ * "gen" draws a trace of any length from a model. The same model and
+ * seed always produce the same trace, written in the text format the
+ * driver and benchmarks read.
+ */
+#include "hist.h"
+#include "rng.h"
+#include "trace.h"
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MODEL_MAGIC "tracegen-model 1"
+#define NUM_CLASSES 8        /* size classes lifetimes are conditioned on */
+#define RATIO_STEPS 4        /* realloc ratio buckets per doubling */
+#define RATIO_MAX 32         /* ratios from 2^-8 to 2^8 */
+#define NUM_RATIOS (2 * RATIO_MAX + 1)
+#define DEFAULT_OPS 1000000
+
+/* upper bounds of the size classes; the last one is open */
+static const size_t class_limits[NUM_CLASSES - 1] = {
+    64, 256, 1024, 4096, 16384, 65536, 262144
+};
+
+typedef struct {
+    hist_t sizes;                     /* allocation sizes */
+    hist_t lifetimes[NUM_CLASSES];    /* requests from allocation to free */
+    uint64_t immortal[NUM_CLASSES];   /* blocks of each class never freed */
+    uint64_t ratios[NUM_RATIOS];      /* realloc new/old size, log2 in quarter steps */
+    uint64_t allocs, reallocs, frees;
+    size_t max_size;                  /* largest size requested, caps realloc growth */
+} model_t;
+
+/* A histogram prepared for sampling */
+typedef struct {
+    int n;            /* nonempty buckets */
+    int* index;       /* their bucket indices */
+    uint64_t* cum;    /* cumulative counts */
+} sampler_t;
+
+static int size_class(size_t size) {
+    int c = 0;
+    while (c < NUM_CLASSES - 1 && size > class_limits[c])
+        c++;
+    return c;
+}
+
+static void* xcalloc(size_t n, size_t size) {
+    void* p = calloc(n, size);
+    if (p == NULL) {
+        fprintf(stderr, "calloc failed\n");
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * Fitting
+ */
+
+static void fit(trace_t* trace, model_t* m) {
+    int* born = xcalloc(trace->num_ids, sizeof(int));
+    size_t* size = xcalloc(trace->num_ids, sizeof(size_t));
+    bool* live = xcalloc(trace->num_ids, sizeof(bool));
+    int i;
+
+    for (i = 0; i < trace->num_ops; i++) {
+        traceop_t* op = &trace->ops[i];
+        int id = op->index;
+        switch (op->type) {
+        case ALLOC:
+            hist_record(&m->sizes, op->size);
+            if (op->size > m->max_size)
+                m->max_size = op->size;
+            born[id] = i;
+            size[id] = op->size;
+            live[id] = true;
+            m->allocs++;
+            break;
+        case REALLOC:
+            if (live[id] && size[id] > 0) {
+                double r = log2((double)op->size / size[id]);
+                int b = (int)lround(r * RATIO_STEPS);
+                b = b < -RATIO_MAX ? -RATIO_MAX : (b > RATIO_MAX ? RATIO_MAX : b);
+                m->ratios[b + RATIO_MAX]++;
+                size[id] = op->size;
+                if (op->size > m->max_size)
+                    m->max_size = op->size;
+                m->reallocs++;
+            }
+            break;
+        case FREE:
+            if (live[id]) {
+                hist_record(&m->lifetimes[size_class(size[id])], i - born[id]);
+                live[id] = false;
+                m->frees++;
+            }
+            break;
+        }
+    }
+    for (i = 0; i < trace->num_ids; i++)
+        if (live[i])
+            m->immortal[size_class(size[i])]++;
+    free(born);
+    free(size);
+    free(live);
+}
+
+static void write_hist(FILE* fp, const char* name, const hist_t* h) {
+    int n = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        n += h->counts[i] != 0;
+    fprintf(fp, "%s %d", name, n);
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        if (h->counts[i])
+            fprintf(fp, " %d:%lu", i, (unsigned long)h->counts[i]);
+    fprintf(fp, "\n");
+}
+
+static void write_model(FILE* fp, const model_t* m) {
+    fprintf(fp, "%s\n", MODEL_MAGIC);
+    fprintf(fp, "requests %lu %lu %lu\n", (unsigned long)m->allocs, (unsigned long)m->reallocs,
+        (unsigned long)m->frees);
+    fprintf(fp, "maxsize %zu\n", m->max_size);
+    write_hist(fp, "sizes", &m->sizes);
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        char name[32];
+        snprintf(name, sizeof(name), "lifetimes%d", c);
+        fprintf(fp, "immortal%d %lu\n", c, (unsigned long)m->immortal[c]);
+        write_hist(fp, name, &m->lifetimes[c]);
+    }
+    fprintf(fp, "ratios");
+    for (int i = 0; i < NUM_RATIOS; i++)
+        fprintf(fp, " %lu", (unsigned long)m->ratios[i]);
+    fprintf(fp, "\n");
+}
+
+/*
+ * Generation
+ */
+
+static void read_hist(FILE* fp, const char* name, hist_t* h) {
+    char word[32];
+    int n, idx;
+    unsigned long count;
+
+    if (fscanf(fp, "%31s %d", word, &n) != 2 || strcmp(word, name) != 0)
+        goto bad;
+    for (int i = 0; i < n; i++) {
+        if (fscanf(fp, " %d:%lu", &idx, &count) != 2 || idx < 0 || idx >= HIST_BUCKETS)
+            goto bad;
+        h->counts[idx] = count;
+        h->total += count;
+    }
+    return;
+bad:
+    fprintf(stderr, "Bad model: expected %s\n", name);
+    exit(1);
+}
+
+static void read_model(const char* path, model_t* m) {
+    FILE* fp = fopen(path, "r");
+    char line[64], name[32], word[32];
+    unsigned long a, r, f;
+
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        exit(1);
+    }
+    if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, MODEL_MAGIC, strlen(MODEL_MAGIC)) != 0 ||
+        fscanf(fp, "%31s %lu %lu %lu", word, &a, &r, &f) != 4) {
+        fprintf(stderr, "%s is not a tracegen model\n", path);
+        exit(1);
+    }
+    m->allocs = a;
+    m->reallocs = r;
+    m->frees = f;
+    if (fscanf(fp, "%31s %zu", word, &m->max_size) != 2 || strcmp(word, "maxsize") != 0) {
+        fprintf(stderr, "Bad model: expected maxsize\n");
+        exit(1);
+    }
+    read_hist(fp, "sizes", &m->sizes);
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        unsigned long k;
+        snprintf(name, sizeof(name), "immortal%d", c);
+        if (fscanf(fp, "%31s %lu", word, &k) != 2 || strcmp(word, name) != 0) {
+            fprintf(stderr, "Bad model: expected %s\n", name);
+            exit(1);
+        }
+        m->immortal[c] = k;
+        snprintf(name, sizeof(name), "lifetimes%d", c);
+        read_hist(fp, name, &m->lifetimes[c]);
+    }
+    if (fscanf(fp, "%31s", word) != 1 || strcmp(word, "ratios") != 0) {
+        fprintf(stderr, "Bad model: expected ratios\n");
+        exit(1);
+    }
+    for (int i = 0; i < NUM_RATIOS; i++) {
+        unsigned long k;
+        if (fscanf(fp, "%lu", &k) != 1) {
+            fprintf(stderr, "Bad model: short ratios\n");
+            exit(1);
+        }
+        m->ratios[i] = k;
+    }
+    fclose(fp);
+    if (m->sizes.total == 0) {
+        fprintf(stderr, "Model %s has no allocations\n", path);
+        exit(1);
+    }
+}
+
+static void make_sampler(sampler_t* s, const hist_t* h) {
+    uint64_t sum = 0;
+    s->n = 0;
+    s->index = xcalloc(HIST_BUCKETS, sizeof(int));
+    s->cum = xcalloc(HIST_BUCKETS, sizeof(uint64_t));
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (h->counts[i] == 0)
+            continue;
+        sum += h->counts[i];
+        s->index[s->n] = i;
+        s->cum[s->n++] = sum;
+    }
+}
+
+/* sample - a value from the histogram, uniform within the chosen bucket */
+static uint64_t sample(const sampler_t* s, rng_t* r) {
+    uint64_t x = rng_next(r) % s->cum[s->n - 1];
+    int lo = 0, hi = s->n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (s->cum[mid] > x)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    int b = s->index[lo];
+    uint64_t low = b == 0 ? 0 : hist_bucket_high(b - 1) + 1;
+    return rng_range(r, low, hist_bucket_high(b));
+}
+
+/* A live block of the generated trace, ordered by death */
+typedef struct {
+    uint64_t death; /* request index it is freed at, UINT64_MAX if never */
+    int id;
+} pending_t;
+
+/* State of one generation pass */
+typedef struct {
+    pending_t* heap;  /* min-heap of live blocks by death */
+    int nheap;
+    int* free_ids;    /* ids of freed blocks, reused first */
+    int nfree;
+    int num_ids;
+    size_t* sizes;    /* current size of each id */
+    int* live;        /* live ids, for picking realloc victims */
+    int* pos;         /* position of each id in live */
+    int nlive;
+    int cap;
+} gen_t;
+
+static void gen_grow(gen_t* g) {
+    int cap = g->cap ? 2 * g->cap : 4096;
+    if ((g->heap = realloc(g->heap, cap * sizeof(pending_t))) == NULL ||
+        (g->free_ids = realloc(g->free_ids, cap * sizeof(int))) == NULL ||
+        (g->sizes = realloc(g->sizes, cap * sizeof(size_t))) == NULL ||
+        (g->live = realloc(g->live, cap * sizeof(int))) == NULL ||
+        (g->pos = realloc(g->pos, cap * sizeof(int))) == NULL) {
+        fprintf(stderr, "realloc failed in gen_grow\n");
+        exit(1);
+    }
+    g->cap = cap;
+}
+
+static void heap_push(gen_t* g, pending_t p) {
+    int i;
+    for (i = g->nheap++; i > 0 && g->heap[(i - 1) / 2].death > p.death; i = (i - 1) / 2)
+        g->heap[i] = g->heap[(i - 1) / 2];
+    g->heap[i] = p;
+}
+
+static pending_t heap_pop(gen_t* g) {
+    pending_t top = g->heap[0], last = g->heap[--g->nheap];
+    int i = 0, child;
+    while ((child = 2 * i + 1) < g->nheap) {
+        if (child + 1 < g->nheap && g->heap[child + 1].death < g->heap[child].death)
+            child++;
+        if (last.death <= g->heap[child].death)
+            break;
+        g->heap[i] = g->heap[child];
+        i = child;
+    }
+    g->heap[i] = last;
+    return top;
+}
+
+/*
+ * generate - draw nops requests from the model. With out == NULL only
+ *            counts the block ids the trace needs.
+ */
+static int generate(const model_t* m, uint64_t seed, long nops, FILE* out) {
+    sampler_t sizes, lifetimes[NUM_CLASSES];
+    uint64_t ratio_total = 0;
+    double p_realloc, p_immortal[NUM_CLASSES];
+    gen_t g;
+    rng_t r;
+    long n = 0;
+
+    memset(&g, 0, sizeof(g));
+    rng_seed(&r, seed);
+    make_sampler(&sizes, &m->sizes);
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        uint64_t total = m->lifetimes[c].total + m->immortal[c];
+        make_sampler(&lifetimes[c], &m->lifetimes[c]);
+        p_immortal[c] = total ? (double)m->immortal[c] / total : 0;
+        if (m->lifetimes[c].total == 0)
+            p_immortal[c] = 1; /* no observed frees in this class */
+    }
+    for (int i = 0; i < NUM_RATIOS; i++)
+        ratio_total += m->ratios[i];
+    p_realloc = ratio_total ? (double)m->reallocs / (m->allocs + m->reallocs) : 0;
+
+    while (n < nops) {
+        /* free every block whose lifetime has run out */
+        if (g.nheap > 0 && g.heap[0].death <= (uint64_t)n) {
+            pending_t p = heap_pop(&g);
+            int last = g.live[--g.nlive];
+            g.live[g.pos[p.id]] = last;
+            g.pos[last] = g.pos[p.id];
+            g.free_ids[g.nfree++] = p.id;
+            if (out != NULL)
+                fprintf(out, "f %d\n", p.id);
+            n++;
+            continue;
+        }
+
+        if (g.nlive > 0 && rng_double(&r) < p_realloc) {
+            /* resize a random live block by a ratio drawn from the model */
+            int id = g.live[rng_next(&r) % g.nlive];
+            uint64_t x = rng_next(&r) % ratio_total;
+            int b = 0;
+            while (x >= m->ratios[b])
+                x -= m->ratios[b++];
+            /* repeated ratios are a random walk; keep it within the observed sizes */
+            double size = g.sizes[id] * exp2((double)(b - RATIO_MAX) / RATIO_STEPS);
+            g.sizes[id] = size < 1 ? 1 : (size > m->max_size ? m->max_size : (size_t)size);
+            if (out != NULL)
+                fprintf(out, "r %d %zu\n", id, g.sizes[id]);
+            n++;
+            continue;
+        }
+
+        /* allocate a new block */
+        if (g.nlive == g.cap)
+            gen_grow(&g);
+        size_t size = sample(&sizes, &r);
+        int c = size_class(size);
+        pending_t p;
+        p.id = g.nfree > 0 ? g.free_ids[--g.nfree] : g.num_ids++;
+        if (rng_double(&r) < p_immortal[c])
+            p.death = UINT64_MAX;
+        else
+            p.death = n + 1 + sample(&lifetimes[c], &r);
+        g.sizes[p.id] = size ? size : 1;
+        g.pos[p.id] = g.nlive;
+        g.live[g.nlive++] = p.id;
+        heap_push(&g, p);
+        if (out != NULL)
+            fprintf(out, "a %d %zu\n", p.id, g.sizes[p.id]);
+        n++;
+    }
+
+    free(sizes.index);
+    free(sizes.cum);
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        free(lifetimes[c].index);
+        free(lifetimes[c].cum);
+    }
+    free(g.heap);
+    free(g.free_ids);
+    free(g.sizes);
+    free(g.live);
+    free(g.pos);
+    return g.num_ids;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: tracegen fit <trace> [-o <model>]\n");
+    fprintf(stderr, "       tracegen gen <model> [-n <requests>] [-s <seed>] [-o <trace>]\n");
+}
+
+int main(int argc, char** argv) {
+    const char* outpath = NULL;
+    long nops = DEFAULT_OPS;
+    uint64_t seed = 1;
+    FILE* out = stdout;
+    int c;
+
+    if (argc < 3 || (strcmp(argv[1], "fit") != 0 && strcmp(argv[1], "gen") != 0)) {
+        usage();
+        exit(1);
+    }
+    const char* cmd = argv[1];
+    const char* input = argv[2];
+    optind = 3;
+    while ((c = getopt(argc, argv, "n:o:s:")) != EOF) {
+        switch (c) {
+        case 'n':
+            nops = (long)strtod(optarg, NULL);
+            break;
+        case 'o':
+            outpath = optarg;
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (nops < 1 || nops > INT_MAX) {
+        fprintf(stderr, "The number of requests must be between 1 and %d\n", INT_MAX);
+        exit(1);
+    }
+    if (outpath != NULL && (out = fopen(outpath, "w")) == NULL) {
+        fprintf(stderr, "Could not open %s\n", outpath);
+        exit(1);
+    }
+
+    model_t* m = xcalloc(1, sizeof(model_t));
+    if (strcmp(cmd, "fit") == 0) {
+        trace_t* trace = read_trace(input);
+        fit(trace, m);
+        write_model(out, m);
+        free_trace(trace);
+    }
+    else {
+        read_model(input, m);
+        /* a dry run sizes the header, the second run writes the requests */
+        int num_ids = generate(m, seed, nops, NULL);
+        fprintf(out, "0\n%d\n%ld\n1\n", num_ids, nops);
+        generate(m, seed, nops, out);
+    }
+    if (out != stdout)
+        fclose(out);
+    free(m);
+    return 0;
+}
@@ -0,0 +1,303 @@
+/*
+ * whatif.c - Replay one trace against many allocator configurations
+ *
+ *     whatif -f app.bin -c fit=best,split=64,chunk=16K -c fit=next ...
+ *
+ * Each configuration (placement policy, split threshold and heap growth
+ * step, see struct mm_config) replays the trace in its own worker, up
+ * to -j at a time, and the results come back as one comparison table
+ * of throughput, peak utilization and peak heap footprint. Without -c a
+ * grid of the three policies, two split thresholds and two growth steps
+ * is compared.
+ *
+ * Workers are forked processes rather than threads: mm.c and memlib keep
+ * their heap in file-scope state, so every configuration needs an address
+ * space of its own to get an independent simulated heap.
+ */
+#include "memlib.h"
+#include "mm.h"
+#include "timer.h"
+#include "trace.h"
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_CONFIGS 64
+#define DEFAULT_REPS 3
+
+/* What a worker reports back through its pipe */
+typedef struct {
+    bool valid;       /* trace replayed without running out of memory */
+    double secs;      /* fastest timed replay */
+    double util;      /* peak live bytes / heap size */
+    size_t footprint; /* peak heap size in bytes */
+} result_t;
+
+/* One configuration and the worker evaluating it */
+typedef struct {
+    char label[64];
+    struct mm_config config;
+    pid_t pid;
+    int fd; /* read end of the worker's pipe */
+    result_t result;
+} job_t;
+
+static const char* fit_names[] = { "first", "next", "best" };
+
+static size_t parse_size(const char* s) {
+    char* end;
+    size_t v = strtoul(s, &end, 0);
+    if (*end == 'K' || *end == 'k')
+        v <<= 10;
+    else if (*end == 'M' || *end == 'm')
+        v <<= 20;
+    return v;
+}
+
+/*
+ * parse_config - parse "fit=<policy>,split=<bytes>,chunk=<bytes>"; keys
+ *                that are left out keep the mm.c defaults
+ */
+static void parse_config(const char* spec, job_t* job) {
+    char buf[256], * tok, * save;
+
+    job->config.fit = MM_FIRST_FIT;
+    job->config.split_min = 32;
+    job->config.chunksize = 1 << 16;
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        char* val = strchr(tok, '=');
+        if (val == NULL)
+            goto bad;
+        *val++ = '\0';
+        if (strcmp(tok, "fit") == 0) {
+            int i;
+            for (i = 0; i < 3 && strcmp(val, fit_names[i]) != 0; i++)
+                ;
+            if (i == 3)
+                goto bad;
+            job->config.fit = i;
+        }
+        else if (strcmp(tok, "split") == 0) {
+            job->config.split_min = parse_size(val);
+        }
+        else if (strcmp(tok, "chunk") == 0) {
+            job->config.chunksize = parse_size(val);
+        }
+        else {
+            goto bad;
+        }
+    }
+    snprintf(job->label, sizeof(job->label), "fit=%s,split=%zu,chunk=%zu",
+        fit_names[job->config.fit], job->config.split_min, job->config.chunksize);
+    return;
+bad:
+    fprintf(stderr, "Bad configuration %s\n", spec);
+    exit(1);
+}
+
+/*
+ * replay - replay the trace once; if peak is not NULL also track the
+ *          peak live bytes in peak and the peak heap size in peak_heap.
+ *          Returns false if the allocator ran out.
+ */
+static bool replay(trace_t* trace, char** blocks, size_t* sizes, size_t* peak, size_t* peak_heap) {
+    size_t live = 0;
+    struct mm_stats st;
+
+    for (int i = 0; i < trace->num_ops; i++) {
+        traceop_t* op = &trace->ops[i];
+        switch (op->type) {
+        case ALLOC:
+        case REALLOC:
+            blocks[op->index] = (op->type == ALLOC)
+                ? mm_malloc(op->size)
+                : mm_realloc(blocks[op->index], op->size);
+            if (blocks[op->index] == NULL)
+                return false;
+            if (peak != NULL) {
+                live += op->size - sizes[op->index];
+                sizes[op->index] = op->size;
+                if (live > *peak)
+                    *peak = live;
+                /* mapped segments are given back, so the heap can shrink */
+                mm_stats(&st);
+                if (st.heap_size > *peak_heap)
+                    *peak_heap = st.heap_size;
+            }
+            break;
+        case FREE:
+            mm_free(blocks[op->index]);
+            blocks[op->index] = NULL;
+            if (peak != NULL) {
+                live -= sizes[op->index];
+                sizes[op->index] = 0;
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+/*
+ * evaluate - body of a worker: measure one configuration
+ */
+static result_t evaluate(trace_t* trace, const struct mm_config* config, int reps) {
+    result_t res = { false, 0, 0, 0 };
+    char** blocks = calloc(trace->num_ids, sizeof(char*));
+    size_t* sizes = calloc(trace->num_ids, sizeof(size_t));
+    size_t peak = 0, peak_heap = 0;
+
+    if (blocks == NULL || sizes == NULL || mm_configure(config) < 0)
+        return res;
+    mem_init();
+
+    /* untimed pass for utilization and footprint */
+    if (mm_init() < 0 || !replay(trace, blocks, sizes, &peak, &peak_heap))
+        return res;
+    res.footprint = peak_heap;
+    res.util = res.footprint ? (double)peak / res.footprint : 0;
+
+    for (int r = 0; r < reps; r++) {
+        mem_reset_brk();
+        mm_init();
+        uint64_t start = now_ns();
+        replay(trace, blocks, NULL, NULL, NULL);
+        double secs = (now_ns() - start) / 1e9;
+        if (r == 0 || secs < res.secs)
+            res.secs = secs;
+    }
+    res.valid = true;
+    return res;
+}
+
+static void start_job(job_t* job, trace_t* trace, int reps) {
+    int fds[2];
+
+    if (pipe(fds) < 0 || (job->pid = fork()) < 0) {
+        fprintf(stderr, "Could not start a worker\n");
+        exit(1);
+    }
+    if (job->pid == 0) {
+        close(fds[0]);
+        result_t res = evaluate(trace, &job->config, reps);
+        if (write(fds[1], &res, sizeof(res)) != sizeof(res))
+            _exit(1);
+        _exit(0);
+    }
+    close(fds[1]);
+    job->fd = fds[0];
+}
+
+static void finish_job(job_t* job) {
+    if (read(job->fd, &job->result, sizeof(result_t)) != sizeof(result_t))
+        job->result.valid = false; /* the worker crashed */
+    close(job->fd);
+    waitpid(job->pid, NULL, 0);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: whatif [-h] -f <trace> [-c <config>]... [-j <jobs>] [-r <reps>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-c <cfg>   Add a configuration fit=first|next|best,split=<n>,chunk=<n>.\n");
+    fprintf(stderr, "\t-f <file>  Trace to replay (text or binary).\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Configurations evaluated at once (default: online CPUs).\n");
+    fprintf(stderr, "\t-r <n>     Timed replays per configuration (default %d).\n", DEFAULT_REPS);
+}
+
+int main(int argc, char** argv) {
+    static job_t jobs[MAX_CONFIGS];
+    const char* tracefile = NULL;
+    int c, njobs = 0, reps = DEFAULT_REPS;
+    long parallel = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((c = getopt(argc, argv, "c:f:hj:r:")) != EOF) {
+        switch (c) {
+        case 'c':
+            if (njobs == MAX_CONFIGS) {
+                fprintf(stderr, "At most %d configurations\n", MAX_CONFIGS);
+                exit(1);
+            }
+            parse_config(optarg, &jobs[njobs++]);
+            break;
+        case 'f':
+            tracefile = optarg;
+            break;
+        case 'j':
+            parallel = atol(optarg);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (tracefile == NULL || parallel < 1 || reps < 1) {
+        usage();
+        exit(1);
+    }
+
+    /* default grid: every policy with two split thresholds and growth steps */
+    if (njobs == 0) {
+        static const char* splits[] = { "32", "128" };
+        static const char* chunks[] = { "4K", "64K" };
+        char spec[128];
+        for (int f = 0; f < 3; f++)
+            for (int s = 0; s < 2; s++)
+                for (int k = 0; k < 2; k++) {
+                    snprintf(spec, sizeof(spec), "fit=%s,split=%s,chunk=%s", fit_names[f],
+                        splits[s], chunks[k]);
+                    parse_config(spec, &jobs[njobs++]);
+                }
+    }
+
+    trace_t* trace = read_trace(tracefile);
+    fflush(stdout);
+
+    /* keep up to parallel workers running, collecting them in order */
+    int started = 0;
+    for (int i = 0; i < njobs; i++) {
+        while (started < njobs && started - i < parallel)
+            start_job(&jobs[started++], trace, reps);
+        finish_job(&jobs[i]);
+    }
+
+    int best_thru = -1, best_util = -1, best_foot = -1;
+    for (int i = 0; i < njobs; i++) {
+        result_t* r = &jobs[i].result;
+        if (!r->valid)
+            continue;
+        if (best_thru < 0 || r->secs < jobs[best_thru].result.secs)
+            best_thru = i;
+        if (best_util < 0 || r->util > jobs[best_util].result.util)
+            best_util = i;
+        if (best_foot < 0 || r->footprint < jobs[best_foot].result.footprint)
+            best_foot = i;
+    }
+
+    printf("%s: %d requests\n", tracefile, trace->num_ops);
+    printf("%-40s %12s %9s %13s\n", "configuration", "Kops/sec", "util", "peak heap");
+    for (int i = 0; i < njobs; i++) {
+        result_t* r = &jobs[i].result;
+        if (!r->valid) {
+            printf("%-40s %12s %9s %13s\n", jobs[i].label, "failed", "-", "-");
+            continue;
+        }
+        printf("%-40s %11.0f%s %7.1f%%%s %12zu%s\n", jobs[i].label,
+            r->secs > 0 ? trace->num_ops / r->secs / 1e3 : 0, i == best_thru ? "*" : " ",
+            r->util * 100.0, i == best_util ? "*" : " ", r->footprint, i == best_foot ? "*" : " ");
+    }
+    printf("* best in column\n");
+    free_trace(trace);
+    return 0;
+}